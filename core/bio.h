@@ -3,16 +3,22 @@
 #include "error.h"
 #include "memory.h"
 #include "page.h"
+#include "page_vector.h"
 #include "kapi.h"
 #include "block_device_interface.h"
 #include "event.h"
 #include "list.h"
 #include "shared_ptr.h"
 #include "atomic.h"
+#include "vector.h"
+#include "block_plug.h"
+#include "bio_set.h"
 
 namespace Core
 {
 
+const size_t BioMaxPages = 256;
+
 template<Memory::PoolType PoolType = Memory::PoolType::Kernel>
 class Bio
 {
@@ -20,7 +26,7 @@ public:
     using Ptr = SharedPtr<Bio<PoolType>, PoolType>;
 
 public:
-    Bio(int pageCount, Error& err)
+    Bio(int pageCount, Error& err, BioSet* bioSet = nullptr)
         : BioPtr(nullptr)
         , PageCount(pageCount)
         , PostEndIoHandler(nullptr)
@@ -30,6 +36,7 @@ public:
         , Preflush(false)
         , Fua(false)
         , Sync(false)
+        , Polled(false)
         , Position(0)
     {
         if (!err.Ok())
@@ -43,7 +50,9 @@ public:
             return;
         }
 
-        BioPtr = get_kapi()->alloc_bio(pageCount, get_kapi_pool_type(PoolType));
+        //Bios from a set serve write-out and must not recurse into IO
+        BioPtr = (bioSet != nullptr) ? bioSet->AllocBio(pageCount, KAPI_POOL_TYPE_NOIO) :
+            get_kapi()->alloc_bio(pageCount, get_kapi_pool_type(PoolType));
         if (!BioPtr)
         {
             trace(0, "Can't allocate bio");
@@ -104,6 +113,64 @@ public:
         SetBdev(blockDevice);
     }
 
+    Bio(BlockDeviceInterface& blockDevice, Vector<typename Page<PoolType>::Ptr, PoolType>& pages,
+        unsigned long long sector, Error& err, bool write, BioSet* bioSet = nullptr)
+        : Bio(static_cast<int>(pages.GetSize()), err, bioSet)
+    {
+        if (!err.Ok())
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < pages.GetSize(); i++)
+        {
+            err = SetPage(static_cast<int>(i), pages[i], 0, pages[i]->GetSize());
+            if (!err.Ok())
+            {
+                return;
+            }
+        }
+
+        if (write)
+        {
+            SetWrite();
+        }
+        else
+        {
+            SetRead();
+        }
+        SetPosition(sector);
+        SetBdev(blockDevice);
+    }
+
+    Bio(BlockDeviceInterface& blockDevice, const typename PageVector<PoolType>::Ptr& pageVector,
+        size_t pageIndex, size_t pageCount, unsigned long long sector, Error& err, bool write,
+        BioSet* bioSet = nullptr)
+        : Bio(static_cast<int>(pageCount), err, bioSet)
+    {
+        if (!err.Ok())
+        {
+            return;
+        }
+
+        err = SetPageVector(pageVector, pageIndex, pageCount);
+        if (!err.Ok())
+        {
+            return;
+        }
+
+        if (write)
+        {
+            SetWrite();
+        }
+        else
+        {
+            SetRead();
+        }
+        SetPosition(sector);
+        SetBdev(blockDevice);
+    }
+
     void SetBdev(BlockDeviceInterface& blockDevice)
     {
         get_kapi()->set_bio_bdev(BioPtr, blockDevice.GetBdev());
@@ -139,6 +206,27 @@ public:
         Sync = true;
     }
 
+    //Completion is reaped by Wait() polling the device queue instead of an interrupt
+    void SetPolled()
+    {
+        Polled = true;
+    }
+
+    bool IsWrite() const
+    {
+        return Write;
+    }
+
+    bool IsCompleted()
+    {
+        return Completed.Get() != 0;
+    }
+
+    int Poll()
+    {
+        return get_kapi()->bio_poll(BioPtr);
+    }
+
     Error SetPage(int pageIndex, const typename Page<PoolType>::Ptr& page, size_t offset, size_t len)
     {
         if (!PageList.AddTail(page))
@@ -153,12 +241,47 @@ public:
         return Error(rc);
     }
 
+    Error SetPageVector(const typename PageVector<PoolType>::Ptr& pageVector, size_t pageIndex, size_t pageCount)
+    {
+        if (pageIndex + pageCount > pageVector->GetPageCount())
+            return MakeError(Error::Overflow);
+
+        if (!PageVectorList.AddTail(pageVector))
+            return MakeError(Error::NoMemory);
+
+        for (size_t i = 0; i < pageCount; i++)
+        {
+            int rc = get_kapi()->set_bio_page(BioPtr, static_cast<int>(i),
+                pageVector->GetPagePtr(pageIndex + i), 0, static_cast<int>(pageVector->GetPageSize()));
+            if (rc)
+            {
+                trace(0, "Can't set bio page vector index %lu, rc %d", pageIndex + i, rc);
+                return Error(rc);
+            }
+        }
+        return MakeError(Error::Success);
+    }
+
 
     void Wait()
     {
+        if (Polled)
+        {
+            while (!IsCompleted())
+            {
+                if (Poll() < 0)
+                    break;
+                get_kapi()->cond_resched();
+            }
+        }
         EndIoEvent.Wait();
     }
 
+    void SetPriority(int prioClass, int prioLevel)
+    {
+        get_kapi()->set_bio_prio(BioPtr, prioClass, prioLevel);
+    }
+
     void SetPosition(unsigned long long sector)
     {
         Position = sector;
@@ -167,14 +290,15 @@ public:
 
     void Submit()
     {
-        trace(4, "Bio 0x%p bio 0x%p submit pos %llu write %d flush %d fua %d sync %d",
-            this, BioPtr, Position, Write, Flush, Fua, Sync);
+        trace(4, "Bio 0x%p bio 0x%p submit pos %llu write %d flush %d fua %d sync %d polled %d",
+            this, BioPtr, Position, Write, Flush, Fua, Sync, Polled);
 
         get_kapi()->submit_bio(BioPtr,
             (Flush) ? KAPI_BIO_OP_FLUSH :
             ((Write) ? KAPI_BIO_OP_WRITE : KAPI_BIO_OP_READ),
             ((Fua) ? KAPI_BIO_REQ_FUA : 0) |
             ((Sync) ? KAPI_BIO_REQ_SYNC : 0) |
+            ((Polled) ? KAPI_BIO_REQ_POLLED : 0) |
             ((Preflush) ? KAPI_BIO_REQ_PREFLUSH : 0));
     }
 
@@ -219,6 +343,43 @@ public:
         return bio;
     }
 
+    static SharedPtr<Bio<PoolType>, PoolType> Create(BlockDeviceInterface& blockDevice,
+        const typename PageVector<PoolType>::Ptr& pageVector, size_t pageIndex, size_t pageCount,
+        unsigned long long sector, Error& err, bool write, BioSet* bioSet = nullptr)
+    {
+        SharedPtr<Bio<PoolType>, PoolType> bio =
+            MakeShared<Bio<PoolType>, PoolType>(blockDevice, pageVector, pageIndex, pageCount,
+                                                sector, err, write, bioSet);
+        if (bio.Get() == nullptr)
+        {
+            err = MakeError(Error::NoMemory);
+            return bio;
+        }
+
+        if (!err.Ok())
+            bio.Reset();
+
+        return bio;
+    }
+
+    static SharedPtr<Bio<PoolType>, PoolType> Create(BlockDeviceInterface& blockDevice,
+        Vector<typename Page<PoolType>::Ptr, PoolType>& pages, unsigned long long sector, Error& err,
+        bool write, BioSet* bioSet = nullptr)
+    {
+        SharedPtr<Bio<PoolType>, PoolType> bio =
+            MakeShared<Bio<PoolType>, PoolType>(blockDevice, pages, sector, err, write, bioSet);
+        if (bio.Get() == nullptr)
+        {
+            err = MakeError(Error::NoMemory);
+            return bio;
+        }
+
+        if (!err.Ok())
+            bio.Reset();
+
+        return bio;
+    }
+
     using PostEndIoHandlerType = void (*)(Bio<PoolType>* bio, void* ctx);
 
     void SetPostEndIoHandler(PostEndIoHandlerType handler, void* ctx)
@@ -237,6 +398,7 @@ private:
     {
         trace(4, "Bio 0x%p bio 0x%p endio err %d", this, BioPtr, err);
         Result.SetCode(err);
+        Completed.Set(1);
         EndIoEvent.SetAll();
 
         if (PostEndIoHandler != nullptr)
@@ -252,8 +414,10 @@ private:
     void* BioPtr;
     int PageCount;
     Event EndIoEvent;
+    Atomic Completed;
     Error Result;
     LinkedList<typename Page<PoolType>::Ptr, PoolType> PageList;
+    LinkedList<typename PageVector<PoolType>::Ptr, PoolType> PageVectorList;
     PostEndIoHandlerType PostEndIoHandler;
     void* PostEndIoCtx;
     bool Write;
@@ -261,6 +425,7 @@ private:
     bool Preflush;
     bool Fua;
     bool Sync;
+    bool Polled;
     unsigned long long Position;
 };
 
@@ -269,9 +434,24 @@ class BioList
 {
 public:
     using Ptr = SharedPtr<BioList<PoolType>, PoolType>;
+    using CompletionHandlerType = void (*)(BioList<PoolType>* bioList, void* ctx);
 public:
     BioList(BlockDeviceInterface& blockDevice)
         : BlockDev(blockDevice)
+        , BioPool(nullptr)
+        , MaxBioPages(0)
+        , PendingSector(0)
+        , PendingEndSector(0)
+        , PendingWrite(false)
+        , Sync(false)
+        , Polled(false)
+        , SubmitPolled(false)
+        , InFlight(false)
+        , SubmitCount(0)
+        , PrioClass(KAPI_BIO_PRIO_CLASS_NONE)
+        , PrioLevel(0)
+        , CompletionHandler(nullptr)
+        , CompletionCtx(nullptr)
     {
     }
 
@@ -299,10 +479,19 @@ public:
     Error AddIo(const typename Page<PoolType>::Ptr& page, unsigned long long position, bool write,
         size_t len = 0)
     {
-        if (position & 511)
+        if (!IsAligned(position))
             return MakeError(Error::InvalidValue);
 
-        Error err;
+        if (len == 0 || len == page->GetSize())
+            return AddPage(page, position / 512, write);
+
+        if (!IsAligned(len))
+            return MakeError(Error::InvalidValue);
+
+        auto err = FlushPending();
+        if (!err.Ok())
+            return err;
+
         auto bio = Bio<PoolType>::Create(BlockDev, page, position / 512, err, write, len);
         if (!err.Ok())
         {
@@ -317,19 +506,140 @@ public:
         return MakeError(Error::Success);
     }
 
+    Error AddIo(Vector<typename Page<PoolType>::Ptr, PoolType>& pages, unsigned long long position,
+        bool write)
+    {
+        if (!IsAligned(position))
+            return MakeError(Error::InvalidValue);
+
+        Error err;
+        unsigned long long sector = position / 512;
+        for (size_t i = 0; i < pages.GetSize(); i++)
+        {
+            err = AddPage(pages[i], sector, write);
+            if (!err.Ok())
+                return err;
+
+            sector += pages[i]->GetSize() / 512;
+        }
+
+        return err;
+    }
+
+    //Merged bios are allocated from the set
+    void SetBioSet(BioSet* bioSet)
+    {
+        BioPool = bioSet;
+    }
+
+    //Applied to every bio of the list on submit
+    void SetSync(bool sync)
+    {
+        Sync = sync;
+    }
+
+    //Only takes effect when the device has poll queues, applies to synchronous submission
+    void SetPolled(bool polled)
+    {
+        Polled = polled && get_kapi()->bdev_poll_capable(BlockDev.GetBdev());
+    }
+
+    void SetPriority(int prioClass, int prioLevel)
+    {
+        PrioClass = prioClass;
+        PrioLevel = prioLevel;
+    }
+
+    //Page vector is split into bios of at most the device limits
+    Error AddIo(const typename PageVector<PoolType>::Ptr& pageVector, unsigned long long position, bool write)
+    {
+        if (!IsAligned(position))
+            return MakeError(Error::InvalidValue);
+
+        auto err = FlushPending();
+        if (!err.Ok())
+            return err;
+
+        unsigned long long sector = position / 512;
+        size_t sectorsPerPage = pageVector->GetPageSize() / 512;
+        for (size_t i = 0; i < pageVector->GetPageCount();)
+        {
+            size_t count = Memory::Min<size_t>(pageVector->GetPageCount() - i, GetMaxBioPages());
+            auto bio = Bio<PoolType>::Create(BlockDev, pageVector, i, count, sector, err, write, BioPool);
+            if (!err.Ok())
+                return err;
+
+            if (!ReqList.AddTail(bio))
+                return MakeError(Error::NoMemory);
+
+            i += count;
+            sector += count * sectorsPerPage;
+        }
+
+        return MakeError(Error::Success);
+    }
+
+    size_t Count()
+    {
+        return ReqList.Count() + ((PendingPages.GetSize() != 0) ? 1 : 0);
+    }
+
+    void Reset()
+    {
+        ReqList.Clear();
+        ResetPending();
+        Result.Reset();
+    }
+
+    //Handler runs from bio end_io context and must not sleep, the list must stay
+    //alive until WaitResult() returns
+    Error SubmitAsync(CompletionHandlerType handler = nullptr, void* ctx = nullptr)
+    {
+        Result = FlushPending();
+        if (!Result.Ok())
+            return Result;
+
+        CompletionHandler = handler;
+        CompletionCtx = ctx;
+        if (ReqList.IsEmpty())
+        {
+            ReqCompleteCount.Set(0);
+            if (handler != nullptr)
+                handler(this, ctx);
+            return MakeError(Error::Success);
+        }
+
+        Submit(ReqList, ReqList.Count(), false);
+        return MakeError(Error::Success);
+    }
+
+    Error WaitResult()
+    {
+        Wait();
+        return GetResult();
+    }
+
     void SubmitWait(bool preflushFua = false)
     {
+        CompletionHandler = nullptr;
+        CompletionCtx = nullptr;
+
+        Result = FlushPending();
+        if (!Result.Ok())
+            return;
+
         if (ReqList.IsEmpty())
             return;
 
         if (!preflushFua)
         {
-            Submit(ReqList, ReqList.Count());
+            Submit(ReqList, ReqList.Count(), Polled);
             Wait();
             return;
         }
 
         auto lastBio = ReqList.Tail();
+        PrepareBio(lastBio, Polled);
         lastBio->SetPreflush();
         lastBio->SetFua();
         lastBio->SetSync();
@@ -337,7 +647,7 @@ public:
         size_t count = ReqList.Count();
         if (count > 1)
         {
-            Submit(ReqList, count - 1);
+            Submit(ReqList, count - 1, Polled);
             Wait();
             auto err = GetResult();
             if (!err.Ok())
@@ -376,6 +686,90 @@ private:
     BioList& operator=(const BioList& other) = delete;
     BioList& operator=(BioList&& other) = delete;
 
+    size_t GetMaxBioPages()
+    {
+        if (MaxBioPages == 0)
+        {
+            size_t pageSize = get_kapi()->get_page_size();
+            size_t maxPages = BlockDev.GetMaxSegments();
+            size_t maxSectorPages = (static_cast<size_t>(BlockDev.GetMaxSectors()) * 512) / pageSize;
+
+            if (maxSectorPages < maxPages)
+                maxPages = maxSectorPages;
+            if (maxPages > BioMaxPages)
+                maxPages = BioMaxPages;
+            MaxBioPages = (maxPages != 0) ? maxPages : 1;
+        }
+        return MaxBioPages;
+    }
+
+    //Positions and lengths must be multiples of the device logical block size
+    bool IsAligned(unsigned long long value)
+    {
+        return (value % BlockDev.GetLogicalBlockSize()) == 0;
+    }
+
+    //Full pages at contiguous positions are merged into one bio up to the device limits
+    Error AddPage(const typename Page<PoolType>::Ptr& page, unsigned long long sector, bool write)
+    {
+        size_t count = PendingPages.GetSize();
+        if (count != 0 && (write != PendingWrite || sector != PendingEndSector ||
+            count >= GetMaxBioPages()))
+        {
+            auto err = FlushPending();
+            if (!err.Ok())
+                return err;
+            count = 0;
+        }
+
+        if (count == 0)
+        {
+            PendingSector = sector;
+            PendingEndSector = sector;
+            PendingWrite = write;
+        }
+
+        if (!PendingPages.PushBack(page))
+            return MakeError(Error::NoMemory);
+
+        PendingEndSector += page->GetSize() / 512;
+        return MakeError(Error::Success);
+    }
+
+    Error FlushPending()
+    {
+        if (PendingPages.GetSize() == 0)
+            return MakeError(Error::Success);
+
+        Error err;
+        auto bio = Bio<PoolType>::Create(BlockDev, PendingPages, PendingSector, err, PendingWrite, BioPool);
+        ResetPending();
+        if (!err.Ok())
+            return err;
+
+        if (!ReqList.AddTail(bio))
+            return MakeError(Error::NoMemory);
+
+        return MakeError(Error::Success);
+    }
+
+    void PrepareBio(typename Bio<PoolType>::Ptr& bio, bool polled)
+    {
+        if (Sync && bio->IsWrite())
+            bio->SetSync();
+        if (polled)
+            bio->SetPolled();
+        if (PrioClass != KAPI_BIO_PRIO_CLASS_NONE)
+            bio->SetPriority(PrioClass, PrioLevel);
+    }
+
+    void ResetPending()
+    {
+        for (size_t i = 0; i < PendingPages.GetSize(); i++)
+            PendingPages[i].Reset();
+        PendingPages.Truncate(0);
+    }
+
     void PostEndIoHandler(Bio<PoolType>* bio)
     {
         auto err = bio->GetResult();
@@ -383,7 +777,12 @@ private:
             Result = err;
 
         if (ReqCompleteCount.DecAndTest())
+        {
+            if (CompletionHandler != nullptr)
+                CompletionHandler(this, CompletionCtx);
+            //Last access, the waiter may free the list once it is set
             ReqCompleteEvent.SetAll();
+        }
     }
 
     static void PostEndIoHandler(Bio<PoolType>* bio, void* ctx)
@@ -392,10 +791,12 @@ private:
         bioList->PostEndIoHandler(bio);
     }
 
-    void Submit(LinkedList<typename Bio<PoolType>::Ptr, PoolType>& reqList, size_t maxCount)
+    void Submit(LinkedList<typename Bio<PoolType>::Ptr, PoolType>& reqList, size_t maxCount, bool polled)
     {
         ReqCompleteCount.Set(0);
         ReqCompleteEvent.Reset();
+        SubmitPolled = polled;
+        InFlight = true;
 
         size_t i = 0;
         auto it = reqList.GetIterator();
@@ -408,6 +809,8 @@ private:
             i++;
         }
 
+        //Plugged so the block layer can merge the list and dispatch it at once
+        BlockPlug plug;
         i = 0;
         it = reqList.GetIterator();
         for (;it.IsValid(); it.Next())
@@ -416,25 +819,68 @@ private:
                 break;
 
             auto bio = it.Get();
+            PrepareBio(bio, polled);
             bio->SetPostEndIoHandler(&BioList<PoolType>::PostEndIoHandler, this);
             bio->Submit();
             i++;
         }
+        SubmitCount = i;
     }
 
-    void Wait()
+    //Polled bios sit on queues without interrupts, so reap them until all have ended
+    void Poll()
     {
-        if (ReqCompleteCount.Get() != 0)
+        while (ReqCompleteCount.Get() != 0)
         {
-            ReqCompleteEvent.Wait();
-            ReqCompleteEvent.Reset();
+            size_t i = 0;
+            auto it = ReqList.GetIterator();
+            for (;it.IsValid(); it.Next())
+            {
+                if (i >= SubmitCount)
+                    break;
+
+                auto bio = it.Get();
+                if (!bio->IsCompleted() && bio->Poll() < 0)
+                    return;
+                i++;
+            }
+            get_kapi()->cond_resched();
         }
     }
 
+    //Waits on the event even if the count already dropped, end_io may still be
+    //running the completion handler
+    void Wait()
+    {
+        if (!InFlight)
+            return;
+
+        if (SubmitPolled)
+            Poll();
+        ReqCompleteEvent.Wait();
+        InFlight = false;
+    }
+
     LinkedList<typename Bio<PoolType>::Ptr, PoolType> ReqList;
     BlockDeviceInterface& BlockDev;
+    BioSet* BioPool;
+    size_t MaxBioPages;
+    Vector<typename Page<PoolType>::Ptr, PoolType> PendingPages;
+    unsigned long long PendingSector;
+    unsigned long long PendingEndSector;
+    bool PendingWrite;
+    bool Sync;
+    bool Polled;
+    bool SubmitPolled;
+    //Owned by the submitter, set from Submit until Wait returns
+    bool InFlight;
+    size_t SubmitCount;
+    int PrioClass;
+    int PrioLevel;
     Atomic ReqCompleteCount;
     Event ReqCompleteEvent;
+    CompletionHandlerType CompletionHandler;
+    void* CompletionCtx;
     Error Result;
 };
 
@@ -0,0 +1,51 @@
+#include "bio_set.h"
+#include "kapi.h"
+#include "trace.h"
+
+namespace Core
+{
+
+BioSet::BioSet()
+    : BioSetPtr(nullptr)
+{
+}
+
+Error BioSet::Create(unsigned int poolSize)
+{
+    if (BioSetPtr != nullptr)
+        return MakeError(Error::InvalidState);
+
+    BioSetPtr = get_kapi()->bio_set_create(poolSize);
+    if (BioSetPtr == nullptr)
+    {
+        trace(0, "Can't create bio set, size %u", poolSize);
+        return MakeError(Error::NoMemory);
+    }
+
+    trace(4, "BioSet 0x%p bioset 0x%p size %u", this, BioSetPtr, poolSize);
+    return MakeError(Error::Success);
+}
+
+void BioSet::Delete()
+{
+    if (BioSetPtr != nullptr)
+    {
+        get_kapi()->bio_set_delete(BioSetPtr);
+        BioSetPtr = nullptr;
+    }
+}
+
+void* BioSet::AllocBio(int pageCount, unsigned long poolType)
+{
+    if (BioSetPtr == nullptr)
+        return get_kapi()->alloc_bio(pageCount, poolType);
+
+    return get_kapi()->alloc_bio_from_set(BioSetPtr, pageCount, poolType);
+}
+
+BioSet::~BioSet()
+{
+    Delete();
+}
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "error.h"
+
+namespace Core
+{
+
+//Reserve of bios so write-out can make progress when the allocator can't
+class BioSet
+{
+public:
+    BioSet();
+    virtual ~BioSet();
+
+    Error Create(unsigned int poolSize);
+    void Delete();
+
+    void* AllocBio(int pageCount, unsigned long poolType);
+
+private:
+    BioSet(const BioSet& other) = delete;
+    BioSet(BioSet&& other) = delete;
+    BioSet& operator=(const BioSet& other) = delete;
+    BioSet& operator=(BioSet&& other) = delete;
+
+    void* BioSetPtr;
+};
+
+}
@@ -7,6 +7,13 @@ namespace Core
 BlockDevice::BlockDevice(const AString& deviceName, Error& err)
     : BDevPtr(nullptr)
     , Mode(KAPI_BDEV_MODE_READ|KAPI_BDEV_MODE_WRITE|KAPI_BDEV_MODE_EXCLUSIVE)
+    , LogicalBlockSize(512)
+    , PhysicalBlockSize(512)
+    , MinIoSize(512)
+    , OptimalIoSize(0)
+    , MaxSegments(1)
+    , MaxSectors(8)
+    , AtomicWriteSize(0)
 {
     if (!err.Ok())
     {
@@ -22,9 +29,70 @@ BlockDevice::BlockDevice(const AString& deviceName, Error& err)
         return;
     }
 
+    QueryLimits();
+
     trace(4, "Bdev 0x%p bdev 0x%p ctor", this, BDevPtr);
 }
 
+void BlockDevice::QueryLimits()
+{
+    LogicalBlockSize = get_kapi()->bdev_get_logical_block_size(BDevPtr);
+    PhysicalBlockSize = get_kapi()->bdev_get_physical_block_size(BDevPtr);
+    MinIoSize = get_kapi()->bdev_get_io_min(BDevPtr);
+    OptimalIoSize = get_kapi()->bdev_get_io_opt(BDevPtr);
+    MaxSegments = get_kapi()->bdev_get_max_segments(BDevPtr);
+    MaxSectors = get_kapi()->bdev_get_max_sectors(BDevPtr);
+    AtomicWriteSize = get_kapi()->bdev_get_atomic_write_max(BDevPtr);
+
+    if (LogicalBlockSize < 512)
+        LogicalBlockSize = 512;
+    if (PhysicalBlockSize < LogicalBlockSize)
+        PhysicalBlockSize = LogicalBlockSize;
+    if (MaxSegments == 0)
+        MaxSegments = 1;
+    if (MaxSectors == 0)
+        MaxSectors = LogicalBlockSize / 512;
+
+    trace(1, "Bdev 0x%p limits lbs %u pbs %u io_min %u io_opt %u max_segs %u max_sectors %u atomic %u",
+        this, LogicalBlockSize, PhysicalBlockSize, MinIoSize, OptimalIoSize,
+        MaxSegments, MaxSectors, AtomicWriteSize);
+}
+
+unsigned int BlockDevice::GetLogicalBlockSize()
+{
+    return LogicalBlockSize;
+}
+
+unsigned int BlockDevice::GetMaxSegments()
+{
+    return MaxSegments;
+}
+
+unsigned int BlockDevice::GetMaxSectors()
+{
+    return MaxSectors;
+}
+
+unsigned int BlockDevice::GetPhysicalBlockSize() const
+{
+    return PhysicalBlockSize;
+}
+
+unsigned int BlockDevice::GetMinIoSize() const
+{
+    return MinIoSize;
+}
+
+unsigned int BlockDevice::GetOptimalIoSize() const
+{
+    return OptimalIoSize;
+}
+
+unsigned int BlockDevice::GetAtomicWriteSize() const
+{
+    return AtomicWriteSize;
+}
+
 void* BlockDevice::GetBdev()
 {
     return BDevPtr;
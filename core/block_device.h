@@ -15,11 +15,35 @@ public:
     BlockDevice(const AString& deviceName, Error& err);
     virtual void* GetBdev() override;
     unsigned long long GetSize() const;
+
+    //Queue limits are sampled once when the device is opened
+    virtual unsigned int GetLogicalBlockSize() override;
+    virtual unsigned int GetMaxSegments() override;
+    virtual unsigned int GetMaxSectors() override;
+    unsigned int GetPhysicalBlockSize() const;
+    unsigned int GetMinIoSize() const;
+    unsigned int GetOptimalIoSize() const;
+    unsigned int GetAtomicWriteSize() const;
+
     virtual ~BlockDevice();
 
 private:
+    BlockDevice(const BlockDevice& other) = delete;
+    BlockDevice(BlockDevice&& other) = delete;
+    BlockDevice& operator=(const BlockDevice& other) = delete;
+    BlockDevice& operator=(BlockDevice&& other) = delete;
+
+    void QueryLimits();
+
     void* BDevPtr;
     int Mode;
+    unsigned int LogicalBlockSize;
+    unsigned int PhysicalBlockSize;
+    unsigned int MinIoSize;
+    unsigned int OptimalIoSize;
+    unsigned int MaxSegments;
+    unsigned int MaxSectors;
+    unsigned int AtomicWriteSize;
 };
 
 }
\ No newline at end of file
@@ -4,4 +4,7 @@ class BlockDeviceInterface
 {
 public:
     virtual void* GetBdev() = 0;
-};
\ No newline at end of file
+    virtual unsigned int GetLogicalBlockSize() = 0;
+    virtual unsigned int GetMaxSegments() = 0;
+    virtual unsigned int GetMaxSectors() = 0;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "kapi.h"
+
+namespace Core
+{
+
+//Holds bios submitted by the current task until destroyed, must live on the stack
+class BlockPlug
+{
+public:
+    BlockPlug()
+    {
+        get_kapi()->blk_start_plug(&Plug);
+    }
+
+    virtual ~BlockPlug()
+    {
+        get_kapi()->blk_finish_plug(&Plug);
+    }
+
+private:
+    BlockPlug(const BlockPlug& other) = delete;
+    BlockPlug(BlockPlug&& other) = delete;
+    BlockPlug& operator=(const BlockPlug& other) = delete;
+    BlockPlug& operator=(BlockPlug&& other) = delete;
+
+    struct kapi_blk_plug Plug;
+};
+
+}
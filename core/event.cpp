@@ -33,6 +33,7 @@ void Event::Wait(unsigned long timeout)
 
 void Event::Reset()
 {
+    get_kapi()->completion_reinit(&Completion);
 }
 
 Event::~Event()
@@ -7,6 +7,7 @@
 #include "shared_ptr.h"
 #include "hex.h"
 #include "bitmap.h"
+#include "page_pool.h"
 
 namespace Core
 {
@@ -34,6 +35,7 @@ public:
 public:
     Page(Error& err)
         : PagePtr(nullptr)
+        , Pool(nullptr)
     {
         if (!err.Ok())
         {
@@ -48,6 +50,23 @@ public:
         }
     }
 
+    Page(PagePool& pool, Error& err)
+        : PagePtr(nullptr)
+        , Pool(&pool)
+    {
+        if (!err.Ok())
+        {
+            return;
+        }
+
+        PagePtr = Pool->AllocPage(KAPI_POOL_TYPE_NOIO);
+        if (PagePtr == nullptr)
+        {
+            err = MakeError(Error::NoMemory);
+            return;
+        }
+    }
+
     virtual void* Map() override
     {
         return get_kapi()->map_page(PagePtr);
@@ -119,7 +138,10 @@ public:
     {
         if (PagePtr != nullptr)
         {
-            get_kapi()->free_page(PagePtr);
+            if (Pool != nullptr)
+                Pool->FreePage(PagePtr);
+            else
+                get_kapi()->free_page(PagePtr);
             PagePtr = nullptr;
         }
     }
@@ -163,6 +185,21 @@ public:
         return page;
     }
 
+    static SharedPtr<Page<PoolType>, PoolType> Create(PagePool& pool, Error& err)
+    {
+        SharedPtr<Page<PoolType>, PoolType> page = MakeShared<Page<PoolType>, PoolType>(pool, err);
+        if (page.Get() == nullptr)
+        {
+            err = MakeError(Error::NoMemory);
+            return page;
+        }
+
+        if (!err.Ok())
+            page.Reset();
+
+        return page;
+    }
+
     virtual AString ToHex(size_t len) const override
     {
         AString result;
@@ -233,6 +270,7 @@ private:
     }
 
     void* PagePtr;
+    PagePool* Pool;
 };
 
 class PageMap
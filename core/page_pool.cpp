@@ -0,0 +1,62 @@
+#include "page_pool.h"
+#include "kapi.h"
+#include "trace.h"
+
+namespace Core
+{
+
+PagePool::PagePool()
+    : PagePoolPtr(nullptr)
+{
+}
+
+Error PagePool::Create(int minPages)
+{
+    if (PagePoolPtr != nullptr)
+        return MakeError(Error::InvalidState);
+
+    PagePoolPtr = get_kapi()->page_pool_create(minPages);
+    if (PagePoolPtr == nullptr)
+    {
+        trace(0, "Can't create page pool, size %d", minPages);
+        return MakeError(Error::NoMemory);
+    }
+
+    trace(4, "PagePool 0x%p pool 0x%p size %d", this, PagePoolPtr, minPages);
+    return MakeError(Error::Success);
+}
+
+void PagePool::Delete()
+{
+    if (PagePoolPtr != nullptr)
+    {
+        get_kapi()->page_pool_delete(PagePoolPtr);
+        PagePoolPtr = nullptr;
+    }
+}
+
+void* PagePool::AllocPage(unsigned long poolType)
+{
+    if (PagePoolPtr == nullptr)
+        return get_kapi()->alloc_page(poolType);
+
+    return get_kapi()->page_pool_alloc(PagePoolPtr, poolType);
+}
+
+void PagePool::FreePage(void* page)
+{
+    if (PagePoolPtr == nullptr)
+    {
+        get_kapi()->free_page(page);
+        return;
+    }
+
+    get_kapi()->page_pool_free(PagePoolPtr, page);
+}
+
+PagePool::~PagePool()
+{
+    Delete();
+}
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "error.h"
+
+namespace Core
+{
+
+//Reserve of pages so write-out can make progress when the allocator can't
+class PagePool
+{
+public:
+    PagePool();
+    virtual ~PagePool();
+
+    Error Create(int minPages);
+    void Delete();
+
+    void* AllocPage(unsigned long poolType);
+    void FreePage(void* page);
+
+private:
+    PagePool(const PagePool& other) = delete;
+    PagePool(PagePool&& other) = delete;
+    PagePool& operator=(const PagePool& other) = delete;
+    PagePool& operator=(PagePool&& other) = delete;
+
+    void* PagePoolPtr;
+};
+
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include "memory.h"
+#include "error.h"
+#include "shared_ptr.h"
+#include "vector.h"
+#include "kapi.h"
+#include "bug.h"
+
+namespace Core
+{
+
+//Multi-page buffer backed by one higher-order allocation when possible,
+//otherwise by single pages
+template<Memory::PoolType PoolType = Memory::PoolType::Kernel>
+class PageVector
+{
+public:
+    using Ptr = SharedPtr<PageVector<PoolType>, PoolType>;
+
+public:
+    PageVector(size_t pageCount, Error& err)
+        : CompoundPtr(nullptr)
+        , Order(0)
+        , PageCount(0)
+    {
+        if (!err.Ok())
+        {
+            return;
+        }
+
+        if (pageCount == 0)
+        {
+            err = MakeError(Error::InvalidValue);
+            return;
+        }
+
+        unsigned int order = 0;
+        while ((static_cast<size_t>(1) << order) < pageCount)
+            order++;
+
+        if ((static_cast<size_t>(1) << order) == pageCount && order != 0)
+        {
+            CompoundPtr = get_kapi()->alloc_pages(order, get_kapi_pool_type(PoolType));
+            if (CompoundPtr != nullptr)
+            {
+                Order = order;
+                PageCount = pageCount;
+                return;
+            }
+        }
+
+        if (!Pages.Reserve(pageCount))
+        {
+            err = MakeError(Error::NoMemory);
+            return;
+        }
+
+        for (size_t i = 0; i < pageCount; i++)
+        {
+            void* page = get_kapi()->alloc_page(get_kapi_pool_type(PoolType));
+            if (page == nullptr)
+            {
+                err = MakeError(Error::NoMemory);
+                return;
+            }
+
+            if (!Pages.PushBack(page))
+            {
+                get_kapi()->free_page(page);
+                err = MakeError(Error::NoMemory);
+                return;
+            }
+        }
+        PageCount = pageCount;
+    }
+
+    virtual ~PageVector()
+    {
+        if (CompoundPtr != nullptr)
+        {
+            get_kapi()->free_pages(CompoundPtr, Order);
+            CompoundPtr = nullptr;
+        }
+
+        for (size_t i = 0; i < Pages.GetSize(); i++)
+        {
+            get_kapi()->free_page(Pages[i]);
+        }
+        Pages.Truncate(0);
+    }
+
+    bool IsCompound() const
+    {
+        return CompoundPtr != nullptr;
+    }
+
+    size_t GetPageCount() const
+    {
+        return PageCount;
+    }
+
+    static size_t GetPageSize()
+    {
+        return get_kapi()->get_page_size();
+    }
+
+    size_t GetSize() const
+    {
+        return PageCount * GetPageSize();
+    }
+
+    void* GetPagePtr(size_t index)
+    {
+        panic(index >= PageCount);
+
+        if (CompoundPtr != nullptr)
+            return get_kapi()->get_nth_page(CompoundPtr, index);
+
+        return Pages[index];
+    }
+
+    //May sleep while mapped, unlike the atomic variant
+    void* MapPage(size_t index)
+    {
+        return get_kapi()->map_page(GetPagePtr(index));
+    }
+
+    void UnmapPage(size_t index)
+    {
+        get_kapi()->unmap_page(GetPagePtr(index));
+    }
+
+    void* MapPageAtomic(size_t index)
+    {
+        return get_kapi()->map_page_atomic(GetPagePtr(index));
+    }
+
+    void UnmapPageAtomic(void* va)
+    {
+        get_kapi()->unmap_page_atomic(va);
+    }
+
+    size_t Read(void *buf, size_t len, size_t off)
+    {
+        size_t done = 0;
+        while (done < len && off < GetSize())
+        {
+            size_t pageOff = off % GetPageSize();
+            size_t size = Memory::Min<size_t>(len - done, GetPageSize() - pageOff);
+
+            void* va = MapPageAtomic(off / GetPageSize());
+            Memory::MemCpy(Memory::MemAdd(buf, done), Memory::MemAdd(va, pageOff), size);
+            UnmapPageAtomic(va);
+
+            done += size;
+            off += size;
+        }
+        return done;
+    }
+
+    size_t Write(const void *buf, size_t len, size_t off)
+    {
+        size_t done = 0;
+        while (done < len && off < GetSize())
+        {
+            size_t pageOff = off % GetPageSize();
+            size_t size = Memory::Min<size_t>(len - done, GetPageSize() - pageOff);
+
+            void* va = MapPageAtomic(off / GetPageSize());
+            Memory::MemCpy(Memory::MemAdd(va, pageOff), Memory::MemAdd(buf, done), size);
+            UnmapPageAtomic(va);
+
+            done += size;
+            off += size;
+        }
+        return done;
+    }
+
+    void Zero()
+    {
+        for (size_t i = 0; i < PageCount; i++)
+        {
+            void* va = MapPageAtomic(i);
+            Memory::MemSet(va, 0, GetPageSize());
+            UnmapPageAtomic(va);
+        }
+    }
+
+    static SharedPtr<PageVector<PoolType>, PoolType> Create(size_t pageCount, Error& err)
+    {
+        SharedPtr<PageVector<PoolType>, PoolType> pageVector =
+            MakeShared<PageVector<PoolType>, PoolType>(pageCount, err);
+        if (pageVector.Get() == nullptr)
+        {
+            err = MakeError(Error::NoMemory);
+            return pageVector;
+        }
+
+        if (!err.Ok())
+            pageVector.Reset();
+
+        return pageVector;
+    }
+
+private:
+    PageVector(const PageVector& other) = delete;
+    PageVector(PageVector&& other) = delete;
+    PageVector& operator=(const PageVector& other) = delete;
+    PageVector& operator=(PageVector&& other) = delete;
+
+    void* CompoundPtr;
+    unsigned int Order;
+    size_t PageCount;
+    Vector<void*, PoolType> Pages;
+};
+
+}
@@ -29,6 +29,11 @@ void Smp::UnlockOnlineCpus()
     get_kapi()->put_online_cpus();
 }
 
+int Smp::GetOnlineCpuCount()
+{
+    return get_kapi()->get_online_cpu_count();
+}
+
 void Smp::CallFunctionOtherCpus(void (*function)(void *data),
                                 void *data, bool wait)
 {
@@ -13,6 +13,7 @@ public:
     static void PreemptEnable();
     static void LockOnlineCpus();
     static void UnlockOnlineCpus();
+    static int GetOnlineCpuCount();
     static void CallFunctionOtherCpus(void (*function)(void *data),
                                       void *data, bool wait);
     static void CallFunctionCurrCpuOnly(void (*function)(void *data),
@@ -80,6 +80,49 @@ Error Socket::Send(const void *buf, unsigned long len, unsigned long& sent)
     return MakeError(Error::Success);
 }
 
+Error Socket::SendPage(void *page, unsigned long offset, unsigned long len, bool more, unsigned long& sent)
+{
+    sent = 0;
+    if (Sockp == nullptr)
+        return MakeError(Error::InvalidState);
+
+    if (offset + len > static_cast<unsigned long>(get_kapi()->get_page_size()))
+        return MakeError(Error::BufToBig);
+
+    int r = get_kapi()->sock_send_page(Sockp, page, static_cast<int>(offset), static_cast<int>(len), more);
+    if (r < 0)
+        return MakeError(r);
+
+    sent = static_cast<unsigned long>(r);
+    return MakeError(Error::Success);
+}
+
+Error Socket::SendPageAll(void *page, unsigned long offset, unsigned long len, bool more, unsigned long& sent)
+{
+    Error err;
+
+    sent = 0;
+    while (sent < len) {
+        unsigned long lsent;
+
+        err = SendPage(page, offset + sent, len - sent, more, lsent);
+        sent += lsent;
+        if (!err.Ok())
+        {
+            if (err == Error::Again)
+                continue;
+
+            break;
+        }
+
+        if (lsent == 0) {
+            err = MakeError(Error::EOF);
+            break;
+        }
+    }
+    return err;
+}
+
 Error Socket::Recv(void *buf, unsigned long len, unsigned long& recv)
 {
     recv = 0;
@@ -150,6 +193,37 @@ Error Socket::RecvAll(void *buf, unsigned long len, unsigned long& recv)
     return err;
 }
 
+Error Socket::RecvNonBlock(void *buf, unsigned long len, unsigned long& recv)
+{
+    recv = 0;
+    if (Sockp == nullptr)
+        return MakeError(Error::InvalidState);
+
+    if (len > Memory::MaxInt)
+        return MakeError(Error::BufToBig);
+
+    int r = get_kapi()->sock_recv_nonblock(Sockp, buf, static_cast<int>(len));
+    if (r < 0)
+        return MakeError(r);
+
+    recv = static_cast<unsigned long>(r);
+    return MakeError(Error::Success);
+}
+
+Error Socket::SetReadyCallback(void (*ready)(void *ctx), void *ctx)
+{
+    if (Sockp == nullptr)
+        return MakeError(Error::InvalidState);
+
+    return MakeError(get_kapi()->sock_set_ready_callback(Sockp, ready, ctx));
+}
+
+void Socket::ClearReadyCallback()
+{
+    if (Sockp != nullptr)
+        get_kapi()->sock_clear_ready_callback(Sockp);
+}
+
 Socket::~Socket()
 {
     Close();
@@ -16,8 +16,16 @@ public:
     Socket *Accept(Error &err);
     Error Send(const void *buf, unsigned long len, unsigned long& sent);
     Error SendAll(const void *buf, unsigned long len, unsigned long& sent);
+    //Page is referenced by the socket until transmitted, not copied
+    Error SendPage(void *page, unsigned long offset, unsigned long len, bool more, unsigned long& sent);
+    Error SendPageAll(void *page, unsigned long offset, unsigned long len, bool more, unsigned long& sent);
     Error Recv(void *buf, unsigned long len, unsigned long& recv);
     Error RecvAll(void *buf, unsigned long len, unsigned long& recv);
+    //Returns Again if no data is queued
+    Error RecvNonBlock(void *buf, unsigned long len, unsigned long& recv);
+    //Ready callback runs in softirq context on incoming data or state change
+    Error SetReadyCallback(void (*ready)(void *ctx), void *ctx);
+    void ClearReadyCallback();
     void AbortAccept();
     void Close();    
     virtual ~Socket();
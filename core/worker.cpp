@@ -1,13 +1,24 @@
 #include "worker.h"
 #include "auto_lock.h"
 #include "trace.h"
+#include "offsetof.h"
 
 namespace Core
 {
 
+WorkItem::WorkItem()
+{
+    InitializeListHead(&WorkerLink);
+}
+
+WorkItem::~WorkItem()
+{
+}
+
 Worker::Worker()
     : Stopping(false), Running(false)
 {
+    InitializeListHead(&ItemList);
 }
 
 bool Worker::Execute(const Runnable::Ptr& task)
@@ -25,6 +36,20 @@ bool Worker::Execute(const Runnable::Ptr& task)
     return result;
 }
 
+bool Worker::Execute(WorkItem* item)
+{
+    if (Stopping || !Running)
+        return false;
+
+    AutoLock lock(Lock);
+    if (Stopping || !Running)
+        return false;
+
+    InsertTailList(&ItemList, &item->WorkerLink);
+    TaskEvent.SetAll();
+    return true;
+}
+
 bool Worker::ExecuteAndWait(const Runnable::Ptr& task, Error& err)
 {
     if (!Execute(task))
@@ -41,19 +66,35 @@ Error Worker::Run(const Threadable& thread)
     {
         trace(255, "Run");
         TaskEvent.Wait(10);
-        Runnable::Ptr task;
+        //Reset before draining so a task queued meanwhile sets it again
+        TaskEvent.Reset();
+        for (;;)
         {
-            AutoLock lock(Lock);
-            trace(255, "Locked");
-            if (!TaskList.IsEmpty())
+            Runnable::Ptr task;
+            WorkItem* item = nullptr;
             {
-                task = TaskList.Head();
-                TaskList.PopHead();
+                AutoLock lock(Lock);
+                trace(255, "Locked");
+                if (!TaskList.IsEmpty())
+                {
+                    task = TaskList.Head();
+                    TaskList.PopHead();
+                }
+                else if (!IsListEmpty(&ItemList))
+                {
+                    item = CONTAINING_RECORD(RemoveHeadList(&ItemList), WorkItem, WorkerLink);
+                    InitializeListHead(&item->WorkerLink);
+                }
+                trace(255, "De-locking");
             }
-            trace(255, "De-locking");
-        }
-        if (task.Get())
-        {
+            if (item != nullptr)
+            {
+                item->Run(thread);
+                continue;
+            }
+            if (!task.Get())
+                break;
+
             task->Execute(thread);
         }
     }
@@ -65,6 +106,8 @@ Error Worker::Run(const Threadable& thread)
 Worker::Worker(const AString& name, Error& err)
     : Stopping(false), Running(false)
 {
+    InitializeListHead(&ItemList);
+
     if (!err.Ok())
         return;
 
@@ -95,20 +138,29 @@ Worker::~Worker()
     bool bHasTasks;
     do {
         Runnable::Ptr task;
+        WorkItem* item = nullptr;
         {
             AutoLock lock(Lock);
-            bHasTasks = !TaskList.IsEmpty();
-            if (bHasTasks)
+            if (!TaskList.IsEmpty())
             {
                 task = TaskList.Head();
                 TaskList.PopHead();
-                bHasTasks = !TaskList.IsEmpty();
             }
+            else if (!IsListEmpty(&ItemList))
+            {
+                item = CONTAINING_RECORD(RemoveHeadList(&ItemList), WorkItem, WorkerLink);
+                InitializeListHead(&item->WorkerLink);
+            }
+            bHasTasks = !TaskList.IsEmpty() || !IsListEmpty(&ItemList);
         }
         if (task.Get())
         {
             task->Cancel();
         }
+        if (item != nullptr)
+        {
+            item->Cancel();
+        }
     } while (bHasTasks);
 }
 
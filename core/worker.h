@@ -9,10 +9,33 @@
 #include "error.h"
 #include "memory.h"
 #include "astring.h"
+#include "list_entry.h"
 
 namespace Core
 {
 
+//Queued through its own link, so the worker doesn't allocate for it.
+//The owner keeps the item alive and doesn't queue it again until Run or
+//Cancel is entered, the worker doesn't touch it after that.
+class WorkItem
+{
+public:
+    WorkItem();
+    virtual ~WorkItem();
+
+    virtual void Run(const Threadable& thread) = 0;
+    virtual void Cancel() = 0;
+
+private:
+    WorkItem(const WorkItem& other) = delete;
+    WorkItem(WorkItem&& other) = delete;
+    WorkItem& operator=(const WorkItem& other) = delete;
+    WorkItem& operator=(WorkItem&& other) = delete;
+
+    friend class Worker;
+    ListEntry WorkerLink;
+};
+
 class Worker : public Runnable
 {
 public:
@@ -23,6 +46,7 @@ public:
     virtual ~Worker();
     bool Execute(const Runnable::Ptr& task);
     bool ExecuteAndWait(const Runnable::Ptr& task, Error& err);
+    bool Execute(WorkItem* item);
     Error Run(const Threadable& thread);
 private:
     Worker(const Worker& other) = delete;
@@ -35,6 +59,7 @@ private:
 
     SpinLock Lock;
     LinkedList<Runnable::Ptr> TaskList;
+    ListEntry ItemList;
     Event TaskEvent;
     Thread WorkerThread;
     AString Name;
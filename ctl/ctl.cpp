@@ -68,7 +68,8 @@ int Ctl::GetRandomUlong(unsigned long& value)
     return err;
 }
 
-int Ctl::Mount(const char* deviceName, bool format, KStor::Api::Guid& volumeId)
+int Ctl::Mount(const char* deviceName, const char* journalDeviceName, bool format, bool polled,
+    KStor::Api::Guid& volumeId)
 {
     Cmd cmd;
 
@@ -76,7 +77,10 @@ int Ctl::Mount(const char* deviceName, bool format, KStor::Api::Guid& volumeId)
 
     auto& params = cmd.Union.Mount;
     snprintf(params.DeviceName, ArraySize(params.DeviceName), "%s", deviceName);
+    if (journalDeviceName != nullptr)
+        snprintf(params.JournalDeviceName, ArraySize(params.JournalDeviceName), "%s", journalDeviceName);
     params.Format = format;
+    params.Polled = polled;
     int err = ioctl(DevFd, IOCTL_KSTOR_MOUNT, &cmd);
     if (!err)
     {
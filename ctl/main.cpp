@@ -21,23 +21,40 @@ int main(int argc, char* argv[])
     std::string cmd(argv[1]);
     if (cmd == "mount")
     {
-        if (argc < 3 || argc > 4)
+        if (argc < 3 || argc > 7)
         {
             printf("Invalid number of args %d\n", argc);
             return 1;
         }
 
         std::string deviceName(argv[2]);
+        std::string journalDeviceName;
         bool format = false;
-        if (argc == 4)
+        bool polled = false;
+        for (int i = 3; i < argc; i++)
         {
-            std::string param(argv[3]);
+            std::string param(argv[i]);
             if (param == "-f")
+            {
                 format = true;
+            }
+            else if (param == "-p")
+            {
+                polled = true;
+            }
+            else if (param == "-j" && (i + 1) < argc)
+            {
+                journalDeviceName = argv[++i];
+            }
+            else
+            {
+                printf("Invalid arg %s\n", param.c_str());
+                return 1;
+            }
         }
 
         KStor::Api::Guid volumeId;
-        err = ctl.Mount(deviceName.c_str(), format, volumeId);
+        err = ctl.Mount(deviceName.c_str(), journalDeviceName.c_str(), format, polled, volumeId);
         if (err)
         {
             printf("Ctl mount err %d\n", err);
@@ -10,6 +10,7 @@ import (
     "net"
     "os"
     "sync"
+    "sync/atomic"
     "crypto/rand"
     "encoding/hex"
     "github.com/pborman/uuid"
@@ -27,11 +28,16 @@ const (
     ChunkSize = 65536
     GuidSize = 16
     HashSize = 8
+    WriteDurabilityDefault = 0
+    WriteDurabilityBuffered = 1
+    WriteDurabilityJournaled = 2
+    WriteDurabilityApplied = 3
 )
 
 type Client struct {
     Host string
     Con  net.Conn
+    NextRequestId uint64
 }
 
 type PacketHeaderBase struct {
@@ -39,6 +45,7 @@ type PacketHeaderBase struct {
     Type     uint32
     DataSize uint32
     Result   uint32
+    RequestId uint64
     DataHash [HashSize]byte
 }
 
@@ -77,6 +84,7 @@ type RespChunkCreate struct {
 
 type ReqChunkWrite struct {
     ChunkId [GuidSize]byte
+    Durability uint32
     Data [ChunkSize]byte
 }
 
@@ -232,6 +240,7 @@ func (client *Client) CreatePacket(packetType uint32, body []byte) (*Packet, err
     packet.Header.Base.Type = packetType
     packet.Header.Base.DataSize = uint32(len(body))
     packet.Header.Base.Result = 0
+    packet.Header.Base.RequestId = atomic.AddUint64(&client.NextRequestId, 1)
 
     hash, err := getHash(body)
     if err != nil {
@@ -343,21 +352,26 @@ func (client *Client) MakePacket(reqType uint32, req ToBytes) (*Packet, error) {
     return client.CreatePacket(reqType, body)
 }
 
-func (client *Client) SendRequest(reqType uint32, req ToBytes) error {
+func (client *Client) SendRequest(reqType uint32, req ToBytes) (uint64, error) {
     packet, err := client.MakePacket(reqType, req)
     if err != nil {
-        return err
+        return 0, err
     }
 
-    return client.SendPacket(packet)
+    return packet.Header.Base.RequestId, client.SendPacket(packet)
 }
 
-func (client *Client) RecvResponse(respType uint32, resp ParseBytes) error {
+func (client *Client) RecvResponse(respType uint32, requestId uint64, resp ParseBytes) error {
     packet, err := client.RecvPacket()
     if err != nil {
         return err
     }
 
+    if packet.Header.Base.RequestId != requestId {
+        return fmt.Errorf("Unexpected request id %d, should be %d",
+            packet.Header.Base.RequestId, requestId)
+    }
+
     if packet.Header.Base.Type != respType {
         return fmt.Errorf("Unexpected packet type %d, should be %d",
 			packet.Header.Base.Type, respType)
@@ -371,11 +385,11 @@ func (client *Client) RecvResponse(respType uint32, resp ParseBytes) error {
 }
 
 func (client *Client) SendRecv(reqType uint32, req ToBytes, resp ParseBytes) error {
-    err := client.SendRequest(reqType, req)
+    requestId, err := client.SendRequest(reqType, req)
     if err != nil {
         return err
     }
-    err = client.RecvResponse(reqType, resp)
+    err = client.RecvResponse(reqType, requestId, resp)
     if err != nil {
         return err
     }
@@ -426,7 +440,7 @@ func (client *Client) ChunkCreate(chunkId []byte) error {
     return nil
 }
 
-func (client *Client) ChunkWrite(chunkId []byte, data []byte) (error) {
+func (client *Client) ChunkWrite(chunkId []byte, data []byte, durability uint32) (error) {
     req := new(ReqChunkWrite)
     if len(chunkId) != len(req.ChunkId) {
         return errors.New("Invalid chunk id size")
@@ -436,6 +450,7 @@ func (client *Client) ChunkWrite(chunkId []byte, data []byte) (error) {
     }
     copy(req.ChunkId[:len(req.ChunkId)], chunkId[:len(req.ChunkId)])
     copy(req.Data[:len(req.Data)], data[:len(req.Data)])
+    req.Durability = durability
 
     resp := new(RespChunkWrite)
     err := client.SendRecv(PacketTypeChunkWrite, req, resp)
@@ -504,7 +519,7 @@ func testClient(rounds int, client *Client, wg *sync.WaitGroup) error {
             return err
         }
 
-        err = client.ChunkWrite(chunkId, data)
+        err = client.ChunkWrite(chunkId, data, WriteDurabilityDefault)
         if err != nil {
             log.Printf("Chunk %s write failed: %v\n", chunkIdS, err)
             return err
@@ -37,6 +37,8 @@ struct Cmd
             char DeviceName[DeviceNameMaxChars];
             Api::Guid VolumeId;
             bool Format;
+            char JournalDeviceName[DeviceNameMaxChars];
+            bool Polled;
         } Mount;
 
         struct 
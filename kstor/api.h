@@ -13,6 +13,7 @@ const unsigned int GuidSize = 16;
 const unsigned int VolumeMagic = 0xCBDACBDA;
 const unsigned int JournalMagic = 0xBCDEBCDE;
 const unsigned int JournalCommitMagic = 0xCFEDCFED;
+const unsigned int JournalStreamMagic = 0xBDCEBDCE;
 
 const unsigned int PacketTypePing = 1;
 const unsigned int PacketTypeChunkCreate = 2;
@@ -22,6 +23,16 @@ const unsigned int PacketTypeChunkDelete = 5;
 
 const unsigned int ChunkSize = 65536;
 
+const unsigned int WriteDurabilityDefault = 0;
+const unsigned int WriteDurabilityBuffered = 1;
+const unsigned int WriteDurabilityJournaled = 2;
+const unsigned int WriteDurabilityApplied = 3;
+
+const unsigned int VolumeJournalFlagExternal = 1;
+
+const unsigned int ChunkIndexFlagUsed = 1;
+const unsigned int ChunkIndexFlagData = 2;
+
 const unsigned int ResultSuccess = 0;
 const unsigned int ResultUnexpectedDataSize = 1;
 const unsigned int ResultNotFound = 2;
@@ -31,7 +42,7 @@ const unsigned int HashSize = 8;
 const unsigned int PageSize = 4096;
 
 const unsigned int JournalBlockTypeTxBegin = 1;
-const unsigned int JournalBlockTypeTxData = 2;
+const unsigned int JournalBlockTypeTxDescriptor = 2;
 const unsigned int JournalBlockTypeTxCommit = 3;
 
 const unsigned int JournalTxStateNew = 1;
@@ -42,6 +53,9 @@ const unsigned int JournalTxStateFinished = 5;
 
 const unsigned int TestJournal = 1;
 const unsigned int TestBtree = 2;
+const unsigned int TestJournalUnload = 3;
+const unsigned int TestBufferedWrite = 4;
+const unsigned int TestJournalApply = 5;
 
 #pragma pack(push, 1)
 
@@ -51,6 +65,7 @@ struct PacketHeader
     unsigned int Type;
     unsigned int DataSize;
     unsigned int Result;
+    unsigned long long RequestId;
     unsigned char DataHash[HashSize];
     unsigned char Hash[HashSize];
 };
@@ -68,26 +83,56 @@ struct VolumeHeader
     unsigned long long Size;
     unsigned long long JournalSize;
     unsigned long long BitmapSize;
-    unsigned char Unused[PageSize - 2 * 16 - 4 * 8];
+    unsigned long long IndexSize;
+    unsigned long long ExtentCount;
+    Guid JournalId;
+    unsigned long long JournalFlags;
+    unsigned char Unused[PageSize - 3 * 16 - 7 * 8];
     unsigned char Hash[HashSize];
 };
 
 static_assert(sizeof(VolumeHeader) == PageSize, "Bad size");
 
+struct ChunkIndexEntry
+{
+    Guid ChunkId;
+    unsigned int Flags;
+    unsigned char Unused[12];
+};
+
+static_assert(sizeof(ChunkIndexEntry) == 32, "Bad size");
+
+const unsigned int ChunkIndexEntriesPerPage = PageSize / sizeof(ChunkIndexEntry);
+
 struct JournalHeader
 {
     unsigned int Magic;
     unsigned char Padding[12];
     unsigned long long Size;
+    unsigned long long StreamCount;
+    Guid JournalId;
+    unsigned char Unused[PageSize - 2 * 16 - 3 * 8];
+    unsigned char Hash[HashSize];
+};
+
+static_assert(sizeof(JournalHeader) == PageSize, "Bad size");
+
+struct JournalStreamHeader
+{
+    unsigned int Magic;
+    unsigned char Padding[12];
+    unsigned long long StreamIndex;
     unsigned long long LogStartIndex;
     unsigned long long LogEndIndex;
     unsigned long long LogSize;
     unsigned long long LogCapacity;
-    unsigned char Unused[PageSize - 2 * 16 - 4 * 8];
+    unsigned long long LogSequence;
+    unsigned long long GlobalSequence;
+    unsigned char Unused[PageSize - 16 - 8 * 8];
     unsigned char Hash[HashSize];
 };
 
-static_assert(sizeof(JournalHeader) == PageSize, "Bad size");
+static_assert(sizeof(JournalStreamHeader) == PageSize, "Bad size");
 
 struct JournalTxBlock
 {
@@ -103,24 +148,37 @@ struct JournalTxBeginBlock
 {
     Guid TxId;
     unsigned int Type;
-    unsigned char Unused[PageSize - 16 - 8 - 4];
+    unsigned long long Sequence;
+    unsigned long long GlobalSequence;
+    unsigned char Unused[PageSize - 16 - 3 * 8 - 4];
     unsigned char Hash[HashSize];
 };
 
 static_assert(sizeof(JournalTxBeginBlock) == PageSize, "Bad size");
 
-struct JournalTxDataBlock
+struct JournalTxDescriptorEntry
+{
+    unsigned long long Position;
+    unsigned char DataHash[HashSize];
+};
+
+static_assert(sizeof(JournalTxDescriptorEntry) == 16, "Bad size");
+
+const unsigned int JournalTxDescriptorMaxEntries = (PageSize - 2 * 16 - HashSize) / sizeof(JournalTxDescriptorEntry);
+
+struct JournalTxDescriptorBlock
 {
     Guid TxId;
     unsigned int Type;
     unsigned int Index;
-    unsigned int DataSize;
-    unsigned long long Position;
-    unsigned char Data[PageSize - 16 - 2 * 8 - 3 * 4];
+    unsigned int EntryCount;
+    unsigned char Padding[4];
+    JournalTxDescriptorEntry Entries[JournalTxDescriptorMaxEntries];
+    unsigned char Unused[PageSize - 2 * 16 - JournalTxDescriptorMaxEntries * sizeof(JournalTxDescriptorEntry) - HashSize];
     unsigned char Hash[HashSize];
 };
 
-static_assert(sizeof(JournalTxDataBlock) == PageSize, "Bad size");
+static_assert(sizeof(JournalTxDescriptorBlock) == PageSize, "Bad size");
 
 struct JournalTxCommitBlock
 {
@@ -129,7 +187,8 @@ struct JournalTxCommitBlock
     unsigned int State;
     unsigned int BlockCount;
     unsigned long long Time;
-    unsigned char Unused[PageSize - 16 - 2 * 8 - 3 * 4];
+    unsigned long long Sequence;
+    unsigned char Unused[PageSize - 16 - 3 * 8 - 3 * 4];
     unsigned char Hash[HashSize];
 };
 
@@ -143,6 +202,7 @@ struct ChunkCreateRequest
 struct ChunkWriteRequest
 {
     Guid ChunkId;
+    unsigned int Durability;
     unsigned char Data[ChunkSize];
 };
 
@@ -13,6 +13,8 @@ BitmapBlock::BitmapBlock(uint64_t index, Core::Error& err)
     Page = Core::Page<>::Create(err);
     if (!err.Ok())
         return;
+
+    Page->Zero();
 }
 
 BitmapBlock::~BitmapBlock()
@@ -60,42 +62,37 @@ Core::Error BitmapBlock::FindSetZeroBit(size_t& bit)
 }
 
 BlockAllocator::BlockAllocator(Volume& volume)
-    : VolumeRef(volume)
+    : BlockCount(0)
+    , MaxIndex(0)
+    , NextIndex(0)
+    , VolumeRef(volume)
 {
 }
 
-Core::Error BlockAllocator::Load(uint64_t start, uint64_t size)
+Core::Error BlockAllocator::Load(uint64_t blockCount)
 {
-    if (start % VolumeRef.GetBlockSize())
+    if (blockCount == 0)
     {
         return MakeError(Core::Error::InvalidValue);
     }
 
-    if (size % VolumeRef.GetBlockSize())
-    {
-        return MakeError(Core::Error::InvalidValue);
-    }
+    Core::AutoLock lock(Lock);
 
-    if ((start + size) > VolumeRef.GetSize())
-    {
-        return MakeError(Core::Error::InvalidValue);
-    }
+    BlockTree.Clear();
+    BlockCount = blockCount;
+    MaxIndex = (blockCount + BitmapBlockBits - 1) / BitmapBlockBits;
+    NextIndex = 0;
 
-    uint64_t maxIndex = start / size;
-    if (maxIndex == 0)
-    {
-        return MakeError(Core::Error::InvalidValue);
-    }
-
-    Start = start;
-    Size = size;
-    MaxIndex = maxIndex;
+    trace(1, "Balloc 0x%p load, blocks %llu bitmap blocks %llu", this, BlockCount, MaxIndex);
 
     return MakeError(Core::Error::Success);
 }
 
 Core::Error BlockAllocator::Unload()
 {
+    Core::AutoLock lock(Lock);
+
+    BlockTree.Clear();
     return MakeError(Core::Error::Success);
 }
 
@@ -103,14 +100,83 @@ BlockAllocator::~BlockAllocator()
 {
 }
 
-Core::Error Alloc(uint64_t& block)
+Core::Error BlockAllocator::Alloc(uint64_t& block)
 {
-    return MakeError(Core::Error::NotImplemented);
+    if (MaxIndex == 0)
+        return MakeError(Core::Error::InvalidState);
+
+    uint64_t start = NextIndex;
+    for (uint64_t i = 0; i < MaxIndex; i++)
+    {
+        uint64_t index = (start + i) % MaxIndex;
+        auto bitmapBlock = CreateBlock(index);
+        if (bitmapBlock.Get() == nullptr)
+            return MakeError(Core::Error::NoMemory);
+
+        size_t bit;
+        auto err = bitmapBlock->FindSetZeroBit(bit);
+        if (err == Core::Error::NotFound)
+            continue;
+        if (!err.Ok())
+            return err;
+
+        if ((index * BitmapBlockBits + bit) >= BlockCount)
+        {
+            bitmapBlock->ClearBit(bit);
+            continue;
+        }
+
+        NextIndex = index;
+        block = index * BitmapBlockBits + bit;
+        trace(3, "Balloc 0x%p alloc block %llu", this, block);
+        return MakeError(Core::Error::Success);
+    }
+
+    return MakeError(Core::Error::NoMemory);
+}
+
+Core::Error BlockAllocator::Free(uint64_t block)
+{
+    if (block >= BlockCount)
+        return MakeError(Core::Error::Overflow);
+
+    auto bitmapBlock = LookupBlock(block / BitmapBlockBits);
+    if (bitmapBlock.Get() == nullptr)
+        return MakeError(Core::Error::InvalidState);
+
+    bool oldValue;
+    auto err = bitmapBlock->TestAndClearBit(block % BitmapBlockBits, oldValue);
+    if (!err.Ok())
+        return err;
+
+    if (!oldValue)
+    {
+        trace(0, "Balloc 0x%p block %llu already free", this, block);
+        return MakeError(Core::Error::InvalidState);
+    }
+
+    trace(3, "Balloc 0x%p free block %llu", this, block);
+    return MakeError(Core::Error::Success);
 }
 
-Core::Error Free(uint64_t block)
+Core::Error BlockAllocator::MarkUsed(uint64_t block)
 {
-    return MakeError(Core::Error::NotImplemented);
+    if (block >= BlockCount)
+        return MakeError(Core::Error::Overflow);
+
+    auto bitmapBlock = CreateBlock(block / BitmapBlockBits);
+    if (bitmapBlock.Get() == nullptr)
+        return MakeError(Core::Error::NoMemory);
+
+    bool oldValue;
+    auto err = bitmapBlock->TestAndSetBit(block % BitmapBlockBits, oldValue);
+    if (!err.Ok())
+        return err;
+
+    if (oldValue)
+        return MakeError(Core::Error::AlreadyExists);
+
+    return MakeError(Core::Error::Success);
 }
 
 BitmapBlock::Ptr BlockAllocator::LookupBlock(uint64_t index)
@@ -10,6 +10,8 @@
 #include <core/noplock.h>
 #include <core/bitmap.h>
 
+#include "api.h"
+
 namespace KStor
 {
 
@@ -42,16 +44,19 @@ private:
     uint64_t Index;
 };
 
+const size_t BitmapBlockBits = 8 * Api::PageSize;
+
 class BlockAllocator
 {
 public:
     BlockAllocator(Volume& volume);
 
-    Core::Error Load(uint64_t start, uint64_t size);
+    Core::Error Load(uint64_t blockCount);
     Core::Error Unload();
 
     Core::Error Alloc(uint64_t& block);
     Core::Error Free(uint64_t block);
+    Core::Error MarkUsed(uint64_t block);
     virtual ~BlockAllocator();
 private:
     BlockAllocator(const BlockAllocator& other) = delete;
@@ -63,9 +68,9 @@ private:
     BitmapBlock::Ptr CreateBlock(uint64_t index);
     void DeleteBlock(uint64_t index);
 
-    uint64_t Start;
-    uint64_t Size;
+    uint64_t BlockCount;
     uint64_t MaxIndex;
+    uint64_t NextIndex;
 
     Volume& VolumeRef;
     Core::RWSem Lock;
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <core/memory.h>
+#include <core/type.h>
+#include <core/rwsem.h>
+#include <core/vector.h>
+#include <core/page_vector.h>
 
 #include "guid.h"
 #include "api.h"
@@ -13,21 +17,28 @@ class Chunk
 public:
     using Ptr =  Core::SharedPtr<Chunk>;
 
-    Chunk(const Guid& chunkId)
+    Chunk(const Guid& chunkId, uint64_t extent, unsigned int flags)
         : ChunkId(chunkId)
+        , Extent(extent)
+        , Flags(flags)
+        , Deleted(false)
+        , Buffered(false)
+        , BufferedQueued(false)
     {
     }
 
-    Chunk(const Guid& chunkId, unsigned char data[Api::ChunkSize])
-        : Chunk(chunkId)
-    {
-        Core::Memory::MemCpy(Data, data, sizeof(Data));
-    }
-
     virtual ~Chunk(){}
 
     Guid ChunkId;
-    unsigned char Data[Api::ChunkSize];
+    uint64_t Extent;
+    unsigned int Flags;
+    bool Deleted;
+    bool Buffered;
+    //On the volume buffered list, protected by the volume buffered lock
+    bool BufferedQueued;
+    //Replaced, never rewritten, so readers may keep sending it
+    Core::PageVector<>::Ptr BufferedPages;
+    Core::RWSem Lock;
 private:
     Chunk(const Chunk& other) = delete;
     Chunk(Chunk&& other) = delete;
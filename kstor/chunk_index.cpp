@@ -0,0 +1,243 @@
+#include "chunk_index.h"
+#include "volume.h"
+
+#include <core/bio.h>
+#include <core/bitops.h>
+#include <core/vector.h>
+#include <core/auto_lock.h>
+#include <core/shared_auto_lock.h>
+
+namespace KStor
+{
+
+ChunkIndex::ChunkIndex(Volume& volume)
+    : VolumeRef(volume)
+    , Start(0)
+    , Size(0)
+    , ExtentCount(0)
+{
+}
+
+ChunkIndex::~ChunkIndex()
+{
+}
+
+Core::Error ChunkIndex::Format(uint64_t start, uint64_t size)
+{
+    Core::AutoLock lock(Lock);
+
+    Core::Error err;
+    Core::Vector<Core::Page<>::Ptr> pages;
+    if (!pages.ReserveAndUse(Core::Memory::Min<size_t>(size, ChunkIndexBioPages)))
+        return MakeError(Core::Error::NoMemory);
+
+    for (size_t i = 0; i < pages.GetSize(); i++)
+    {
+        pages[i] = Core::Page<>::Create(err);
+        if (!err.Ok())
+            return err;
+        pages[i]->Zero();
+    }
+
+    for (uint64_t index = 0; index < size; index += pages.GetSize())
+    {
+        if ((size - index) < pages.GetSize())
+        {
+            Core::Vector<Core::Page<>::Ptr> tailPages;
+            if (!tailPages.ReserveAndUse(size - index))
+                return MakeError(Core::Error::NoMemory);
+
+            for (size_t i = 0; i < tailPages.GetSize(); i++)
+                tailPages[i] = pages[i];
+
+            pages = Core::Memory::Move(tailPages);
+        }
+
+        Core::BioList<> bioList(VolumeRef.GetDevice());
+        err = bioList.AddIo(pages, (start + index) * VolumeRef.GetBlockSize(), true);
+        if (!err.Ok())
+            return err;
+
+        err = bioList.SubmitWaitResult((index + pages.GetSize()) >= size);
+        if (!err.Ok())
+        {
+            trace(0, "ChunkIndex 0x%p format err %d", this, err.GetCode());
+            return err;
+        }
+    }
+
+    trace(1, "ChunkIndex 0x%p format start %llu size %llu", this, start, size);
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error ChunkIndex::LoadPage(uint64_t index, const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page,
+    Core::LinkedList<Chunk::Ptr>& chunkList)
+{
+    bool used = false;
+    Core::PageMap pageMap(*page.Get());
+    Api::ChunkIndexEntry* entries = static_cast<Api::ChunkIndexEntry*>(pageMap.GetAddress());
+
+    for (size_t i = 0; i < Api::ChunkIndexEntriesPerPage; i++)
+    {
+        auto& entry = entries[i];
+        unsigned int flags = Core::BitOps::Le32ToCpu(entry.Flags);
+        if (!(flags & Api::ChunkIndexFlagUsed))
+            continue;
+
+        uint64_t extent = index * Api::ChunkIndexEntriesPerPage + i;
+        if (extent >= ExtentCount)
+        {
+            trace(0, "ChunkIndex 0x%p invalid extent %llu", this, extent);
+            return MakeError(Core::Error::DataCorrupt);
+        }
+
+        auto chunk = Core::MakeShared<Chunk, Core::Memory::PoolType::Kernel>(Guid(entry.ChunkId), extent, flags);
+        if (chunk.Get() == nullptr)
+            return MakeError(Core::Error::NoMemory);
+
+        if (!chunkList.AddTail(chunk))
+            return MakeError(Core::Error::NoMemory);
+
+        used = true;
+    }
+
+    if (used && !PageTree.Insert(index, page))
+        return MakeError(Core::Error::NoMemory);
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error ChunkIndex::Load(uint64_t start, uint64_t size, uint64_t extentCount, Core::LinkedList<Chunk::Ptr>& chunkList)
+{
+    Core::AutoLock lock(Lock);
+
+    if (((extentCount + Api::ChunkIndexEntriesPerPage - 1) / Api::ChunkIndexEntriesPerPage) > size)
+        return MakeError(Core::Error::BadSize);
+
+    Start = start;
+    Size = size;
+    ExtentCount = extentCount;
+    PageTree.Clear();
+
+    for (uint64_t index = 0; index < size; index += ChunkIndexBioPages)
+    {
+        Core::Error err;
+        Core::Vector<Core::Page<Core::Memory::PoolType::NoIO>::Ptr, Core::Memory::PoolType::NoIO> pages;
+        if (!pages.ReserveAndUse(Core::Memory::Min<size_t>(size - index, ChunkIndexBioPages)))
+            return MakeError(Core::Error::NoMemory);
+
+        for (size_t i = 0; i < pages.GetSize(); i++)
+        {
+            pages[i] = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
+            if (!err.Ok())
+                return err;
+        }
+
+        Core::NoIOBioList bioList(VolumeRef.GetDevice());
+        err = bioList.AddIo(pages, (start + index) * VolumeRef.GetBlockSize(), false);
+        if (!err.Ok())
+            return err;
+
+        err = bioList.SubmitWaitResult();
+        if (!err.Ok())
+        {
+            trace(0, "ChunkIndex 0x%p read err %d", this, err.GetCode());
+            return err;
+        }
+
+        for (size_t i = 0; i < pages.GetSize(); i++)
+        {
+            err = LoadPage(index + i, pages[i], chunkList);
+            if (!err.Ok())
+                return err;
+        }
+    }
+
+    trace(1, "ChunkIndex 0x%p load start %llu size %llu extents %llu chunks %lu",
+        this, start, size, extentCount, chunkList.Count());
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error ChunkIndex::Unload()
+{
+    Core::AutoLock lock(Lock);
+
+    PageTree.Clear();
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error ChunkIndex::Update(const Transaction::Ptr& tx, uint64_t extent, const Api::ChunkIndexEntry& entry)
+{
+    if (extent >= ExtentCount)
+        return MakeError(Core::Error::Overflow);
+
+    uint64_t index = extent / Api::ChunkIndexEntriesPerPage;
+    size_t offset = (extent % Api::ChunkIndexEntriesPerPage) * sizeof(entry);
+
+    Core::AutoLock lock(Lock);
+
+    //Journal keeps a reference to the page, so cached pages are never
+    //modified in place: each update makes a new version of the page
+    Core::Error err;
+    auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
+    if (!err.Ok())
+        return err;
+
+    bool exist;
+    auto oldPage = PageTree.Lookup(index, exist);
+    if (exist)
+    {
+        Core::PageMap pageMap(*page.Get());
+        if (oldPage->Read(pageMap.GetAddress(), page->GetSize(), 0) != page->GetSize())
+            return MakeError(Core::Error::UnexpectedEOF);
+    }
+    else
+    {
+        page->Zero();
+    }
+
+    if (page->Write(&entry, sizeof(entry), offset) != sizeof(entry))
+        return MakeError(Core::Error::UnexpectedEOF);
+
+    if (exist)
+        PageTree.Delete(index);
+
+    if (!PageTree.Insert(index, page))
+    {
+        if (exist)
+            PageTree.Insert(index, oldPage);
+        return MakeError(Core::Error::NoMemory);
+    }
+
+    if (tx.Get() == nullptr)
+        return MakeError(Core::Error::Success);
+
+    return tx->Write(page, (Start + index) * VolumeRef.GetBlockSize());
+}
+
+Core::Error ChunkIndex::Set(const Transaction::Ptr& tx, uint64_t extent, const Guid& chunkId, unsigned int flags)
+{
+    Api::ChunkIndexEntry entry;
+    Core::Memory::MemSet(&entry, 0, sizeof(entry));
+    entry.ChunkId = chunkId.GetContent();
+    entry.Flags = Core::BitOps::CpuToLe32(flags | Api::ChunkIndexFlagUsed);
+
+    trace(3, "ChunkIndex 0x%p set extent %llu chunk %s flags 0x%x",
+        this, extent, chunkId.ToString().GetConstBuf(), flags);
+
+    return Update(tx, extent, entry);
+}
+
+Core::Error ChunkIndex::Clear(const Transaction::Ptr& tx, uint64_t extent)
+{
+    Api::ChunkIndexEntry entry;
+    Core::Memory::MemSet(&entry, 0, sizeof(entry));
+
+    trace(3, "ChunkIndex 0x%p clear extent %llu", this, extent);
+
+    return Update(tx, extent, entry);
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "forwards.h"
+#include "guid.h"
+#include "chunk.h"
+#include "journal.h"
+
+#include <core/error.h>
+#include <core/memory.h>
+#include <core/type.h>
+#include <core/page.h>
+#include <core/btree.h>
+#include <core/rwsem.h>
+#include <core/list.h>
+
+namespace KStor
+{
+
+const size_t ChunkIndexBioPages = 64;
+
+class ChunkIndex
+{
+public:
+    ChunkIndex(Volume& volume);
+    virtual ~ChunkIndex();
+
+    Core::Error Format(uint64_t start, uint64_t size);
+    Core::Error Load(uint64_t start, uint64_t size, uint64_t extentCount, Core::LinkedList<Chunk::Ptr>& chunkList);
+    Core::Error Unload();
+
+    Core::Error Set(const Transaction::Ptr& tx, uint64_t extent, const Guid& chunkId, unsigned int flags);
+    Core::Error Clear(const Transaction::Ptr& tx, uint64_t extent);
+
+private:
+    ChunkIndex(const ChunkIndex& other) = delete;
+    ChunkIndex(ChunkIndex&& other) = delete;
+    ChunkIndex& operator=(const ChunkIndex& other) = delete;
+    ChunkIndex& operator=(ChunkIndex&& other) = delete;
+
+    Core::Error Update(const Transaction::Ptr& tx, uint64_t extent, const Api::ChunkIndexEntry& entry);
+    Core::Error LoadPage(uint64_t index, const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page,
+        Core::LinkedList<Chunk::Ptr>& chunkList);
+
+    Volume& VolumeRef;
+    //Pages go to the journal write-out path, which must not recurse into reclaim I/O
+    Core::Btree<uint64_t, Core::Page<Core::Memory::PoolType::NoIO>::Ptr, 4> PageTree;
+    Core::RWSem Lock;
+    uint64_t Start;
+    uint64_t Size;
+    uint64_t ExtentCount;
+};
+
+}
@@ -25,7 +25,8 @@ ControlDevice::ControlDevice(Core::Error& err)
 {
 }
 
-Core::Error ControlDevice::Mount(const Core::AString& deviceName, bool format, Guid& volumeId)
+Core::Error ControlDevice::Mount(const Core::AString& deviceName, const Core::AString& journalDeviceName,
+    bool format, bool polled, Guid& volumeId)
 {
     Core::AutoLock lock(VolumeLock);
     if (VolumeRef.Get() != nullptr)
@@ -34,7 +35,7 @@ Core::Error ControlDevice::Mount(const Core::AString& deviceName, bool format, G
     }
 
     Core::Error err;
-    VolumeRef = Core::MakeShared<Volume, Core::Memory::PoolType::Kernel>(deviceName, err);
+    VolumeRef = Core::MakeShared<Volume, Core::Memory::PoolType::Kernel>(deviceName, journalDeviceName, err);
     if (VolumeRef.Get() == nullptr)
     {
         trace(0, "CtrlDev 0x%p can't allocate device", this);
@@ -58,6 +59,8 @@ Core::Error ControlDevice::Mount(const Core::AString& deviceName, bool format, G
         }
     }
 
+    VolumeRef->GetIoScheduler().SetPolled(polled);
+
     err = VolumeRef->Load();
     if (!err.Ok())
     {
@@ -309,6 +312,45 @@ Core::Error ControlDevice::RunTest(unsigned int testId)
         err = VolumeRef->TestJournal();
         break;
     }
+    case Api::TestJournalUnload:
+    {
+        Core::AutoLock lock(VolumeLock);
+
+        if (VolumeRef.Get() == nullptr)
+        {
+            err =  MakeError(Core::Error::NotFound);
+            break;
+        }
+
+        err = VolumeRef->TestJournalUnload();
+        break;
+    }
+    case Api::TestBufferedWrite:
+    {
+        Core::AutoLock lock(VolumeLock);
+
+        if (VolumeRef.Get() == nullptr)
+        {
+            err =  MakeError(Core::Error::NotFound);
+            break;
+        }
+
+        err = VolumeRef->TestBufferedWrite();
+        break;
+    }
+    case Api::TestJournalApply:
+    {
+        Core::AutoLock lock(VolumeLock);
+
+        if (VolumeRef.Get() == nullptr)
+        {
+            err =  MakeError(Core::Error::NotFound);
+            break;
+        }
+
+        err = VolumeRef->TestJournalApply();
+        break;
+    }
     case Api::TestBtree:
     {
         err = TestBtree();
@@ -381,7 +423,8 @@ Core::Error ControlDevice::Ioctl(unsigned int code, unsigned long arg)
     case IOCTL_KSTOR_MOUNT:
     {
         auto& params = cmd->Union.Mount;
-        if (params.DeviceName[Core::Memory::ArraySize(params.DeviceName) - 1] != '\0')
+        if (params.DeviceName[Core::Memory::ArraySize(params.DeviceName) - 1] != '\0' ||
+            params.JournalDeviceName[Core::Memory::ArraySize(params.JournalDeviceName) - 1] != '\0')
         {
             err = MakeError(Core::Error::InvalidValue);
             break;
@@ -393,8 +436,19 @@ Core::Error ControlDevice::Ioctl(unsigned int code, unsigned long arg)
             break;
         }
 
+        Core::AString journalDeviceName;
+        if (params.JournalDeviceName[0] != '\0')
+        {
+            journalDeviceName = Core::AString(params.JournalDeviceName,
+                Core::Memory::ArraySize(params.JournalDeviceName) - 1, err);
+            if (!err.Ok())
+            {
+                break;
+            }
+        }
+
         Guid volumeId;
-        err = Mount(deviceName, params.Format, volumeId);
+        err = Mount(deviceName, journalDeviceName, params.Format, params.Polled, volumeId);
         if (err.Ok()) {
             params.VolumeId = volumeId.GetContent();
         }
@@ -500,7 +554,7 @@ Core::Error ControlDevice::ChunkCreate(const Guid& chunkId)
     return VolumeRef->ChunkCreate(chunkId);
 }
 
-Core::Error ControlDevice::ChunkWrite(const Guid& chunkId, unsigned char data[Api::ChunkSize])
+Core::Error ControlDevice::ChunkWrite(const Guid& chunkId, const Core::PageVector<>::Ptr& pages, unsigned int durability)
 {
     Core::SharedAutoLock lock(VolumeLock);
     if (VolumeRef.Get() == nullptr)
@@ -508,10 +562,10 @@ Core::Error ControlDevice::ChunkWrite(const Guid& chunkId, unsigned char data[Ap
         return MakeError(Core::Error::NotFound);
     }
 
-    return VolumeRef->ChunkWrite(chunkId, data);
+    return VolumeRef->ChunkWrite(chunkId, pages, durability);
 }
 
-Core::Error ControlDevice::ChunkRead(const Guid& chunkId, unsigned char data[Api::ChunkSize])
+Core::Error ControlDevice::ChunkRead(const Guid& chunkId, Core::PageVector<>::Ptr& pages, ReadStream* stream)
 {
     Core::SharedAutoLock lock(VolumeLock);
     if (VolumeRef.Get() == nullptr)
@@ -519,7 +573,7 @@ Core::Error ControlDevice::ChunkRead(const Guid& chunkId, unsigned char data[Api
         return MakeError(Core::Error::NotFound);
     }
 
-    return VolumeRef->ChunkRead(chunkId, data);
+    return VolumeRef->ChunkRead(chunkId, pages, stream);
 }
 
 Core::Error ControlDevice::ChunkDelete(const Guid& chunkId)
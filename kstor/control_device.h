@@ -22,7 +22,8 @@ public:
 
     Core::Error Ioctl(unsigned int code, unsigned long arg) override;
 
-    Core::Error Mount(const Core::AString& deviceName, bool format, Guid& volumeId);
+    Core::Error Mount(const Core::AString& deviceName, const Core::AString& journalDeviceName,
+        bool format, bool polled, Guid& volumeId);
     Core::Error Unmount(const Guid& volumeId);
     Core::Error Unmount(const Core::AString& deviceName);
 
@@ -32,8 +33,8 @@ public:
     Core::Error StopServer();
 
     Core::Error ChunkCreate(const Guid& chunkId);
-    Core::Error ChunkWrite(const Guid& chunkId, unsigned char data[Api::ChunkSize]);
-    Core::Error ChunkRead(const Guid& chunkId, unsigned char data[Api::ChunkSize]);
+    Core::Error ChunkWrite(const Guid& chunkId, const Core::PageVector<>::Ptr& pages, unsigned int durability);
+    Core::Error ChunkRead(const Guid& chunkId, Core::PageVector<>::Ptr& pages, ReadStream* stream = nullptr);
     Core::Error ChunkDelete(const Guid& chunkId);
 
     static ControlDevice* Get();
@@ -1,5 +1,6 @@
 #include "guid.h"
 #include <core/hex.h>
+#include <core/random.h>
 
 namespace KStor
 {
@@ -39,13 +40,9 @@ Core::Error Guid::Generate(Core::RandomFile& rng)
 
 Core::Error Guid::Generate()
 {
-    Core::Error err;
-
-    Core::RandomFile rng(err, false);
-    if (!err.Ok())
-        return err;
-
-    return rng.GetBytes(Content.Data, sizeof(Content.Data));
+    //Kernel CSPRNG, opening the random device for every tx and chunk id is too slow
+    Core::Random::GetBytes(Content.Data, sizeof(Content.Data));
+    return MakeError(Core::Error::Success);
 }
 
 const Api::Guid& Guid::GetContent() const
@@ -0,0 +1,167 @@
+#include "io_scheduler.h"
+
+#include <core/trace.h>
+#include <core/time.h>
+#include <core/auto_lock.h>
+
+namespace KStor
+{
+
+static const IoClassInfo IoClassTable[IoClassCount] =
+{
+    { 8, IoSchedulerDepth, true, KAPI_BIO_PRIO_CLASS_RT },
+    { 8, IoSchedulerDepth, true, KAPI_BIO_PRIO_CLASS_RT },
+    { 2, IoSchedulerDepth / 4, false, KAPI_BIO_PRIO_CLASS_BE },
+    { 1, IoSchedulerDepth / 8, false, KAPI_BIO_PRIO_CLASS_IDLE },
+};
+
+IoScheduler::IoScheduler()
+    : LatencySamples(0)
+    , ForegroundP99Us(0)
+    , ThrottleShift(0)
+    , Polled(false)
+{
+    for (size_t i = 0; i < IoClassCount; i++)
+        Inflight[i] = 0;
+    for (size_t i = 0; i < IoSchedulerLatencyBuckets; i++)
+        LatencyHistogram[i] = 0;
+}
+
+IoScheduler::~IoScheduler()
+{
+}
+
+void IoScheduler::SetPolled(bool polled)
+{
+    trace(1, "IoScheduler 0x%p polled %d", this, polled);
+    Polled = polled;
+}
+
+size_t IoScheduler::GetLimitLocked(unsigned int ioClass)
+{
+    const IoClassInfo& info = IoClassTable[ioClass];
+
+    unsigned int totalWeight = 0;
+    for (size_t i = 0; i < IoClassCount; i++)
+        totalWeight += IoClassTable[i].Weight;
+
+    //Foreground classes may use the whole depth, background ones get their
+    //weighted share shrunk while foreground tail latency is over target
+    size_t limit = info.MaxInflight;
+    if (!info.Foreground)
+    {
+        limit = Core::Memory::Min<size_t>(limit, (IoSchedulerDepth * info.Weight) / totalWeight);
+        limit = limit >> ThrottleShift;
+    }
+
+    return (limit != 0) ? limit : 1;
+}
+
+void IoScheduler::AddLatencyLocked(uint64_t latencyUs)
+{
+    size_t bucket = 0;
+    while (bucket < (IoSchedulerLatencyBuckets - 1) && (static_cast<uint64_t>(1) << bucket) < latencyUs)
+        bucket++;
+
+    LatencyHistogram[bucket]++;
+    LatencySamples++;
+    if (LatencySamples < IoSchedulerSampleWindow)
+        return;
+
+    uint64_t threshold = (LatencySamples * 99) / 100;
+    uint64_t count = 0;
+    for (bucket = 0; bucket < IoSchedulerLatencyBuckets; bucket++)
+    {
+        count += LatencyHistogram[bucket];
+        if (count >= threshold)
+            break;
+    }
+    ForegroundP99Us = static_cast<uint64_t>(1) << bucket;
+
+    if (ForegroundP99Us > IoSchedulerTargetP99Us)
+    {
+        if (ThrottleShift < IoSchedulerMaxThrottleShift)
+            ThrottleShift++;
+    }
+    else if (ForegroundP99Us <= IoSchedulerTargetP99Us / 2)
+    {
+        if (ThrottleShift > 0)
+            ThrottleShift--;
+    }
+
+    for (bucket = 0; bucket < IoSchedulerLatencyBuckets; bucket++)
+        LatencyHistogram[bucket] = 0;
+    LatencySamples = 0;
+}
+
+bool IoScheduler::IsForeground(unsigned int ioClass)
+{
+    return IoClassTable[ioClass].Foreground;
+}
+
+int IoScheduler::GetPrioClass(unsigned int ioClass)
+{
+    return IoClassTable[ioClass].PrioClass;
+}
+
+bool IoScheduler::AdmitLocked(unsigned int ioClass, size_t count)
+{
+    //List larger than the limit goes alone so it can't wait forever
+    if (Inflight[ioClass] != 0 && (Inflight[ioClass] + count) > GetLimitLocked(ioClass))
+        return false;
+
+    Inflight[ioClass] += count;
+    return true;
+}
+
+uint64_t IoScheduler::Begin(unsigned int ioClass, size_t count)
+{
+    for (;;)
+    {
+        {
+            //Slots are freed under Lock, so a release after the check wakes the wait
+            Core::AutoLock lock(Lock);
+            SlotEvent.Reset();
+            if (AdmitLocked(ioClass, count))
+                break;
+        }
+
+        SlotEvent.Wait(1);
+    }
+
+    return Core::Time::GetTime();
+}
+
+bool IoScheduler::TryBegin(unsigned int ioClass, size_t count, uint64_t& startTime)
+{
+    {
+        Core::AutoLock lock(Lock);
+        if (!AdmitLocked(ioClass, count))
+            return false;
+    }
+
+    startTime = Core::Time::GetTime();
+    return true;
+}
+
+void IoScheduler::End(unsigned int ioClass, size_t count, uint64_t startTime)
+{
+    uint64_t latencyUs = (Core::Time::GetTime() - startTime) / 1000;
+
+    {
+        Core::AutoLock lock(Lock);
+        Inflight[ioClass] -= count;
+        if (IoClassTable[ioClass].Foreground)
+            AddLatencyLocked(latencyUs);
+    }
+
+    SlotEvent.SetAll();
+}
+
+uint64_t IoScheduler::GetForegroundP99Us()
+{
+    Core::AutoLock lock(Lock);
+    return ForegroundP99Us;
+}
+
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <core/error.h>
+#include <core/bio.h>
+#include <core/spinlock.h>
+#include <core/event.h>
+#include <core/type.h>
+
+namespace KStor
+{
+
+const unsigned int IoClassRead = 0;
+const unsigned int IoClassCommit = 1;
+const unsigned int IoClassCheckpoint = 2;
+const unsigned int IoClassBackground = 3;
+const unsigned int IoClassCount = 4;
+
+const size_t IoSchedulerDepth = 64;
+const size_t IoSchedulerLatencyBuckets = 32;
+const size_t IoSchedulerSampleWindow = 256;
+const uint64_t IoSchedulerTargetP99Us = 4000;
+const unsigned int IoSchedulerMaxThrottleShift = 4;
+
+class IoScheduler;
+
+//State of a background submission, slots are released from bio completion
+//so it must stay alive until the list is waited for
+template<Core::Memory::PoolType PoolType = Core::Memory::PoolType::Kernel>
+struct IoAsync
+{
+    IoAsync()
+        : Scheduler(nullptr)
+        , IoClass(0)
+        , Count(0)
+        , StartTime(0)
+        , Handler(nullptr)
+        , Ctx(nullptr)
+    {
+    }
+
+    IoScheduler* Scheduler;
+    unsigned int IoClass;
+    size_t Count;
+    uint64_t StartTime;
+    typename Core::BioList<PoolType>::CompletionHandlerType Handler;
+    void* Ctx;
+};
+
+struct IoClassInfo
+{
+    unsigned int Weight;
+    size_t MaxInflight;
+    bool Foreground;
+    int PrioClass;
+};
+
+class IoScheduler
+{
+public:
+    IoScheduler();
+    virtual ~IoScheduler();
+
+    //Marks the list with the class sync flag and priority
+    template<Core::Memory::PoolType PoolType>
+    void Prepare(Core::BioList<PoolType>& bioList, unsigned int ioClass)
+    {
+        bioList.SetSync(IsForeground(ioClass));
+        bioList.SetPriority(GetPrioClass(ioClass), 0);
+        bioList.SetPolled(Polled && IsForeground(ioClass));
+    }
+
+    //Foreground I/O is completed by polling instead of interrupts
+    void SetPolled(bool polled);
+
+    //Waits for in-flight slots of the class, one per bio
+    uint64_t Begin(unsigned int ioClass, size_t count);
+    bool TryBegin(unsigned int ioClass, size_t count, uint64_t& startTime);
+    void End(unsigned int ioClass, size_t count, uint64_t startTime);
+
+    template<Core::Memory::PoolType PoolType>
+    Core::Error SubmitWait(Core::BioList<PoolType>& bioList, unsigned int ioClass, bool preflushFua = false)
+    {
+        Prepare(bioList, ioClass);
+
+        size_t count = bioList.Count();
+        uint64_t startTime = Begin(ioClass, count);
+        auto err = bioList.SubmitWaitResult(preflushFua);
+        End(ioClass, count, startTime);
+
+        return err;
+    }
+
+    //With tryOnly nothing is submitted and Again is returned while the class is full
+    template<Core::Memory::PoolType PoolType>
+    Core::Error SubmitAsync(Core::BioList<PoolType>& bioList, unsigned int ioClass, IoAsync<PoolType>& io,
+        typename Core::BioList<PoolType>::CompletionHandlerType handler = nullptr, void* ctx = nullptr,
+        bool tryOnly = false)
+    {
+        Prepare(bioList, ioClass);
+
+        io.Scheduler = this;
+        io.IoClass = ioClass;
+        io.Count = bioList.Count();
+        io.Handler = handler;
+        io.Ctx = ctx;
+        if (tryOnly)
+        {
+            if (!TryBegin(ioClass, io.Count, io.StartTime))
+                return MakeError(Core::Error::Again);
+        }
+        else
+        {
+            io.StartTime = Begin(ioClass, io.Count);
+        }
+
+        auto err = bioList.SubmitAsync(&IoScheduler::AsyncComplete<PoolType>, &io);
+        if (!err.Ok())
+            End(ioClass, io.Count, io.StartTime);
+
+        return err;
+    }
+
+    uint64_t GetForegroundP99Us();
+
+private:
+    IoScheduler(const IoScheduler& other) = delete;
+    IoScheduler(IoScheduler&& other) = delete;
+    IoScheduler& operator=(const IoScheduler& other) = delete;
+    IoScheduler& operator=(IoScheduler&& other) = delete;
+
+    template<Core::Memory::PoolType PoolType>
+    static void AsyncComplete(Core::BioList<PoolType>* bioList, void* ctx)
+    {
+        auto io = static_cast<IoAsync<PoolType>*>(ctx);
+
+        io->Scheduler->End(io->IoClass, io->Count, io->StartTime);
+        if (io->Handler != nullptr)
+            io->Handler(bioList, io->Ctx);
+    }
+
+    bool IsForeground(unsigned int ioClass);
+    bool AdmitLocked(unsigned int ioClass, size_t count);
+    int GetPrioClass(unsigned int ioClass);
+    size_t GetLimitLocked(unsigned int ioClass);
+    void AddLatencyLocked(uint64_t latencyUs);
+
+    size_t Inflight[IoClassCount];
+    uint64_t LatencyHistogram[IoSchedulerLatencyBuckets];
+    uint64_t LatencySamples;
+    uint64_t ForegroundP99Us;
+    unsigned int ThrottleShift;
+    bool Polled;
+    Core::SpinLock Lock;
+    Core::Event SlotEvent;
+};
+
+}
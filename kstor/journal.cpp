@@ -10,31 +10,81 @@
 #include <core/auto_lock.h>
 #include <core/shared_auto_lock.h>
 #include <core/bug.h>
+#include <core/random.h>
+#include <core/smp.h>
+#include <core/time.h>
 
 namespace KStor
 {
 
 Journal::Journal(Volume& volume)
     : VolumeRef(volume)
+    , StreamCount(0)
+    , GlobalSequence(0)
     , Start(0)
     , Size(0)
     , State(JournalStateNew)
 {
+    Core::InitializeListHead(&FreeRetainedPages);
+    //Pool never grows under the lock, a failed reserve just disables it
+    TxPool.Reserve(JournalTxPoolSize);
     trace(1, "Journal 0x%p ctor", this);
 }
 
-Core::Error Journal::Load(uint64_t start)
+Core::Error Journal::CreateStreams(uint64_t streamCount)
+{
+    if (streamCount == 0 || streamCount > JournalMaxStreams)
+        return MakeError(Core::Error::InvalidValue);
+
+    //Reserves cover every batch a stream can have in flight plus its header write,
+    //pages of earlier streams may still be out so the pools are kept once created
+    bool createPools = (StreamCount == 0);
+    if (createPools)
+    {
+        auto err = WriteBioSet.Create(static_cast<unsigned int>(JournalMaxStreams * JournalBioSetPerStream));
+        if (!err.Ok())
+            return err;
+
+        err = WritePagePool.Create(static_cast<int>(JournalMaxStreams * JournalPagePoolPerStream));
+        if (!err.Ok())
+        {
+            WriteBioSet.Delete();
+            return err;
+        }
+    }
+
+    for (size_t i = 0; i < streamCount; i++)
+    {
+        Streams[i] = Core::MakeUnique<JournalStream, Core::Memory::PoolType::Kernel>(*this, i);
+        if (Streams[i].Get() == nullptr)
+        {
+            for (size_t j = 0; j < i; j++)
+                Streams[j].Reset();
+            if (createPools)
+            {
+                WritePagePool.Delete();
+                WriteBioSet.Delete();
+            }
+            return MakeError(Core::Error::NoMemory);
+        }
+    }
+
+    StreamCount = streamCount;
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error Journal::Load(uint64_t start, const Guid& journalId)
 {
     Core::AutoLock lock(Lock);
     if (State != JournalStateNew)
         return MakeError(Core::Error::InvalidState);
 
     Core::Error err;
-    auto page = Core::Page<>::Create(err);
+    auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
     if (!err.Ok())
         return err;
 
-    err = Core::BioList<>(VolumeRef.GetDevice()).SubmitWaitResult(page,
+    err = Core::NoIOBioList(GetDevice()).SubmitWaitResult(page,
                                                     start * GetBlockSize(), false);
     if (!err.Ok())
         return err;
@@ -55,28 +105,39 @@ Core::Error Journal::Load(uint64_t start)
         return MakeError(Core::Error::DataCorrupt);
     }
 
-    uint64_t size = Core::BitOps::Le64ToCpu(header->Size);
+    if (Guid(header->JournalId) != journalId)
+    {
+        trace(0, "Journal 0x%p journalId %s mismatch", this, Guid(header->JournalId).ToString().GetConstBuf());
+        return MakeError(Core::Error::NotFound);
+    }
 
-    if (size <= 1)
-        return MakeError(Core::Error::BadSize);
+    uint64_t size = Core::BitOps::Le64ToCpu(header->Size);
+    uint64_t streamCount = Core::BitOps::Le64ToCpu(header->StreamCount);
 
-    uint64_t logSize = Core::BitOps::Le64ToCpu(header->LogSize);
-    uint64_t logStartIndex = Core::BitOps::Le64ToCpu(header->LogStartIndex);
-    uint64_t logEndIndex = Core::BitOps::Le64ToCpu(header->LogEndIndex);
-    uint64_t logCapacity = Core::BitOps::Le64ToCpu(header->LogCapacity);
+    trace(1, "Journal 0x%p load, size %llu streams %llu", this, size, streamCount);
 
-    trace(1, "Journal 0x%p load, logStartIndex %llu logEndIndex %llu logSize %llu logCapacity %llu",
-        this, logStartIndex, logEndIndex, logSize, logCapacity);
+    if (streamCount == 0 || streamCount > JournalMaxStreams)
+        return MakeError(Core::Error::BadSize);
 
-    if (logCapacity != (size - 1))
+    if (size <= 1 || ((size - 1) / streamCount) <= 1)
         return MakeError(Core::Error::BadSize);
 
+    err = CreateStreams(streamCount);
+    if (!err.Ok())
+        return err;
+
+    uint64_t streamSize = (size - 1) / StreamCount;
+    for (size_t i = 0; i < StreamCount; i++)
     {
-        Core::AutoLock lock(LogRbLock);
-        if (!LogRb.Reset(logStartIndex, logEndIndex, logSize, logCapacity))
-            return MakeError(Core::Error::BadSize);
+        err = Streams[i]->Load(start + 1 + i * streamSize, streamSize);
+        if (!err.Ok())
+        {
+            trace(0, "Journal 0x%p stream %lu load error %d", this, i, err.GetCode());
+            return err;
+        }
     }
 
+    JournalId = journalId;
     Start = start;
     Size = size;
 
@@ -93,20 +154,19 @@ Core::Error Journal::Load(uint64_t start)
         }
     }
 
-    Core::AString name("kstor-jrnl", err);
-    if (!err.Ok())
-    {
-        return err;
-    }
-
-    TxThread = Core::MakeUnique<Core::Thread, Core::Memory::PoolType::Kernel>(name, this, err);
-    if (TxThread.Get() == nullptr)
+    for (size_t i = 0; i < StreamCount; i++)
     {
-        return MakeError(Core::Error::NoMemory);
+        err = Streams[i]->StartThread();
+        if (!err.Ok())
+        {
+            for (size_t j = 0; j < i; j++)
+                Streams[j]->StopThread();
+            return err;
+        }
     }
 
     State = JournalStateRunning;
-    trace(1, "Journal 0x%p start %llu size %llu", this, Start, Size);
+    trace(1, "Journal 0x%p start %llu size %llu streams %lu", this, Start, Size, StreamCount);
 
     return MakeError(Core::Error::Success);
 }
@@ -119,8 +179,31 @@ Core::Error Journal::Format(uint64_t start, uint64_t size)
     if (State != JournalStateNew)
         return MakeError(Core::Error::InvalidState);
 
-    Core::Error err;
-    auto page = Core::Page<>::Create(err);
+    uint64_t streamCount = Core::Memory::Min<uint64_t>(JournalMaxStreams, (size - 1) / JournalStreamMinSize);
+    if (streamCount == 0)
+        streamCount = 1;
+
+    if (((size - 1) / streamCount) <= 1)
+        return MakeError(Core::Error::InvalidValue);
+
+    Guid journalId;
+    Core::Error err = journalId.Generate();
+    if (!err.Ok())
+        return err;
+
+    err = CreateStreams(streamCount);
+    if (!err.Ok())
+        return err;
+
+    uint64_t streamSize = (size - 1) / StreamCount;
+    for (size_t i = 0; i < StreamCount; i++)
+    {
+        err = Streams[i]->Format(start + 1 + i * streamSize, streamSize);
+        if (!err.Ok())
+            return err;
+    }
+
+    auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
     if (!err.Ok())
         return err;
     
@@ -130,17 +213,14 @@ Core::Error Journal::Format(uint64_t start, uint64_t size)
 
     header->Magic = Core::BitOps::CpuToLe32(Api::JournalMagic);
     header->Size = Core::BitOps::CpuToLe64(size);
-
-    header->LogSize = Core::BitOps::CpuToLe64(0);
-    header->LogStartIndex = Core::BitOps::CpuToLe64(0);
-    header->LogEndIndex = Core::BitOps::CpuToLe64(0);
-    header->LogCapacity = Core::BitOps::CpuToLe64(size - 1);
+    header->StreamCount = Core::BitOps::CpuToLe64(StreamCount);
+    header->JournalId = journalId.GetContent();
 
     Core::XXHash::Sum(header, OFFSET_OF(Api::JournalHeader, Hash), header->Hash);
 
-    trace(1, "Journal 0x%p start %llu size %llu", this, start, size);
+    trace(1, "Journal 0x%p start %llu size %llu streams %lu", this, start, size, StreamCount);
 
-    err = Core::BioList<>(VolumeRef.GetDevice()).SubmitWaitResult(page,
+    err = Core::NoIOBioList(GetDevice()).SubmitWaitResult(page,
                                                         start * GetBlockSize(), true, true);
     if (!err.Ok())
     {
@@ -148,6 +228,7 @@ Core::Error Journal::Format(uint64_t start, uint64_t size)
         return err;
     }
 
+    JournalId = journalId;
     Start = start;
     Size = size;
 
@@ -164,62 +245,50 @@ uint64_t Journal::GetSize()
     return Size;
 }
 
+const Guid& Journal::GetJournalId() const
+{
+    return JournalId;
+}
+
+Core::BlockDevice& Journal::GetDevice()
+{
+    return VolumeRef.GetJournalDevice();
+}
+
 Journal::~Journal()
 {
     trace(1, "Journal 0x%p dtor", this);
     Unload();
+
+    //Pooled txs and streams return retained pages to the free list, so they go first
+    TxPool.Clear();
+    for (size_t i = 0; i < StreamCount; i++)
+        Streams[i].Reset();
+
+    while (!Core::IsListEmpty(&FreeRetainedPages))
+        delete CONTAINING_RECORD(Core::RemoveHeadList(&FreeRetainedPages), JournalRetainedPages, Link);
 }
 
 Transaction::Transaction(Journal& journal, Core::Error& err)
     : JournalRef(journal)
+    , Stream(nullptr)
+    , Pending(false)
+    , Journaled(false)
+    , ReservedBlocks(0)
     , State(Api::JournalTxStateNew)
 {
+    Core::InitializeListHead(&RetainedPages);
+
     if (!err.Ok())
         return;
     
     err = TxId.Generate();
     if (!err.Ok())
         return;
-    
-    BeginBlock = CreateTxBlock(Api::JournalBlockTypeTxBegin);
-    if (BeginBlock.Get() == nullptr)
-    {
-        err = MakeError(Core::Error::NoMemory);
-        return;
-    }
 
-    CommitBlock = CreateTxBlock(Api::JournalBlockTypeTxCommit);
-    if (CommitBlock.Get() == nullptr)
-    {
-        err = MakeError(Core::Error::NoMemory);
-        BeginBlock.Reset();
-        return;
-    }
     trace(1, "Tx 0x%p %s ctor", this, TxId.ToString().GetConstBuf());
 }
 
-JournalTxBlockPtr Transaction::CreateTxBlock(unsigned int type)
-{
-    JournalTxBlockPtr block = Core::MakeShared<Api::JournalTxBlock, Core::Memory::PoolType::Kernel>();
-    if (block.Get() == nullptr)
-        return block;
-
-    switch (type)
-    {
-    case Api::JournalBlockTypeTxBegin:
-    case Api::JournalBlockTypeTxCommit:
-    case Api::JournalBlockTypeTxData:
-        block->TxId = TxId.GetContent();
-        block->Type = type;
-        break;
-    default:
-        block.Reset();
-        break;
-    }
-
-    return block;
-}
-
 Transaction::~Transaction()
 {
     trace(1, "Tx 0x%p %s dtor", this, TxId.ToString().GetConstBuf());
@@ -227,7 +296,7 @@ Transaction::~Transaction()
     JournalRef.UnlinkTx(this, false);
 }
 
-Core::Error Transaction::Write(const Core::PageInterface& page, uint64_t position)
+Core::Error Transaction::Write(const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page, uint64_t position)
 {
     Core::AutoLock lock(Lock);
 
@@ -235,46 +304,17 @@ Core::Error Transaction::Write(const Core::PageInterface& page, uint64_t positio
         return MakeError(Core::Error::InvalidState);
 
     trace(1, "Tx 0x%p %s write %llu data %s",
-        this, TxId.ToString().GetConstBuf(), position, page.ToHex(16).GetConstBuf());
+        this, TxId.ToString().GetConstBuf(), position, page->ToHex(16).GetConstBuf());
+
+    if (page->GetSize() != JournalRef.GetBlockSize())
+        return MakeError(Core::Error::InvalidValue);
 
-    auto err = JournalRef.CheckPosition(position, page.GetSize());
+    auto err = JournalRef.CheckPosition(position, page->GetSize());
     if (!err.Ok())
         return err;
 
-    Core::LinkedList<JournalTxBlockPtr> blockList;
-    unsigned int index = DataBlockList.Count();
-    size_t off = 0;
-    while (off < page.GetSize())
-    {
-        if (position & 511)
-            return MakeError(Core::Error::InvalidValue);
-
-        auto blockPtr = CreateTxBlock(Api::JournalBlockTypeTxData);
-        if (blockPtr.Get() == nullptr)
-        {
-            return MakeError(Core::Error::NoMemory);
-        }
-
-        Api::JournalTxDataBlock* block = reinterpret_cast<Api::JournalTxDataBlock*>(blockPtr.Get());
-        size_t sizeToRead = (sizeof(block->Data) / 512) * 512;
-        if (sizeToRead == 0)
-            return MakeError(Core::Error::InvalidValue);
-
-        size_t read = page.Read(block->Data, sizeToRead, off);
-        block->Position = position;
-        block->DataSize = read;
-        block->Index = index;
-        if (!blockList.AddTail(blockPtr))
-        {
-            return MakeError(Core::Error::NoMemory);
-        }
-
-        off += read;
-        position += read;
-        index++;
-    }
-
-    DataBlockList.AddTail(Core::Memory::Move(blockList));
+    if (!DataBlockList.PushBack(JournalDataBlock(position, page)))
+        return MakeError(Core::Error::NoMemory);
 
     return MakeError(Core::Error::Success);
 }
@@ -286,58 +326,58 @@ const Guid& Transaction::GetTxId() const
 
 Core::Error Transaction::Commit()
 {
-    {
-        Core::AutoLock lock(Lock);
+    auto err = StartCommit();
+    if (!err.Ok())
+        return err;
 
-        if (State != Api::JournalTxStateNew)
-            return MakeError(Core::Error::InvalidState);
+    return WaitCommit();
+}
 
-        State = Api::JournalTxStateCommiting;
-        Core::Error err = JournalRef.StartCommitTx(this);
-        if (!err.Ok())
-        {
-            State = Api::JournalTxStateCanceled;
-            JournalRef.UnlinkTx(this, false);
-            return err;
-        }
-    }
+Core::Error Transaction::StartCommit()
+{
+    Core::AutoLock lock(Lock);
 
-    CommitEvent.Wait();
+    if (State != Api::JournalTxStateNew)
+        return MakeError(Core::Error::InvalidState);
 
-    Core::Error err;
+    State = Api::JournalTxStateCommiting;
+    Core::Error err = JournalRef.StartCommitTx(this);
+    if (!err.Ok())
     {
-        Core::AutoLock lock(Lock);
-        if (!CommitResult.Ok())
-        {
-            return CommitResult;
-        }
+        State = Api::JournalTxStateCanceled;
+        JournalRef.UnlinkTx(this, false);
+        return err;
+    }
 
-        if (State != Api::JournalTxStateCommited)
-        {
-            return MakeError(Core::Error::InvalidState);
-        }
+    return err;
+}
 
-        err = JournalRef.ApplyBlocks(DataBlockList, false);
-        if (!err.Ok())
-        {
-            trace(0, "Tx 0x%p %s apply error %d", this, TxId.ToString().GetConstBuf(), err.GetCode());
-        }
+Core::Error Transaction::WaitCommit()
+{
+    CommitEvent.Wait();
+
+    Core::AutoLock lock(Lock);
+    if (!CommitResult.Ok())
+    {
+        return CommitResult;
     }
 
-    if (err.Ok())
+    if (State != Api::JournalTxStateCommited)
     {
-        err = JournalRef.EraseTx(this);
-        if (!err.Ok())
-        {
-            trace(0, "Tx 0x%p %s erase error %d", this, TxId.ToString().GetConstBuf(), err.GetCode());
-        }
+        return MakeError(Core::Error::InvalidState);
     }
 
-    //Return success despite apply/erase tx errors
-    //due to tx already commited into log
     return MakeError(Core::Error::Success);
 }
 
+Core::Error Transaction::WaitJournaled()
+{
+    JournaledEvent.Wait();
+
+    Core::AutoLock lock(Lock);
+    return JournaledResult;
+}
+
 void Transaction::Cancel()
 {
     Core::AutoLock lock(Lock);
@@ -347,78 +387,23 @@ void Transaction::Cancel()
     CommitResult = MakeError(Core::Error::Cancelled);
 }
 
-Core::Error Transaction::WriteTx(Core::NoIOBioList& bioList)
+void Transaction::OnJournaledLocked(const Core::Error& result)
 {
-    Core::Error err;
-    Core::AutoLock lock(Lock);
-
-    if (State != Api::JournalTxStateCommiting)
-    {
-        err = MakeError(Core::Error::InvalidState);
-        goto fail;
-    }
-
-    size_t index;
-    err = JournalRef.GetNextIndex(index);
-    if (!err.Ok())
-        goto fail;
-
-    if (!IndexList.AddTail(index))
-    {
-        err = MakeError(Core::Error::NoMemory);
-        goto fail;
-    }
-
-    err = JournalRef.WriteTxBlock(index, BeginBlock, bioList);
-    if (!err.Ok())
-        goto fail;
-
-    {
-        auto it = DataBlockList.GetIterator();
-        for (;it.IsValid(); it.Next())
-        {
-            auto block = it.Get();
-            err = JournalRef.GetNextIndex(index);
-            if (!err.Ok())
-                goto fail;
-
-            if (!IndexList.AddTail(index))
-            {
-                err = MakeError(Core::Error::NoMemory);
-                goto fail;
-            }
-
-            err = JournalRef.WriteTxBlock(index, block, bioList);
-            if (!err.Ok())
-                goto fail;
-        }
-    }
-
-    err = JournalRef.GetNextIndex(index);
-    if (!err.Ok())
-        goto fail;
+    if (Journaled)
+        return;
 
-    if (!IndexList.AddTail(index))
-    {
-        err = MakeError(Core::Error::NoMemory);
-        goto fail;
-    }
+    trace(1, "Tx 0x%p %s journaled %d", this, TxId.ToString().GetConstBuf(), result.GetCode());
 
-    {
-        Api::JournalTxCommitBlock *commitBlock = reinterpret_cast<Api::JournalTxCommitBlock*>(CommitBlock.Get());
-        commitBlock->State = Api::JournalTxStateCommited;
-        commitBlock->BlockCount = DataBlockList.Count();
-        err = JournalRef.WriteTxBlock(index, CommitBlock, bioList);
-        if (!err.Ok())
-            goto fail;
-    }
+    Journaled = true;
+    JournaledResult = result;
+    JournaledEvent.SetAll();
+}
 
-    return err;
+void Transaction::OnJournaled(const Core::Error& result)
+{
+    Core::AutoLock lock(Lock);
 
-fail:
-    IndexList.Clear();
-    OnCommitCompleteLocked(err);
-    return err;
+    OnJournaledLocked(result);
 }
 
 void Transaction::OnCommitCompleteLocked(const Core::Error& result)
@@ -434,7 +419,9 @@ void Transaction::OnCommitCompleteLocked(const Core::Error& result)
     else
     {
         State = Api::JournalTxStateCommited;
+        JournalRef.UnlinkTx(this, false);
     }
+    OnJournaledLocked(result);
     CommitResult = result;
     CommitEvent.SetAll();
 }
@@ -446,11 +433,6 @@ void Transaction::OnCommitComplete(const Core::Error& result)
     OnCommitCompleteLocked(result);
 }
 
-Core::LinkedList<size_t>& Transaction::GetIndexList()
-{
-    return IndexList;
-}
-
 void Transaction::AcquireLock()
 {
     Lock.Acquire();
@@ -466,137 +448,389 @@ unsigned int Transaction::GetState()
     return State;
 }
 
-Transaction::Ptr Journal::BeginTx()
+Core::Error Transaction::Reset()
 {
-    Core::SharedAutoLock lock(Lock);
-
-    if (State != JournalStateRunning)
-        return Transaction::Ptr();
-
-    Core::Error err;
-    Transaction::Ptr tx = Core::MakeShared<Transaction, Core::Memory::PoolType::Kernel>(*this, err);
-    if (tx.Get() == nullptr)
-    {
-        return tx;
-    }
+    Core::AutoLock lock(Lock);
 
-    if (!err.Ok())
-    {
-        tx.Reset();
-        return tx;
-    }
+    Stream = nullptr;
+    Pending = false;
+    Journaled = false;
+    ReservedBlocks = 0;
+    State = Api::JournalTxStateNew;
+    CommitResult.Reset();
+    JournaledResult.Reset();
+    CommitEvent.Reset();
+    JournaledEvent.Reset();
+    return TxId.Generate();
+}
 
-    if (!TxTable.Insert(tx->GetTxId(), tx))
-    {
-        tx.Reset();
-        return tx;
-    }
+void Transaction::DropBlocks()
+{
+    Core::AutoLock lock(Lock);
 
-    return tx;
+    for (size_t i = 0; i < DataBlockList.GetSize(); i++)
+        DataBlockList[i].DataPage.Reset();
+    DataBlockList.Truncate(0);
 }
 
-void Journal::UnlinkTx(Transaction* tx, bool cancel)
+JournalBatch::JournalBatch(Core::BlockDevice& device, Core::BioSet& bioSet, Core::Error& err)
+    : Sequence(0)
+    , DataBioList(device)
+    , CommitBioList(device)
+    , LogEndIndex(0)
+    , BlockCount(0)
+    , AbsorbedCount(0)
 {
-    trace(1, "Journal 0x%p tx 0x%p %s unlink cancel %d",
-        this, tx, tx->GetTxId().ToString().GetConstBuf(), cancel);
-
-    bool exist;
-    auto txPtr = TxTable.Lookup(tx->GetTxId(), exist);
-    if (!exist || txPtr.Get() != tx)
+    if (!err.Ok())
         return;
 
-    TxTable.Delete(tx->GetTxId());
+    DataBioList.SetBioSet(&bioSet);
+    CommitBioList.SetBioSet(&bioSet);
+
+    err = TxId.Generate();
 }
 
-Core::Error Journal::StartCommitTx(Transaction* tx)
+JournalBatch::~JournalBatch()
 {
-    Core::SharedAutoLock lock(Lock);
+}
 
+Core::Error JournalBatch::AddBlock(const JournalDataBlock& block)
+{
+    //Newest version of the same block replaces older one, older one is dropped
+    //from its place and newest is appended to keep order against partial overlaps
     bool exist;
-    auto txPtr = TxTable.Lookup(tx->GetTxId(), exist);
-    if (!exist || txPtr.Get() != tx)
-        return MakeError(Core::Error::NotFound);
-
+    size_t index = PositionTree.Lookup(block.Position, exist);
+    if (exist)
     {
-        Core::AutoLock lock(TxListLock);
-        if (!TxList.AddTail(txPtr))
-            return MakeError(Core::Error::NoMemory);
-        TxListEvent.SetAll();
+        BlockList[index].DataPage.Reset();
+        BlockCount--;
+        AbsorbedCount++;
+        PositionTree.Delete(block.Position);
     }
 
-    trace(1, "Journal 0x%p tx 0x%p %s start commit",
-        this, txPtr.Get(), txPtr->GetTxId().ToString().GetConstBuf());
+    if (!BlockList.PushBack(block))
+        return MakeError(Core::Error::NoMemory);
+
+    if (!PositionTree.Insert(block.Position, BlockList.GetSize() - 1))
+        return MakeError(Core::Error::NoMemory);
 
+    BlockCount++;
     return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::WriteTx(const Transaction::Ptr& tx, Core::NoIOBioList& bioList)
+Core::Error JournalBatch::AddTx(const Transaction::Ptr& tx)
 {
-    Core::AutoLock lock(Lock);
-    Core::Error err;
+    Core::AutoLock lock(tx->Lock);
+
+    if (tx->State != Api::JournalTxStateCommiting)
+        return MakeError(Core::Error::InvalidState);
 
-    trace(1, "Journal 0x%p tx 0x%p %s write",
-        this, tx.Get(), tx->GetTxId().ToString().GetConstBuf());
+    for (size_t i = 0; i < tx->DataBlockList.GetSize(); i++)
+    {
+        auto err = AddBlock(tx->DataBlockList[i]);
+        if (!err.Ok())
+            return err;
+    }
 
-    return tx->WriteTx(bioList);
+    return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::Run(const Core::Threadable& thread)
+Transaction::Ptr Journal::BeginTx()
 {
+    Core::SharedAutoLock lock(Lock);
+
+    if (State != JournalStateRunning)
+        return Transaction::Ptr();
+
     Core::Error err;
-    trace(1, "Journal 0x%p tx thread start", this);
+    Transaction::Ptr tx;
+    {
+        Core::AutoLock lock(TxPoolLock);
+        size_t size = TxPool.GetSize();
+        if (size != 0)
+        {
+            tx = Core::Memory::Move(TxPool[size - 1]);
+            TxPool.Truncate(size - 1);
+        }
+    }
 
-    Core::LinkedList<Transaction::Ptr> txList;
-    while (!thread.IsStopping())
+    if (tx.Get() != nullptr)
+        err = tx->Reset();
+    else
+        tx = Core::MakeShared<Transaction, Core::Memory::PoolType::Kernel>(*this, err);
+
+    if (tx.Get() == nullptr)
+    {
+        return tx;
+    }
+
+    if (!err.Ok())
     {
-        TxListEvent.Wait(10);
+        tx.Reset();
+        return tx;
+    }
 
-        if (TxList.IsEmpty())
-            continue;
+    tx->Self = tx;
+    return tx;
+}
+
+void Journal::EndTx(Transaction::Ptr& tx)
+{
+    //Unlinked txs hold no reference to themselves, so nobody else can see this one
+    if (tx.Get() != nullptr && tx.GetCounter() == 1)
+    {
+        tx->DropBlocks();
+
+        Core::AutoLock lock(TxPoolLock);
+        if (TxPool.GetSize() < TxPool.GetCapacity())
+            TxPool.PushBack(Core::Memory::Move(tx));
+    }
+
+    tx.Reset();
+}
+
+void Journal::UnlinkTx(Transaction* tx, bool cancel)
+{
+    trace(1, "Journal 0x%p tx 0x%p %s unlink cancel %d",
+        this, tx, tx->GetTxId().ToString().GetConstBuf(), cancel);
+
+    ReleasePendingPages(tx);
+    if (tx->Stream != nullptr)
+        tx->Stream->ReleaseSpace(tx);
+
+    //Callers hold a reference of their own, this is never the last one
+    tx->Self.Reset();
+}
+
+Core::Error Journal::AcquirePendingPages(Transaction* tx, size_t& streamIndex)
+{
+    //Retaining the pages after the tx is logged must not fail, or they would stay
+    //routed to the stream for good
+    {
+        Core::AutoLock lock(PendingLock);
+        auto err = GetRetainedPagesLocked(tx);
+        if (!err.Ok())
+            return err;
+    }
 
+    for (;;)
+    {
+        size_t index = 0;
+        size_t conflictIndex = 0;
         {
-            Core::AutoLock lock(TxListLock);
-            txList = Core::Memory::Move(TxList);
+            Core::AutoLock lock(PendingLock);
+            //Pages are released under PendingLock, so a release after the check wakes the wait
+            PendingEvent.Reset();
+            bool found = false;
+            bool conflict = false;
+
+            for (size_t i = 0; i < tx->DataBlockList.GetSize() && !conflict; i++)
+            {
+                auto& block = tx->DataBlockList[i];
+                uint64_t lastPage = (block.Position + block.DataPage->GetSize() - 1) / Api::PageSize;
+                for (uint64_t page = block.Position / Api::PageSize; page <= lastPage; page++)
+                {
+                    bool exist;
+                    auto pending = PendingPages.Lookup(page, exist);
+                    if (!exist)
+                        continue;
+
+                    if (found && pending.StreamIndex != index)
+                    {
+                        conflict = true;
+                        conflictIndex = pending.StreamIndex;
+                        break;
+                    }
+
+                    found = true;
+                    index = pending.StreamIndex;
+                }
+            }
+
+            if (!conflict)
+            {
+                if (!found)
+                {
+                    Core::Smp::PreemptDisable();
+                    index = Core::Smp::GetCpuId() % StreamCount;
+                    Core::Smp::PreemptEnable();
+                }
+
+                size_t acquired = 0;
+                for (size_t i = 0; i < tx->DataBlockList.GetSize(); i++)
+                {
+                    auto& block = tx->DataBlockList[i];
+                    uint64_t lastPage = (block.Position + block.DataPage->GetSize() - 1) / Api::PageSize;
+                    for (uint64_t page = block.Position / Api::PageSize; page <= lastPage; page++)
+                    {
+                        bool exist;
+                        auto pending = PendingPages.Lookup(page, exist);
+                        if (exist)
+                            PendingPages.Delete(page);
+
+                        if (!PendingPages.Insert(page, JournalPendingPage(index, pending.Count + 1)))
+                        {
+                            if (exist)
+                                PendingPages.Insert(page, pending);
+                            PutPendingPagesLocked(tx, acquired);
+                            PutRetainedPagesLocked(&tx->RetainedPages);
+                            return MakeError(Core::Error::NoMemory);
+                        }
+                        acquired++;
+                    }
+                }
+
+                streamIndex = index;
+                return MakeError(Core::Error::Success);
+            }
         }
 
-        Core::NoIOBioList bioList(VolumeRef.GetDevice());
+        trace(3, "Journal 0x%p tx 0x%p %s waits for conflicting streams %lu %lu",
+            this, tx, tx->GetTxId().ToString().GetConstBuf(), index, conflictIndex);
 
-        auto it = txList.GetIterator();
-        for (;it.IsValid(); it.Next())
+        //Applied pages are released once their streams checkpoint the header
         {
-            auto tx = it.Get();
-            err = WriteTx(tx, bioList);
-            if (!err.Ok())
-                break;
+            Core::SharedAutoLock lock(Lock);
+            if (State == JournalStateRunning)
+            {
+                Streams[index]->CheckpointRetained();
+                Streams[conflictIndex]->CheckpointRetained();
+            }
         }
 
-        if (err.Ok())
+        PendingEvent.Wait(10);
+    }
+}
+
+void Journal::ReleasePendingPages(Transaction* tx)
+{
+    if (!tx->Pending)
+        return;
+
+    {
+        Core::AutoLock lock(PendingLock);
+        PutPendingPagesLocked(tx, static_cast<size_t>(-1));
+        PutRetainedPagesLocked(&tx->RetainedPages);
+    }
+
+    tx->Pending = false;
+    PendingEvent.SetAll();
+}
+
+void Journal::PutPendingPagesLocked(Transaction* tx, size_t count)
+{
+    for (size_t i = 0; i < tx->DataBlockList.GetSize(); i++)
+    {
+        auto& block = tx->DataBlockList[i];
+        uint64_t lastPage = (block.Position + block.DataPage->GetSize() - 1) / Api::PageSize;
+        for (uint64_t page = block.Position / Api::PageSize; page <= lastPage; page++)
         {
-            err = Flush(bioList);
+            if (count == 0)
+                return;
+            count--;
+
+            PutPendingPageLocked(page);
         }
+    }
+}
+
+void Journal::PutPendingPageLocked(uint64_t page)
+{
+    bool exist;
+    auto pending = PendingPages.Lookup(page, exist);
+    if (!exist)
+        return;
+
+    PendingPages.Delete(page);
+    if (pending.Count > 1)
+        PendingPages.Insert(page, JournalPendingPage(pending.StreamIndex, pending.Count - 1));
+}
 
-        while (!txList.IsEmpty())
+Core::Error Journal::GetRetainedPagesLocked(Transaction* tx)
+{
+    for (size_t i = 0; i < tx->DataBlockList.GetSize(); i++)
+    {
+        JournalRetainedPages* retained;
+        if (!Core::IsListEmpty(&FreeRetainedPages))
+        {
+            retained = CONTAINING_RECORD(Core::RemoveHeadList(&FreeRetainedPages), JournalRetainedPages, Link);
+        }
+        else
         {
-            auto tx = txList.Head();
-            txList.PopHead();
-            tx->OnCommitComplete(err);
+            retained = new (Core::Memory::PoolType::Kernel) JournalRetainedPages();
+            if (retained == nullptr)
+            {
+                PutRetainedPagesLocked(&tx->RetainedPages);
+                return MakeError(Core::Error::NoMemory);
+            }
         }
+
+        auto& block = tx->DataBlockList[i];
+        retained->Sequence = 0;
+        retained->FirstPage = block.Position / Api::PageSize;
+        retained->LastPage = (block.Position + block.DataPage->GetSize() - 1) / Api::PageSize;
+        Core::InsertTailList(&tx->RetainedPages, &retained->Link);
     }
 
-    trace(1, "Journal 0x%p tx thread stop", this);
+    return MakeError(Core::Error::Success);
+}
+
+void Journal::PutRetainedPagesLocked(Core::ListEntry* list)
+{
+    while (!Core::IsListEmpty(list))
+        Core::InsertTailList(&FreeRetainedPages, Core::RemoveHeadList(list));
+}
 
-    return err;
+uint64_t Journal::GetNextGlobalSequence()
+{
+    Core::AutoLock lock(GlobalSequenceLock);
+    return GlobalSequence++;
+}
+
+Core::Error Journal::StartCommitTx(Transaction* tx)
+{
+    size_t streamIndex;
+    auto err = AcquirePendingPages(tx, streamIndex);
+    if (!err.Ok())
+        return err;
+
+    tx->Pending = true;
+
+    Core::SharedAutoLock lock(Lock);
+
+    //Self is only dropped under the tx lock the caller holds
+    if (tx->Self.Get() != tx)
+        return MakeError(Core::Error::NotFound);
+    auto& txPtr = tx->Self;
+
+    if (State != JournalStateRunning)
+        return MakeError(Core::Error::InvalidState);
+
+    tx->Stream = Streams[streamIndex].Get();
+    err = tx->Stream->ReserveSpace(tx);
+    if (!err.Ok())
+        return err;
+
+    err = tx->Stream->QueueTx(txPtr);
+    if (!err.Ok())
+        return err;
+
+    trace(1, "Journal 0x%p tx 0x%p %s start commit, stream %lu",
+        this, txPtr.Get(), txPtr->GetTxId().ToString().GetConstBuf(), streamIndex);
+
+    return MakeError(Core::Error::Success);
 }
 
 Core::Error Journal::CheckPosition(unsigned long long position, size_t size)
 {
-    if (position & 511)
+    if (position % VolumeRef.GetDevice().GetLogicalBlockSize())
         return MakeError(Core::Error::InvalidValue);
 
     if (position < GetBlockSize())
         return MakeError(Core::Error::Overlap);
 
-    if (Core::Memory::CheckIntersection(position, position + size,
+    if (!VolumeRef.HasExternalJournal() &&
+        Core::Memory::CheckIntersection(position, position + size,
                     GetStart() * GetBlockSize(), (GetStart() + GetSize()) * GetBlockSize()))
         return MakeError(Core::Error::Overlap);
 
@@ -609,46 +843,91 @@ Core::Error Journal::CheckPosition(unsigned long long position, size_t size)
     return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::ApplyBlocks(Core::LinkedList<JournalTxBlockPtr>& blockList, bool preflushFua)
+JournalApplier::JournalApplier(Journal& journal)
+    : JournalRef(journal)
+    , IoList(journal.VolumeRef.GetDevice())
+    , IoCount(0)
 {
-    Core::NoIOBioList bioList(VolumeRef.GetDevice());
+    IoList.SetBioSet(&journal.WriteBioSet);
+}
 
-    auto it = blockList.GetIterator();
-    for(; it.IsValid(); it.Next())
+JournalApplier::~JournalApplier()
+{
+}
+
+bool JournalApplier::CheckOverlap(uint64_t position, size_t size)
+{
+    for (uint64_t sector = position / 512; sector < (position + size + 511) / 512; sector++)
     {
-        auto block = it.Get();
-        auto data = reinterpret_cast<Api::JournalTxDataBlock*>(block.Get());
+        bool exist;
+        SectorTree.Lookup(sector, exist);
+        if (exist)
+            return true;
+    }
 
-        if (data->Type != Api::JournalBlockTypeTxData)
-            return MakeError(Core::Error::InvalidValue);
+    return false;
+}
 
-        auto err = CheckPosition(data->Position, data->DataSize);
-        if (!err.Ok())
-            return err;
+Core::Error JournalApplier::Add(const JournalDataBlock& block)
+{
+    size_t size = block.DataPage->GetSize();
 
-        trace(1, "Journal 0x%p position %llu size %lu data %s",
-            this, data->Position, data->DataSize,
-            Core::Hex::Encode(data->Data, 16, data->DataSize).GetConstBuf());
+    auto err = JournalRef.CheckPosition(block.Position, size);
+    if (!err.Ok())
+        return err;
 
-        err = bioList.AddIo(data->Data, data->DataSize, data->Position, true);
+    if (IoCount >= JournalApplyMaxBios || CheckOverlap(block.Position, size))
+    {
+        err = Submit(false);
         if (!err.Ok())
             return err;
     }
 
-    return bioList.SubmitWaitResult(preflushFua);
+    for (uint64_t sector = block.Position / 512; sector < (block.Position + size + 511) / 512; sector++)
+    {
+        if (!SectorTree.Insert(sector, sector))
+            return MakeError(Core::Error::NoMemory);
+    }
+
+    trace(3, "Journal 0x%p position %llu size %lu data %s",
+        &JournalRef, block.Position, size, block.DataPage->ToHex(16).GetConstBuf());
+
+    err = IoList.AddIo(block.DataPage, block.Position, true);
+    if (!err.Ok())
+        return err;
+
+    IoCount++;
+    return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::Replay(Core::LinkedList<JournalTxBlockPtr>&& blockList)
+Core::Error JournalApplier::Submit(bool preflushFua)
 {
-    auto localBlockList = Core::Memory::Move(blockList);
+    if (IoCount == 0)
+        return MakeError(Core::Error::Success);
 
-    if (localBlockList.Count() < 3)
+    auto err = JournalRef.VolumeRef.GetIoScheduler().SubmitWait(IoList, IoClassCheckpoint, preflushFua);
+
+    trace(3, "Journal 0x%p applied %lu blocks, err %d", &JournalRef, IoCount, err.GetCode());
+
+    IoList.Reset();
+    SectorTree.Clear();
+    IoCount = 0;
+    return err;
+}
+
+Core::Error JournalApplier::Complete(bool preflushFua)
+{
+    return Submit(preflushFua);
+}
+
+Core::Error Journal::CheckTx(Core::LinkedList<JournalTxBlockPtr>& blockList,
+    Core::LinkedList<JournalDataBlock>& dataBlockList)
+{
+    if (blockList.Count() < 3)
         return MakeError(Core::Error::DataCorrupt);
 
-    auto beginBlock = localBlockList.Head();
-    localBlockList.PopHead();
-    auto commitBlock = localBlockList.Tail();
-    localBlockList.PopTail();
+    auto beginBlock = blockList.Head();
+    auto commitBlock = blockList.Tail();
 
     if (beginBlock->Type != Api::JournalBlockTypeTxBegin)
         return MakeError(Core::Error::DataCorrupt);
@@ -663,32 +942,68 @@ Core::Error Journal::Replay(Core::LinkedList<JournalTxBlockPtr>&& blockList)
     if (txId != Guid(commitBlock->TxId))
         return MakeError(Core::Error::DataCorrupt);
 
-    if (commitData->BlockCount != localBlockList.Count())
+    auto beginData = reinterpret_cast<Api::JournalTxBeginBlock*>(beginBlock.Get());
+    if (commitData->Sequence != beginData->Sequence)
+        return MakeError(Core::Error::DataCorrupt);
+
+    if (commitData->BlockCount != (blockList.Count() - 2 + dataBlockList.Count()))
         return MakeError(Core::Error::DataCorrupt);
 
-    auto it = localBlockList.GetIterator();
+    auto it = blockList.GetIterator();
     unsigned int index = 0;
-    for(; it.IsValid(); it.Next())
+    size_t entryCount = 0;
+    for(it.Next(); it.IsValid(); it.Next())
     {
         auto block = it.Get();
-        if (block->Type != Api::JournalBlockTypeTxData)
+        if (block.Get() == commitBlock.Get())
+            break;
+
+        if (block->Type != Api::JournalBlockTypeTxDescriptor)
             return MakeError(Core::Error::DataCorrupt);
         if (txId != Guid(block->TxId))
             return MakeError(Core::Error::DataCorrupt);
 
-        auto& data = *reinterpret_cast<Api::JournalTxDataBlock*>(block.Get());
-        if (data.Index != index)
+        auto& descriptor = *reinterpret_cast<Api::JournalTxDescriptorBlock*>(block.Get());
+        if (descriptor.Index != index)
             return MakeError(Core::Error::DataCorrupt);
 
-        trace(1, "Journal 0x%p tx %s block %u pos %llu size %u",
-            this, txId.ToString().GetConstBuf(), data.Index, data.Position, data.DataSize);
+        trace(3, "Journal 0x%p tx %s descriptor %u entries %u",
+            this, txId.ToString().GetConstBuf(), descriptor.Index, descriptor.EntryCount);
 
+        entryCount += descriptor.EntryCount;
         index++;
     }
 
-    auto err = ApplyBlocks(localBlockList, true);
+    if (entryCount != dataBlockList.Count())
+        return MakeError(Core::Error::DataCorrupt);
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error Journal::ReplayTx(Core::LinkedList<JournalTxBlockPtr>&& blockList,
+    Core::LinkedList<JournalDataBlock>&& dataBlockList, JournalApplier& applier)
+{
+    auto localBlockList = Core::Memory::Move(blockList);
+    auto localDataBlockList = Core::Memory::Move(dataBlockList);
+
+    if (localBlockList.Count() < 3)
+        return MakeError(Core::Error::DataCorrupt);
+
+    Core::Error err;
+    auto beginBlock = localBlockList.Head();
+
+    auto beginData = reinterpret_cast<Api::JournalTxBeginBlock*>(beginBlock.Get());
+    auto it = localDataBlockList.GetIterator();
+    for (; it.IsValid(); it.Next())
+    {
+        err = applier.Add(it.Get());
+        if (!err.Ok())
+            break;
+    }
 
-    trace(1, "Journal 0x%p tx %s replayed, err %d", this, txId.ToString().GetConstBuf(), err.GetCode());
+    trace(1, "Journal 0x%p tx %s seq %llu global seq %llu replayed, err %d",
+        this, Guid(beginBlock->TxId).ToString().GetConstBuf(), beginData->Sequence,
+        beginData->GlobalSequence, err.GetCode());
 
     return err;
 }
@@ -698,145 +1013,84 @@ Core::Error Journal::Replay()
     Core::Error err;
 
     State = JournalStateReplaying;
-    Core::AutoLock lock(LogRbLock);
 
-    Core::LinkedList<JournalTxBlockPtr> blockList;
-    for (;;)
-    {
-        size_t index = -1;
+    JournalApplier applier(*this);
+    Core::LinkedList<JournalTxBlockPtr> txBlockList[JournalMaxStreams];
+    Core::LinkedList<JournalDataBlock> dataBlockList[JournalMaxStreams];
+    bool end[JournalMaxStreams];
 
-        err = LogRb.PopFront(index);
+    for (size_t i = 0; i < StreamCount; i++)
+    {
+        end[i] = false;
+        err = Streams[i]->ReplayNextTx(txBlockList[i], dataBlockList[i]);
         if (err == Core::Error::NotFound)
         {
+            end[i] = true;
             err = MakeError(Core::Error::Success);
-            break;
         }
-
         if (!err.Ok())
-            break;
+            return err;
+    }
 
-        auto block = ReadTxBlock(index, err);
-        if (!err.Ok())
+    //Streams are merged by global sequence, not replayed independently, so txs
+    //of different streams writing the same page are applied in commit order
+    for (;;)
+    {
+        size_t index = StreamCount;
+        uint64_t minSequence = 0;
+        for (size_t i = 0; i < StreamCount; i++)
         {
-            trace(0, "Journal 0x%p read index %lu err %d", this, index, err.GetCode());
-            break;
-        }
-
-        trace(1, "Journal 0x%p replay index %lu block %u", this, index, block->Type);
+            if (end[i])
+                continue;
 
-        switch (block->Type)
-        {
-        case Api::JournalBlockTypeTxBegin:
-        {
-            if (!blockList.IsEmpty())
-            {
-                err = MakeError(Core::Error::DataCorrupt);
-                break;
-            }
-            if (!blockList.AddTail(block))
+            auto beginData = reinterpret_cast<Api::JournalTxBeginBlock*>(txBlockList[i].Head().Get());
+            if (index == StreamCount || beginData->GlobalSequence < minSequence)
             {
-                err = MakeError(Core::Error::NoMemory);
-                break;
+                index = i;
+                minSequence = beginData->GlobalSequence;
             }
-            break;
         }
-        case Api::JournalBlockTypeTxData:
-        {
-            if (blockList.IsEmpty())
-            {
-                err = MakeError(Core::Error::DataCorrupt);
-                break;
-            }
-            if (!blockList.AddTail(block))
-            {
-                err = MakeError(Core::Error::NoMemory);
-                break;
-            }
+
+        if (index == StreamCount)
             break;
-        }
-        case Api::JournalBlockTypeTxCommit:
-        {
-            if (blockList.Count() < 2)
-            {
-                err = MakeError(Core::Error::DataCorrupt);
-                break;
-            }
-            if (!blockList.AddTail(block))
-            {
-                err = MakeError(Core::Error::NoMemory);
-                break;
-            }
 
-            err = Replay(Core::Memory::Move(blockList));
+        err = ReplayTx(Core::Memory::Move(txBlockList[index]), Core::Memory::Move(dataBlockList[index]), applier);
+        if (!err.Ok())
             break;
+
+        if (minSequence >= GlobalSequence)
+            GlobalSequence = minSequence + 1;
+
+        err = Streams[index]->ReplayNextTx(txBlockList[index], dataBlockList[index]);
+        if (err == Core::Error::NotFound)
+        {
+            end[index] = true;
+            err = MakeError(Core::Error::Success);
         }
-        default:
-            err = MakeError(Core::Error::DataCorrupt);
+        if (!err.Ok())
             break;
-        }
+    }
 
-        if (!err.Ok())
+    auto applyErr = applier.Complete(true);
+    if (err.Ok() && !applyErr.Ok())
+        err = applyErr;
+
+    if (err.Ok())
+    {
+        for (size_t i = 0; i < StreamCount; i++)
         {
-            break;
+            err = Streams[i]->ReplayComplete();
+            if (!err.Ok())
+                break;
         }
     }
 
-    trace(1, "Journal 0x%p replay %d", this, err.GetCode());
+    trace(1, "Journal 0x%p replay %d, global seq %llu", this, err.GetCode(), GlobalSequence);
 
     return err;
 }
 
-Core::Error Journal::Flush(Core::NoIOBioList& bioList)
-{
-    Core::AutoLock lock(Lock);
-
-    Core::Error err;
-    auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
-    if (!err.Ok())
-        return err;
-    
-    page->Zero();
-    Core::PageMap pageMap(*page.Get());
-    Api::JournalHeader *header = static_cast<Api::JournalHeader *>(pageMap.GetAddress());
-
-
-    header->Magic = Core::BitOps::CpuToLe32(Api::JournalMagic);
-    header->Size = Core::BitOps::CpuToLe64(Size);
-    {
-        Core::SharedAutoLock lock2(LogRbLock);
-
-        header->LogStartIndex = Core::BitOps::CpuToLe64(LogRb.GetStartIndex());
-        header->LogEndIndex = Core::BitOps::CpuToLe64(LogRb.GetEndIndex());
-        header->LogSize = Core::BitOps::CpuToLe64(LogRb.GetSize());
-        header->LogCapacity = Core::BitOps::CpuToLe64(LogRb.GetCapacity());
-
-        trace(1, "Journal 0x%p flush, logStartIndex %llu logEndIndex %llu logSize %llu logCapacity %llu",
-            this, LogRb.GetStartIndex(), LogRb.GetEndIndex(), LogRb.GetSize(), LogRb.GetCapacity());
-    }
-
-    Core::XXHash::Sum(header, OFFSET_OF(Api::JournalHeader, Hash), header->Hash);
-
-    err = bioList.AddIo(page, Start * GetBlockSize(), true);
-    if (!err.Ok())
-    {
-        trace(0, "Journal 0x%p write header err %d", this, err.GetCode());
-        return err;
-    }
-
-    err = bioList.SubmitWaitResult(true);
-    if (!err.Ok())
-    {
-        trace(0, "Journal 0x%p flush err %d", this, err.GetCode());
-        return err;
-    }
-
-    CompactLog();
-
-    trace(1, "Journal 0x%p flush %d", this, err.GetCode());
-    return err;
-}
-
-Core::Error Journal::ReadTxBlockComplete(Core::PageInterface& page)
+Core::Error Journal::ReadTxBlockComplete(Core::PageInterface& page)
 {
     Api::JournalTxBlock* block;
     if (sizeof(*block) != page.GetSize())
@@ -856,13 +1110,22 @@ Core::Error Journal::ReadTxBlockComplete(Core::PageInterface& page)
     switch (block->Type)
     {
     case Api::JournalBlockTypeTxBegin:
+    {
+        Api::JournalTxBeginBlock *beginBlock = reinterpret_cast<Api::JournalTxBeginBlock*>(block);
+        beginBlock->Sequence = Core::BitOps::Le64ToCpu(beginBlock->Sequence);
+        beginBlock->GlobalSequence = Core::BitOps::Le64ToCpu(beginBlock->GlobalSequence);
         break;
-    case Api::JournalBlockTypeTxData:
+    }
+    case Api::JournalBlockTypeTxDescriptor:
     {
-        Api::JournalTxDataBlock *dataBlock = reinterpret_cast<Api::JournalTxDataBlock*>(block);
-        dataBlock->Position = Core::BitOps::Le64ToCpu(dataBlock->Position);
-        dataBlock->DataSize = Core::BitOps::Le32ToCpu(dataBlock->DataSize);
-        dataBlock->Index = Core::BitOps::Le32ToCpu(dataBlock->Index);
+        Api::JournalTxDescriptorBlock *descBlock = reinterpret_cast<Api::JournalTxDescriptorBlock*>(block);
+        descBlock->Index = Core::BitOps::Le32ToCpu(descBlock->Index);
+        descBlock->EntryCount = Core::BitOps::Le32ToCpu(descBlock->EntryCount);
+        if (descBlock->EntryCount == 0 || descBlock->EntryCount > Api::JournalTxDescriptorMaxEntries)
+            return MakeError(Core::Error::DataCorrupt);
+
+        for (size_t i = 0; i < descBlock->EntryCount; i++)
+            descBlock->Entries[i].Position = Core::BitOps::Le64ToCpu(descBlock->Entries[i].Position);
         break;
     }
     case Api::JournalBlockTypeTxCommit:
@@ -871,6 +1134,7 @@ Core::Error Journal::ReadTxBlockComplete(Core::PageInterface& page)
         commitBlock->State = Core::BitOps::Le32ToCpu(commitBlock->State);
         commitBlock->Time = Core::BitOps::Le64ToCpu(commitBlock->Time);
         commitBlock->BlockCount = Core::BitOps::Le32ToCpu(commitBlock->BlockCount);
+        commitBlock->Sequence = Core::BitOps::Le64ToCpu(commitBlock->Sequence);
         break;
     }
     default:
@@ -892,13 +1156,22 @@ Core::Error Journal::WriteTxBlockPrepare(Core::PageInterface& page)
     switch (block->Type)
     {
     case Api::JournalBlockTypeTxBegin:
+    {
+        Api::JournalTxBeginBlock *beginBlock = reinterpret_cast<Api::JournalTxBeginBlock*>(block);
+        beginBlock->Sequence = Core::BitOps::CpuToLe64(beginBlock->Sequence);
+        beginBlock->GlobalSequence = Core::BitOps::CpuToLe64(beginBlock->GlobalSequence);
         break;
-    case Api::JournalBlockTypeTxData:
+    }
+    case Api::JournalBlockTypeTxDescriptor:
     {
-        Api::JournalTxDataBlock *dataBlock = reinterpret_cast<Api::JournalTxDataBlock*>(block);
-        dataBlock->Position = Core::BitOps::CpuToLe64(dataBlock->Position);
-        dataBlock->DataSize = Core::BitOps::CpuToLe32(dataBlock->DataSize);
-        dataBlock->Index = Core::BitOps::CpuToLe32(dataBlock->Index);
+        Api::JournalTxDescriptorBlock *descBlock = reinterpret_cast<Api::JournalTxDescriptorBlock*>(block);
+        if (descBlock->EntryCount > Api::JournalTxDescriptorMaxEntries)
+            return MakeError(Core::Error::InvalidValue);
+
+        for (size_t i = 0; i < descBlock->EntryCount; i++)
+            descBlock->Entries[i].Position = Core::BitOps::CpuToLe64(descBlock->Entries[i].Position);
+        descBlock->Index = Core::BitOps::CpuToLe32(descBlock->Index);
+        descBlock->EntryCount = Core::BitOps::CpuToLe32(descBlock->EntryCount);
         break;
     }
     case Api::JournalBlockTypeTxCommit:
@@ -907,6 +1180,7 @@ Core::Error Journal::WriteTxBlockPrepare(Core::PageInterface& page)
         commitBlock->State = Core::BitOps::CpuToLe32(commitBlock->State);
         commitBlock->Time = Core::BitOps::CpuToLe64(commitBlock->Time);
         commitBlock->BlockCount = Core::BitOps::CpuToLe32(commitBlock->BlockCount);
+        commitBlock->Sequence = Core::BitOps::CpuToLe64(commitBlock->Sequence);
         break;
     }
     default:
@@ -918,116 +1192,280 @@ Core::Error Journal::WriteTxBlockPrepare(Core::PageInterface& page)
     return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::IndexToPosition(size_t index, uint64_t& position)
+size_t Journal::GetBlockSize()
 {
-    if ((index + 1) >= Size)
+    return VolumeRef.GetBlockSize();
+}
+
+void Journal::GetThrottleStats(uint64_t& count, uint64_t& time)
+{
+    count = 0;
+    time = 0;
+
+    Core::SharedAutoLock lock(Lock);
+    for (size_t i = 0; i < StreamCount; i++)
     {
-        return MakeError(Core::Error::Overflow);
+        uint64_t streamCount, streamTime;
+        Streams[i]->GetThrottleStats(streamCount, streamTime);
+        count += streamCount;
+        time += streamTime;
     }
-
-    position =  (Start + 1 + index) * GetBlockSize();
-    return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::PositionToIndex(uint64_t position, size_t& index)
+Core::Error Journal::Unload()
 {
-    if ((position % GetBlockSize()) != 0)
-        return MakeError(Core::Error::InvalidValue);
+    trace(1, "Journal 0x%p unload", this);
 
-    uint64_t localIndex = position / GetBlockSize();
-    if (localIndex < (Start + 1) ||
-        position >= (Start + Size))
-        return MakeError(Core::Error::Overflow);
+    //Throttled txs wait for log space under shared Lock, let them fail first
+    {
+        Core::SharedAutoLock lock(Lock);
+        if (State == JournalStateRunning)
+        {
+            for (size_t i = 0; i < StreamCount; i++)
+                Streams[i]->StopReserve();
+        }
+    }
 
-    index = localIndex - (Start + 1);
-    return MakeError(Core::Error::Success);
+    {
+        Core::AutoLock lock(Lock);
+        if (State == JournalStateStopped)
+            return MakeError(Core::Error::Success);
+        if (State != JournalStateRunning)
+            return MakeError(Core::Error::InvalidState);
+        State = JournalStateStopping;
+    }
+
+    Core::Error err;
+    for (size_t i = 0; i < StreamCount; i++)
+    {
+        auto streamErr = Streams[i]->Unload();
+        if (!streamErr.Ok())
+            err = streamErr;
+    }
+
+    {
+        Core::AutoLock lock(Lock);
+        State = JournalStateStopped;
+    }
+
+    trace(1, "Journal 0x%p unload, err %d", this, err.GetCode());
+
+    return err;
 }
 
-JournalTxBlockPtr Journal::ReadTxBlock(uint64_t index, Core::Error& err)
+void Journal::SetThrottled(bool throttled)
 {
-    JournalTxBlockPtr block;
+    Core::SharedAutoLock lock(Lock);
+    if (State != JournalStateRunning)
+        return;
 
-    uint64_t position;
-    err = IndexToPosition(index, position);
-    if (!err.Ok())
-        return block;
+    for (size_t i = 0; i < StreamCount; i++)
+        Streams[i]->SetThrottled(throttled);
+}
 
-    auto page = Core::Page<>::Create(err);
-    if (!err.Ok())
-        return block;
+JournalStream::JournalStream(Journal& journal, size_t index)
+    : JournalRef(journal)
+    , Index(index)
+    , Committer(*this)
+    , LogStartSequence(0)
+    , NextSequence(0)
+    , CheckpointLag(0)
+    , Reserved(0)
+    , Throttled(false)
+    , ForceThrottled(false)
+    , Stopping(false)
+    , ThrottleCount(0)
+    , ThrottleTime(0)
+    , ReplayDataLeft(0)
+    , ReplayIndex(0)
+    , ReplayEndIndex(0)
+    , ReplayScanned(0)
+    , Start(0)
+    , Size(0)
+{
+    Core::InitializeListHead(&RetainedPages);
+    trace(1, "Journal 0x%p stream %lu ctor", &JournalRef, Index);
+}
+
+JournalStream::~JournalStream()
+{
+    trace(1, "Journal 0x%p stream %lu dtor", &JournalRef, Index);
+    StopThread();
+
+    Core::AutoLock lock(JournalRef.PendingLock);
+    JournalRef.PutRetainedPagesLocked(&RetainedPages);
+}
 
-    err = Core::BioList<>(VolumeRef.GetDevice()).SubmitWaitResult(page,
-                                                        position, false);
+Core::Error JournalStream::Load(uint64_t start, uint64_t size)
+{
+    Core::Error err;
+    auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
     if (!err.Ok())
-        return block;
+        return err;
 
-    err = ReadTxBlockComplete(*page.Get());
+    err = Core::NoIOBioList(JournalRef.GetDevice()).SubmitWaitResult(page,
+                                                    start * JournalRef.GetBlockSize(), false);
     if (!err.Ok())
-        return block;
+        return err;
 
-    block = Core::MakeShared<Api::JournalTxBlock, Core::Memory::PoolType::Kernel>();
-    if (block.Get() == nullptr)
+    Core::PageMap pageMap(*page.Get());
+    Api::JournalStreamHeader *header = static_cast<Api::JournalStreamHeader *>(pageMap.GetAddress());
+    if (Core::BitOps::Le32ToCpu(header->Magic) != Api::JournalStreamMagic)
     {
-        err = MakeError(Core::Error::NoMemory);
-        return block;
+        trace(0, "Journal 0x%p stream %lu invalid header magic 0x%x",
+            &JournalRef, Index, Core::BitOps::Le32ToCpu(header->Magic));
+        return MakeError(Core::Error::BadMagic);
     }
 
-    if (page->Read(block.Get(), sizeof(*block.Get()), 0) != page->GetSize())
+    unsigned char hash[Api::HashSize];
+    Core::XXHash::Sum(header, OFFSET_OF(Api::JournalStreamHeader, Hash), hash);
+    if (!Core::Memory::ArrayEqual(hash, header->Hash))
     {
-        err = MakeError(Core::Error::UnexpectedEOF);
-        block.Reset();
-        return block;
+        trace(0, "Journal 0x%p stream %lu invalid header hash", &JournalRef, Index);
+        return MakeError(Core::Error::DataCorrupt);
     }
 
-    return block;
+    uint64_t streamIndex = Core::BitOps::Le64ToCpu(header->StreamIndex);
+    uint64_t logSize = Core::BitOps::Le64ToCpu(header->LogSize);
+    uint64_t logStartIndex = Core::BitOps::Le64ToCpu(header->LogStartIndex);
+    uint64_t logEndIndex = Core::BitOps::Le64ToCpu(header->LogEndIndex);
+    uint64_t logCapacity = Core::BitOps::Le64ToCpu(header->LogCapacity);
+    uint64_t logSequence = Core::BitOps::Le64ToCpu(header->LogSequence);
+    uint64_t globalSequence = Core::BitOps::Le64ToCpu(header->GlobalSequence);
+
+    trace(1, "Journal 0x%p stream %lu load, logStartIndex %llu logEndIndex %llu logSize %llu logCapacity %llu logSequence %llu globalSequence %llu",
+        &JournalRef, Index, logStartIndex, logEndIndex, logSize, logCapacity, logSequence, globalSequence);
+
+    if (streamIndex != Index)
+        return MakeError(Core::Error::InvalidValue);
+
+    if (logCapacity != (size - 1))
+        return MakeError(Core::Error::BadSize);
+
+    Core::AutoLock lock(LogRbLock);
+    if (!LogRb.Reset(logStartIndex, logEndIndex, logSize, logCapacity))
+        return MakeError(Core::Error::BadSize);
+
+    LogStartSequence = logSequence;
+    NextSequence = logSequence;
+    CheckpointLag = 0;
+
+    ReplayPageList.Clear();
+    ReplayReadResult = MakeError(Core::Error::Success);
+    ReplayDataLeft = 0;
+    ReplayIndex = logStartIndex;
+    ReplayEndIndex = logStartIndex;
+    ReplayScanned = 0;
+
+    Start = start;
+    Size = size;
+
+    if (globalSequence > JournalRef.GlobalSequence)
+        JournalRef.GlobalSequence = globalSequence;
+
+    return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::WriteTxBlock(uint64_t index, const JournalTxBlockPtr& block, Core::NoIOBioList& bioList)
+Core::Error JournalStream::Format(uint64_t start, uint64_t size)
 {
-    uint64_t position;
-    auto err = IndexToPosition(index, position);
-    if (!err.Ok())
-        return err;
+    if (size <= 1)
+        return MakeError(Core::Error::InvalidValue);
 
+    Core::Error err;
     auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
     if (!err.Ok())
         return err;
 
-    if (page->Write(block.Get(), sizeof(*block.Get()), 0) != page->GetSize())
-    {
-        return MakeError(Core::Error::UnexpectedEOF);
-    }
+    page->Zero();
+    Core::PageMap pageMap(*page.Get());
+    Api::JournalStreamHeader *header = static_cast<Api::JournalStreamHeader *>(pageMap.GetAddress());
+
+    header->Magic = Core::BitOps::CpuToLe32(Api::JournalStreamMagic);
+    header->StreamIndex = Core::BitOps::CpuToLe64(Index);
+    header->LogSize = Core::BitOps::CpuToLe64(0);
+    header->LogStartIndex = Core::BitOps::CpuToLe64(0);
+    header->LogEndIndex = Core::BitOps::CpuToLe64(0);
+    header->LogCapacity = Core::BitOps::CpuToLe64(size - 1);
+    header->LogSequence = Core::BitOps::CpuToLe64(Core::Random::GetUint64());
+    header->GlobalSequence = Core::BitOps::CpuToLe64(0);
+
+    Core::XXHash::Sum(header, OFFSET_OF(Api::JournalStreamHeader, Hash), header->Hash);
+
+    trace(1, "Journal 0x%p stream %lu start %llu size %llu", &JournalRef, Index, start, size);
 
-    err = WriteTxBlockPrepare(*page.Get());
+    err = Core::NoIOBioList(JournalRef.GetDevice()).SubmitWaitResult(page,
+                                                        start * JournalRef.GetBlockSize(), true, true);
     if (!err.Ok())
+    {
+        trace(0, "Journal 0x%p stream %lu write header err %d", &JournalRef, Index, err.GetCode());
         return err;
+    }
 
-    return bioList.AddIo(page, position, true);
-}
+    Start = start;
+    Size = size;
 
-size_t Journal::GetBlockSize()
-{
-    return VolumeRef.GetBlockSize();
+    return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::Unload()
+Core::Error JournalStream::StartThread()
 {
-    trace(1, "Journal 0x%p unload", this);
+    Core::Error err;
+    Core::AString name("kstor-jrnl", err);
+    if (!err.Ok())
+        return err;
+
+    if (!BlockPagePool.Reserve(JournalBlockPagePoolSize))
+        return MakeError(Core::Error::NoMemory);
+
+    Core::AString commitName("kstor-jcommit", err);
+    if (!err.Ok())
+        return err;
+
+    //Committer is started first and stopped last so it drains what the writer queued
+    CommitThread = Core::MakeUnique<Core::Thread, Core::Memory::PoolType::Kernel>(commitName, &Committer, err);
+    if (CommitThread.Get() == nullptr)
+        return MakeError(Core::Error::NoMemory);
+
+    if (!err.Ok())
     {
-        Core::AutoLock lock(Lock);
-        if (State == JournalStateStopped)
-            return MakeError(Core::Error::Success);
-        if (State != JournalStateRunning)
-            return MakeError(Core::Error::InvalidState);
-        State = JournalStateStopping;
+        CommitThread.Reset();
+        return err;
+    }
+
+    TxThread = Core::MakeUnique<Core::Thread, Core::Memory::PoolType::Kernel>(name, this, err);
+    if (TxThread.Get() == nullptr)
+        err = MakeError(Core::Error::NoMemory);
+
+    if (!err.Ok())
+    {
+        TxThread.Reset();
+        CommitThread->StopAndWait();
+        CommitThread.Reset();
+        return err;
     }
 
+    return MakeError(Core::Error::Success);
+}
+
+void JournalStream::StopThread()
+{
     if (TxThread.Get() != nullptr)
     {
         TxThread->StopAndWait();
         TxThread.Reset();
     }
 
+    if (CommitThread.Get() != nullptr)
+    {
+        CommitThread->StopAndWait();
+        CommitThread.Reset();
+    }
+}
+
+Core::Error JournalStream::Unload()
+{
+    StopThread();
+
     TxListLock.Acquire();
     auto txList = Core::Memory::Move(TxList);
     TxListLock.Release();
@@ -1039,84 +1477,1108 @@ Core::Error Journal::Unload()
         tx->Cancel();
     }
 
-    Core::NoIOBioList bioList(VolumeRef.GetDevice());
+    Core::NoIOBioList bioList(JournalRef.GetDevice());
     auto err = Flush(bioList);
-
+    if (err.Ok())
     {
-        Core::AutoLock lock(Lock);
-        State = JournalStateStopped;
+        Core::AutoLock lock(LogRbLock);
+        err = WriteHeaderLocked();
     }
 
-    trace(1, "Journal 0x%p unload, err %d", this, err.GetCode());
+    trace(1, "Journal 0x%p stream %lu unload, throttled %llu times for %llu ns, err %d",
+        &JournalRef, Index, ThrottleCount, ThrottleTime, err.GetCode());
 
     return err;
 }
 
-Core::Error Journal::GetNextIndex(size_t& index)
+Core::Error JournalStream::QueueTx(const Transaction::Ptr& tx)
 {
-    size_t localIndex = -1;
-
-    Core::AutoLock lock(LogRbLock);
-    auto err = LogRb.PushBack(localIndex);
-    if (!err.Ok())
-        return err;
+    Core::AutoLock lock(TxListLock);
+    if (!TxList.AddTail(tx))
+        return MakeError(Core::Error::NoMemory);
+    TxListEvent.SetAll();
 
-    trace(1, "Journal 0x%p next index %llu", this, localIndex);
-    index = localIndex;
     return MakeError(Core::Error::Success);
 }
 
-Core::Error Journal::EraseTx(Transaction* tx)
+Core::Error JournalStream::WriteBatch(const JournalBatch::Ptr& batch)
 {
-    Core::AutoLock lock(Lock);
+    batch->Sequence = NextSequence++;
 
-    bool exist;
-    auto txPtr = TxTable.Lookup(tx->GetTxId(), exist);
-    if (!exist || txPtr.Get() != tx)
-        return MakeError(Core::Error::NotFound);
+    Core::Error err;
+    auto beginPage = GetBlockPage(batch, err);
+    if (!err.Ok())
+        return err;
 
     {
-        Core::AutoLock lock(LogRbLock);
-        if (!TxToErase.AddTail(txPtr))
-            return MakeError(Core::Error::NoMemory);
+        Core::PageMap pageMap(*beginPage.Get());
+        auto beginData = static_cast<Api::JournalTxBeginBlock*>(pageMap.GetAddress());
+        beginData->TxId = batch->TxId.GetContent();
+        beginData->Type = Api::JournalBlockTypeTxBegin;
+        beginData->Sequence = batch->Sequence;
+        beginData->GlobalSequence = JournalRef.GetNextGlobalSequence();
     }
 
-    return MakeError(Core::Error::Success);
-}
+    size_t index;
+    err = GetNextIndex(index);
+    if (!err.Ok())
+        return err;
 
-void Journal::CompactLog()
-{
-    Core::AutoLock lock(LogRbLock);
+    if (!batch->IndexList.AddTail(index))
+        return MakeError(Core::Error::NoMemory);
 
-    for (;;)
+    err = WriteTxBlock(index, beginPage, batch->DataBioList);
+    if (!err.Ok())
+        return err;
+
+    //Each descriptor is followed by the data pages it describes, data pages
+    //are written directly from the pages passed to Transaction::Write
+    unsigned int blockCount = 0;
+    unsigned int descIndex = 0;
+    size_t i = 0;
+    while (i < batch->BlockList.GetSize())
     {
-        size_t count = 0;
-        auto it = TxToErase.GetIterator();
-        for (;it.IsValid(); it.Next())
-        {
-            auto tx = it.Get();
+        auto descPage = GetBlockPage(batch, err);
+        if (!err.Ok())
+            return err;
 
-            tx->AcquireLock();
-            auto erased = LogRb.Erase(tx->GetIndexList());
-            tx->ReleaseLock();
+        size_t first = i;
+        unsigned int entryCount = 0;
+        {
+            Core::PageMap pageMap(*descPage.Get());
+            auto descData = static_cast<Api::JournalTxDescriptorBlock*>(pageMap.GetAddress());
+            descData->TxId = batch->TxId.GetContent();
+            descData->Type = Api::JournalBlockTypeTxDescriptor;
+            descData->Index = descIndex;
 
-            if (erased)
+            for (; i < batch->BlockList.GetSize() && entryCount < Api::JournalTxDescriptorMaxEntries; i++)
             {
-                trace(1, "Journal 0x%p tx %p %s erased",
-                    this, tx.Get(), tx->GetTxId().ToString().GetConstBuf());
-                it.Erase();
-                count++;
+                auto& block = batch->BlockList[i];
+                if (block.DataPage.Get() == nullptr)
+                    continue;
+
+                auto& entry = descData->Entries[entryCount];
+                entry.Position = block.Position;
+                {
+                    Core::PageMap dataPageMap(*block.DataPage.Get());
+                    Core::XXHash::Sum(dataPageMap.GetAddress(), block.DataPage->GetSize(), entry.DataHash);
+                }
+                entryCount++;
             }
+            descData->EntryCount = entryCount;
         }
 
-        if (count == 0)
+        if (entryCount == 0)
             break;
-    }
 
-    trace(1, "Journal 0x%p tx leaks %lu",
-        this, TxToErase.Count());
+        err = GetNextIndex(index);
+        if (!err.Ok())
+            return err;
+
+        if (!batch->IndexList.AddTail(index))
+            return MakeError(Core::Error::NoMemory);
+
+        err = WriteTxBlock(index, descPage, batch->DataBioList);
+        if (!err.Ok())
+            return err;
+
+        for (size_t j = first; j < i; j++)
+        {
+            auto& block = batch->BlockList[j];
+            if (block.DataPage.Get() == nullptr)
+                continue;
+
+            err = GetNextIndex(index);
+            if (!err.Ok())
+                return err;
+
+            if (!batch->IndexList.AddTail(index))
+                return MakeError(Core::Error::NoMemory);
+
+            uint64_t position;
+            err = IndexToPosition(index, position);
+            if (!err.Ok())
+                return err;
+
+            err = batch->DataBioList.AddIo(block.DataPage, position, true);
+            if (!err.Ok())
+                return err;
+        }
+
+        blockCount += 1 + entryCount;
+        descIndex++;
+    }
+
+    auto commitPage = GetBlockPage(batch, err);
+    if (!err.Ok())
+        return err;
+
+    err = GetNextIndex(index);
+    if (!err.Ok())
+        return err;
+
+    if (!batch->IndexList.AddTail(index))
+        return MakeError(Core::Error::NoMemory);
+
+    {
+        Core::PageMap pageMap(*commitPage.Get());
+        auto commitData = static_cast<Api::JournalTxCommitBlock*>(pageMap.GetAddress());
+        commitData->TxId = batch->TxId.GetContent();
+        commitData->Type = Api::JournalBlockTypeTxCommit;
+        commitData->State = Api::JournalTxStateCommited;
+        commitData->BlockCount = blockCount;
+        commitData->Sequence = batch->Sequence;
+    }
+
+    err = WriteTxBlock(index, commitPage, batch->CommitBioList);
+    if (!err.Ok())
+        return err;
+
+    trace(1, "Journal 0x%p stream %lu batch %s seq %llu blocks %lu absorbed %lu",
+        &JournalRef, Index, batch->TxId.ToString().GetConstBuf(), batch->Sequence,
+        batch->BlockCount, batch->AbsorbedCount);
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Page<Core::Memory::PoolType::NoIO>::Ptr JournalStream::GetBlockPage(const JournalBatch::Ptr& batch, Core::Error& err)
+{
+    Core::Page<Core::Memory::PoolType::NoIO>::Ptr page;
+    {
+        Core::AutoLock lock(BlockPagePoolLock);
+        size_t size = BlockPagePool.GetSize();
+        if (size != 0)
+        {
+            page = Core::Memory::Move(BlockPagePool[size - 1]);
+            BlockPagePool.Truncate(size - 1);
+        }
+    }
+
+    if (page.Get() == nullptr)
+    {
+        page = Core::Page<Core::Memory::PoolType::NoIO>::Create(JournalRef.WritePagePool, err);
+        if (!err.Ok())
+            return page;
+    }
+
+    if (!batch->BlockPages.AddTail(page))
+    {
+        err = MakeError(Core::Error::NoMemory);
+        page.Reset();
+        return page;
+    }
+
+    page->Zero();
+    err = MakeError(Core::Error::Success);
+    return page;
+}
+
+void JournalStream::PutBlockPages(const JournalBatch::Ptr& batch)
+{
+    while (!batch->BlockPages.IsEmpty())
+    {
+        auto page = batch->BlockPages.Head();
+        batch->BlockPages.PopHead();
+
+        Core::AutoLock lock(BlockPagePoolLock);
+        if (BlockPagePool.GetSize() < BlockPagePool.GetCapacity())
+            BlockPagePool.PushBack(Core::Memory::Move(page));
+    }
+}
+
+Core::Error JournalStream::Run(const Core::Threadable& thread)
+{
+    Core::Error err;
+    trace(1, "Journal 0x%p stream %lu tx thread start", &JournalRef, Index);
+
+    Core::LinkedList<Transaction::Ptr> txList;
+    while (!thread.IsStopping())
+    {
+        //Events are reset under the lock the state changes under, so a signal
+        //after the check isn't lost
+        bool empty;
+        {
+            Core::AutoLock lock(TxListLock);
+            TxListEvent.Reset();
+            empty = TxList.IsEmpty();
+        }
+
+        if (empty)
+        {
+            TxListEvent.Wait(10);
+            continue;
+        }
+
+        //Next batch is built and its data written while earlier ones wait for commit
+        size_t inflight;
+        {
+            Core::AutoLock lock(CommitQueueLock);
+            CommitDoneEvent.Reset();
+            inflight = CommitQueue.Count();
+        }
+
+        if (inflight >= JournalMaxInflightBatches)
+        {
+            CommitDoneEvent.Wait(10);
+            continue;
+        }
+
+        {
+            Core::AutoLock lock(TxListLock);
+            txList = Core::Memory::Move(TxList);
+        }
+
+        //Txs queued before the stream failed are failed here instead of being logged
+        err = GetFailResult();
+        if (!err.Ok())
+        {
+            for (auto it = txList.GetIterator(); it.IsValid(); it.Next())
+            {
+                auto& tx = it.Get();
+                tx->AcquireLock();
+                ReleaseSpace(tx.Get());
+                tx->ReleaseLock();
+            }
+            CompleteTxList(txList, err);
+            continue;
+        }
+
+        //All txs of the batch go to the log as one compound tx
+        auto batch = Core::MakeShared<JournalBatch, Core::Memory::PoolType::Kernel>(JournalRef.GetDevice(),
+            JournalRef.WriteBioSet, err);
+        if (batch.Get() == nullptr)
+            err = MakeError(Core::Error::NoMemory);
+
+        auto it = txList.GetIterator();
+        for (;it.IsValid() && err.Ok(); it.Next())
+        {
+            auto tx = it.Get();
+            trace(1, "Journal 0x%p stream %lu tx 0x%p %s write",
+                &JournalRef, Index, tx.Get(), tx->GetTxId().ToString().GetConstBuf());
+
+            err = batch->AddTx(tx);
+        }
+
+        if (err.Ok())
+        {
+            batch->TxList = Core::Memory::Move(txList);
+            err = SubmitBatch(batch);
+        }
+        else
+        {
+            for (it = txList.GetIterator(); it.IsValid(); it.Next())
+            {
+                auto& tx = it.Get();
+                tx->AcquireLock();
+                ReleaseSpace(tx.Get());
+                tx->ReleaseLock();
+            }
+            CompleteTxList(txList, err);
+        }
+    }
+
+    trace(1, "Journal 0x%p stream %lu tx thread stop", &JournalRef, Index);
+
+    return err;
+}
+
+Core::Error JournalStream::SubmitBatch(const JournalBatch::Ptr& batch)
+{
+    Core::AutoLock lock(Lock);
+    Core::Error err;
+
+    {
+        Core::SharedAutoLock lock(LogRbLock);
+        batch->LogEndIndex = LogRb.GetEndIndex();
+    }
+    uint64_t nextSequence = NextSequence;
+
+    if (batch->BlockCount != 0)
+    {
+        //Data is written in the background, committer waits for it before the commit block
+        err = WriteBatch(batch);
+        if (err.Ok())
+        {
+            err = JournalRef.VolumeRef.GetIoScheduler().SubmitAsync(batch->DataBioList, IoClassCommit,
+                batch->DataIo, &JournalStream::DataWriteComplete, this);
+        }
+    }
+
+    auto it = batch->TxList.GetIterator();
+    for (;it.IsValid(); it.Next())
+    {
+        auto& tx = it.Get();
+        tx->AcquireLock();
+        ReleaseSpace(tx.Get());
+        tx->ReleaseLock();
+    }
+
+    if (err.Ok())
+    {
+        Core::AutoLock lock(CommitQueueLock);
+        if (!CommitQueue.AddTail(batch))
+            err = MakeError(Core::Error::NoMemory);
+    }
+
+    if (!err.Ok())
+    {
+        //Nothing is written after this batch while Lock is held
+        {
+            Core::AutoLock lock(LogRbLock);
+            RollbackLogLocked(batch->LogEndIndex);
+        }
+        NextSequence = nextSequence;
+
+        batch->DataBioList.WaitResult();
+        batch->DataBioList.Reset();
+        batch->CommitBioList.Reset();
+        PutBlockPages(batch);
+        CompleteTxList(batch->TxList, err);
+        return err;
+    }
+
+    CommitQueueEvent.SetAll();
+    return err;
+}
+
+void JournalStream::CommitBatch(const JournalBatch::Ptr& batch)
+{
+    Core::Error err;
+
+    if (batch->BlockCount != 0)
+    {
+        err = batch->DataBioList.WaitResult();
+        if (err.Ok())
+            err = Flush(batch->CommitBioList);
+        batch->DataBioList.Reset();
+        batch->CommitBioList.Reset();
+        PutBlockPages(batch);
+
+        if (!err.Ok())
+        {
+            Core::AutoLock lock(Lock);
+            FailBatchesLocked(batch, err);
+            return;
+        }
+
+        RetainPendingPages(batch);
+        JournaledTxList(batch->TxList);
+
+        //Batches behind a failed one stay in the log for replay as well
+        err = GetFailResult();
+        if (err.Ok())
+            err = Apply(batch);
+        CompactLog();
+    }
+
+    CompleteTxList(batch->TxList, err);
+}
+
+void JournalStream::FailBatchesLocked(const JournalBatch::Ptr& batch, const Core::Error& err)
+{
+    //Batches queued after a failed one are behind it in the log and can't be committed
+    Core::LinkedList<JournalBatch::Ptr> failedList;
+    {
+        Core::AutoLock lock(CommitQueueLock);
+        failedList = Core::Memory::Move(CommitQueue);
+    }
+
+    {
+        Core::AutoLock lock(LogRbLock);
+        RollbackLogLocked(batch->LogEndIndex);
+    }
+    NextSequence = batch->Sequence;
+
+    trace(0, "Journal 0x%p stream %lu batch %s seq %llu commit err %d, failed %lu queued batches",
+        &JournalRef, Index, batch->TxId.ToString().GetConstBuf(), batch->Sequence,
+        err.GetCode(), failedList.Count());
+
+    CompleteTxList(batch->TxList, err);
+    while (!failedList.IsEmpty())
+    {
+        auto failed = failedList.Head();
+        failedList.PopHead();
+
+        failed->DataBioList.WaitResult();
+        failed->DataBioList.Reset();
+        failed->CommitBioList.Reset();
+        PutBlockPages(failed);
+        CompleteTxList(failed->TxList, err);
+    }
+}
+
+void JournalStream::RollbackLogLocked(size_t endIndex)
+{
+    //Blocks past endIndex belong to unwritten batches, so they can't have been erased
+    size_t capacity = LogRb.GetCapacity();
+    size_t written = (LogRb.GetEndIndex() + capacity - endIndex) % capacity;
+    bool reset = (written <= LogRb.GetSize()) &&
+        LogRb.Reset(LogRb.GetStartIndex(), endIndex, LogRb.GetSize() - written, capacity);
+    panic(!reset);
+}
+
+void JournalStream::CompleteTxList(Core::LinkedList<Transaction::Ptr>& txList, const Core::Error& err)
+{
+    while (!txList.IsEmpty())
+    {
+        auto tx = txList.Head();
+        txList.PopHead();
+        tx->OnCommitComplete(err);
+    }
+}
+
+void JournalStream::DataWriteComplete(Core::NoIOBioList* bioList, void* ctx)
+{
+    static_cast<JournalStream*>(ctx)->CommitQueueEvent.SetAll();
+}
+
+void JournalStream::JournaledTxList(Core::LinkedList<Transaction::Ptr>& txList)
+{
+    auto it = txList.GetIterator();
+    for (;it.IsValid(); it.Next())
+    {
+        it.Get()->OnJournaled(MakeError(Core::Error::Success));
+    }
+}
+
+Core::Error JournalStream::RunCommit(const Core::Threadable& thread)
+{
+    trace(1, "Journal 0x%p stream %lu commit thread start", &JournalRef, Index);
+
+    for (;;)
+    {
+        JournalBatch::Ptr batch;
+        {
+            Core::AutoLock lock(CommitQueueLock);
+            CommitQueueEvent.Reset();
+            if (!CommitQueue.IsEmpty())
+            {
+                batch = CommitQueue.Head();
+                CommitQueue.PopHead();
+            }
+        }
+
+        if (batch.Get() == nullptr)
+        {
+            if (thread.IsStopping())
+                break;
+
+            CommitQueueEvent.Wait(10);
+            continue;
+        }
+
+        CommitBatch(batch);
+        CommitDoneEvent.SetAll();
+    }
+
+    trace(1, "Journal 0x%p stream %lu commit thread stop", &JournalRef, Index);
+
+    return MakeError(Core::Error::Success);
+}
+
+JournalTxCommitter::JournalTxCommitter(const Transaction::Ptr& tx)
+    : Tx(tx)
+{
+}
+
+JournalTxCommitter::~JournalTxCommitter()
+{
+}
+
+Core::Error JournalTxCommitter::Run(const Core::Threadable& thread)
+{
+    return Tx->Commit();
+}
+
+JournalCommitter::JournalCommitter(JournalStream& stream)
+    : StreamRef(stream)
+{
+}
+
+JournalCommitter::~JournalCommitter()
+{
+}
+
+Core::Error JournalCommitter::Run(const Core::Threadable& thread)
+{
+    return StreamRef.RunCommit(thread);
+}
+
+Core::Error JournalStream::Apply(const JournalBatch::Ptr& batch)
+{
+    JournalApplier applier(JournalRef);
+    Core::Error err;
+
+    for (size_t i = 0; i < batch->BlockList.GetSize(); i++)
+    {
+        auto& block = batch->BlockList[i];
+        if (block.DataPage.Get() == nullptr)
+            continue;
+
+        err = applier.Add(block);
+        if (!err.Ok())
+            break;
+    }
+
+    //Home writes must be durable before the log is checkpointed,
+    //a flush of the journal device doesn't cover a separate data device
+    if (err.Ok())
+        err = applier.Complete(JournalRef.VolumeRef.HasExternalJournal());
+
+    if (!err.Ok())
+    {
+        //Keep batch in log to be replayed on next load, later batches can't be erased past it
+        trace(0, "Journal 0x%p stream %lu apply error %d", &JournalRef, Index, err.GetCode());
+
+        Core::AutoLock lock(LogRbLock);
+        FailResult = err;
+        SpaceEvent.SetAll();
+        return err;
+    }
+
+    auto eraseErr = EraseBatch(batch);
+    if (!eraseErr.Ok())
+    {
+        trace(0, "Journal 0x%p stream %lu batch %s erase error %d",
+            &JournalRef, Index, batch->TxId.ToString().GetConstBuf(), eraseErr.GetCode());
+    }
+
+    return err;
+}
+
+Core::Error JournalStream::GetFailResult()
+{
+    Core::SharedAutoLock lock(LogRbLock);
+
+    return FailResult;
+}
+
+Core::Error JournalStream::ReplayTxBlock(size_t index, const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page,
+    Core::LinkedList<JournalTxBlockPtr>& txBlockList, Core::LinkedList<JournalDataBlock>& dataBlockList,
+    bool& complete)
+{
+    complete = false;
+    if (ReplayDataLeft != 0)
+    {
+        auto& descriptor = *reinterpret_cast<Api::JournalTxDescriptorBlock*>(txBlockList.Tail().Get());
+        auto& entry = descriptor.Entries[descriptor.EntryCount - ReplayDataLeft];
+
+        unsigned char hash[Api::HashSize];
+        {
+            Core::PageMap pageMap(*page.Get());
+            Core::XXHash::Sum(pageMap.GetAddress(), page->GetSize(), hash);
+        }
+
+        trace(3, "Journal 0x%p stream %lu replay index %lu data pos %llu", &JournalRef, Index, index, entry.Position);
+
+        if (!Core::Memory::ArrayEqual(hash, entry.DataHash))
+            return MakeError(Core::Error::DataCorrupt);
+
+        if (!dataBlockList.AddTail(JournalDataBlock(entry.Position, page)))
+            return MakeError(Core::Error::NoMemory);
+
+        ReplayDataLeft--;
+        return MakeError(Core::Error::Success);
+    }
+
+    auto err = JournalRef.ReadTxBlockComplete(*page.Get());
+    if (!err.Ok())
+        return err;
+
+    auto block = Core::MakeShared<Api::JournalTxBlock, Core::Memory::PoolType::Kernel>();
+    if (block.Get() == nullptr)
+        return MakeError(Core::Error::NoMemory);
+
+    if (page->Read(block.Get(), sizeof(*block.Get()), 0) != page->GetSize())
+        return MakeError(Core::Error::UnexpectedEOF);
+
+    trace(3, "Journal 0x%p stream %lu replay index %lu block %u", &JournalRef, Index, index, block->Type);
+
+    switch (block->Type)
+    {
+    case Api::JournalBlockTypeTxBegin:
+        if (!txBlockList.IsEmpty())
+            return MakeError(Core::Error::DataCorrupt);
+        if (reinterpret_cast<Api::JournalTxBeginBlock*>(block.Get())->Sequence != NextSequence)
+            return MakeError(Core::Error::DataCorrupt);
+        break;
+    case Api::JournalBlockTypeTxDescriptor:
+        if (txBlockList.IsEmpty())
+            return MakeError(Core::Error::DataCorrupt);
+        ReplayDataLeft = reinterpret_cast<Api::JournalTxDescriptorBlock*>(block.Get())->EntryCount;
+        break;
+    case Api::JournalBlockTypeTxCommit:
+        if (txBlockList.Count() < 2)
+            return MakeError(Core::Error::DataCorrupt);
+        break;
+    default:
+        return MakeError(Core::Error::DataCorrupt);
+    }
+
+    if (!txBlockList.AddTail(block))
+        return MakeError(Core::Error::NoMemory);
+
+    if (block->Type != Api::JournalBlockTypeTxCommit)
+        return MakeError(Core::Error::Success);
+
+    err = JournalRef.CheckTx(txBlockList, dataBlockList);
+    if (!err.Ok())
+        return err;
+
+    complete = true;
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error JournalStream::ReplayNextTx(Core::LinkedList<JournalTxBlockPtr>& txBlockList,
+    Core::LinkedList<JournalDataBlock>& dataBlockList)
+{
+    Core::AutoLock lock(LogRbLock);
+    size_t capacity = LogRb.GetCapacity();
+
+    txBlockList.Clear();
+    dataBlockList.Clear();
+    ReplayDataLeft = 0;
+    while (ReplayScanned < capacity)
+    {
+        size_t consumed = txBlockList.Count() + dataBlockList.Count();
+        if (ReplayPageList.IsEmpty())
+        {
+            if (!ReplayReadResult.Ok())
+                break;
+
+            size_t readIndex = (ReplayIndex + consumed) % capacity;
+            size_t readScanned = ReplayScanned + consumed;
+            if (readScanned >= capacity)
+                break;
+
+            size_t count = Core::Memory::Min<size_t>(capacity - readScanned, capacity - readIndex);
+            count = Core::Memory::Min<size_t>(count, JournalReplayReadAhead);
+
+            ReplayReadResult = ReadTxBlocks(readIndex, count, ReplayPageList);
+            if (ReplayPageList.IsEmpty())
+                break;
+        }
+
+        auto page = ReplayPageList.Head();
+        ReplayPageList.PopHead();
+
+        bool complete;
+        auto err = ReplayTxBlock((ReplayIndex + consumed) % capacity, page, txBlockList, dataBlockList, complete);
+        if (!err.Ok())
+        {
+            ReplayReadResult = err;
+            break;
+        }
+
+        if (complete)
+        {
+            consumed = txBlockList.Count() + dataBlockList.Count();
+            ReplayIndex = (ReplayIndex + consumed) % capacity;
+            ReplayScanned += consumed;
+            ReplayEndIndex = ReplayIndex;
+            NextSequence++;
+            return MakeError(Core::Error::Success);
+        }
+    }
+
+    txBlockList.Clear();
+    dataBlockList.Clear();
+    ReplayPageList.Clear();
+    ReplayDataLeft = 0;
+
+    if (!ReplayReadResult.Ok() && ReplayReadResult != Core::Error::DataCorrupt)
+        return ReplayReadResult;
+
+    trace(1, "Journal 0x%p stream %lu replay found log end at index %lu seq %llu",
+        &JournalRef, Index, ReplayEndIndex, NextSequence);
+
+    return MakeError(Core::Error::NotFound);
+}
+
+Core::Error JournalStream::ReplayComplete()
+{
+    Core::AutoLock lock(LogRbLock);
+
+    if (!LogRb.Reset(ReplayEndIndex, ReplayEndIndex, 0, LogRb.GetCapacity()))
+        return MakeError(Core::Error::BadSize);
+
+    LogStartSequence = NextSequence;
+    CheckpointLag = 0;
+    ReplayPageList.Clear();
+
+    return WriteHeaderLocked();
+}
+
+Core::Error JournalStream::Flush(Core::NoIOBioList& bioList)
+{
+    auto err = JournalRef.VolumeRef.GetIoScheduler().SubmitWait(bioList, IoClassCommit, true);
+    if (!err.Ok())
+    {
+        trace(0, "Journal 0x%p stream %lu flush err %d", &JournalRef, Index, err.GetCode());
+        return err;
+    }
+
+    CompactLog();
+
+    trace(3, "Journal 0x%p stream %lu flush %d", &JournalRef, Index, err.GetCode());
+    return err;
+}
+
+Core::Error JournalStream::WriteHeaderLocked()
+{
+    Core::Error err;
+    auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(JournalRef.WritePagePool, err);
+    if (!err.Ok())
+        return err;
+
+    page->Zero();
+    Core::PageMap pageMap(*page.Get());
+    Api::JournalStreamHeader *header = static_cast<Api::JournalStreamHeader *>(pageMap.GetAddress());
+
+    uint64_t globalSequence;
+    {
+        Core::AutoLock lock(JournalRef.GlobalSequenceLock);
+        globalSequence = JournalRef.GlobalSequence;
+    }
+
+    header->Magic = Core::BitOps::CpuToLe32(Api::JournalStreamMagic);
+    header->StreamIndex = Core::BitOps::CpuToLe64(Index);
+    header->LogStartIndex = Core::BitOps::CpuToLe64(LogRb.GetStartIndex());
+    header->LogEndIndex = Core::BitOps::CpuToLe64(LogRb.GetEndIndex());
+    header->LogSize = Core::BitOps::CpuToLe64(LogRb.GetSize());
+    header->LogCapacity = Core::BitOps::CpuToLe64(LogRb.GetCapacity());
+    header->LogSequence = Core::BitOps::CpuToLe64(LogStartSequence);
+    header->GlobalSequence = Core::BitOps::CpuToLe64(globalSequence);
+
+    Core::XXHash::Sum(header, OFFSET_OF(Api::JournalStreamHeader, Hash), header->Hash);
+    pageMap.Unmap();
+
+    Core::NoIOBioList bioList(JournalRef.GetDevice());
+    bioList.SetBioSet(&JournalRef.WriteBioSet);
+    err = bioList.AddIo(page, Start * JournalRef.GetBlockSize(), true);
+    if (err.Ok())
+        err = JournalRef.VolumeRef.GetIoScheduler().SubmitWait(bioList, IoClassCommit, true);
+    if (!err.Ok())
+    {
+        trace(0, "Journal 0x%p stream %lu write header err %d", &JournalRef, Index, err.GetCode());
+        return err;
+    }
+
+    trace(1, "Journal 0x%p stream %lu checkpoint, logStartIndex %llu logEndIndex %llu logSize %llu logCapacity %llu logSequence %llu",
+        &JournalRef, Index, LogRb.GetStartIndex(), LogRb.GetEndIndex(), LogRb.GetSize(),
+        LogRb.GetCapacity(), LogStartSequence);
+
+    CheckpointLag = 0;
+    ReleaseRetainedPagesLocked();
+    return err;
+}
+
+void JournalStream::RetainPendingPages(const JournalBatch::Ptr& batch)
+{
+    //Replay takes the log from the header on, a page may only move to another stream
+    //once the header is past every batch of this stream that writes it
+    auto it = batch->TxList.GetIterator();
+    for (;it.IsValid(); it.Next())
+    {
+        auto& tx = it.Get();
+        tx->AcquireLock();
+        if (tx->Pending)
+        {
+            Core::AutoLock lock(LogRbLock);
+            while (!Core::IsListEmpty(&tx->RetainedPages))
+            {
+                auto retained = CONTAINING_RECORD(Core::RemoveHeadList(&tx->RetainedPages), JournalRetainedPages, Link);
+                retained->Sequence = batch->Sequence;
+                Core::InsertTailList(&RetainedPages, &retained->Link);
+            }
+            tx->Pending = false;
+        }
+        tx->ReleaseLock();
+    }
+}
+
+bool JournalStream::HasPassedRetainedLocked()
+{
+    if (Core::IsListEmpty(&RetainedPages))
+        return false;
+
+    auto retained = CONTAINING_RECORD(RetainedPages.Flink, JournalRetainedPages, Link);
+    return retained->Sequence < LogStartSequence;
+}
+
+void JournalStream::ReleaseRetainedPagesLocked()
+{
+    if (!HasPassedRetainedLocked())
+        return;
+
+    {
+        Core::AutoLock lock(JournalRef.PendingLock);
+        while (HasPassedRetainedLocked())
+        {
+            auto retained = CONTAINING_RECORD(Core::RemoveHeadList(&RetainedPages), JournalRetainedPages, Link);
+            for (uint64_t page = retained->FirstPage; page <= retained->LastPage; page++)
+                JournalRef.PutPendingPageLocked(page);
+            Core::InsertTailList(&JournalRef.FreeRetainedPages, &retained->Link);
+        }
+    }
+
+    JournalRef.PendingEvent.SetAll();
+}
+
+void JournalStream::CheckpointRetained()
+{
+    Core::AutoLock lock(LogRbLock);
+
+    if (!HasPassedRetainedLocked())
+        return;
+
+    auto err = WriteHeaderLocked();
+    if (!err.Ok())
+    {
+        trace(0, "Journal 0x%p stream %lu checkpoint err %d", &JournalRef, Index, err.GetCode());
+    }
+}
+
+Core::Error JournalStream::IndexToPosition(size_t index, uint64_t& position)
+{
+    if ((index + 1) >= Size)
+    {
+        return MakeError(Core::Error::Overflow);
+    }
+
+    position =  (Start + 1 + index) * JournalRef.GetBlockSize();
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error JournalStream::ReadTxBlocks(size_t index, size_t count, Core::LinkedList<Core::Page<Core::Memory::PoolType::NoIO>::Ptr>& pageList)
+{
+    if (count == 0 || (index + count) > LogRb.GetCapacity())
+        return MakeError(Core::Error::InvalidValue);
+
+    Core::Error err;
+    Core::NoIOBioList bioList(JournalRef.GetDevice());
+    Core::LinkedList<Core::Page<Core::Memory::PoolType::NoIO>::Ptr> readPageList;
+
+    for (size_t off = 0; off < count; off += JournalReplayBioPages)
+    {
+        uint64_t position;
+        err = IndexToPosition(index + off, position);
+        if (!err.Ok())
+            return err;
+
+        Core::Vector<Core::Page<Core::Memory::PoolType::NoIO>::Ptr, Core::Memory::PoolType::NoIO> pages;
+        if (!pages.ReserveAndUse(Core::Memory::Min<size_t>(count - off, JournalReplayBioPages)))
+            return MakeError(Core::Error::NoMemory);
+
+        for (size_t i = 0; i < pages.GetSize(); i++)
+        {
+            pages[i] = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
+            if (!err.Ok())
+                return err;
+
+            if (!readPageList.AddTail(pages[i]))
+                return MakeError(Core::Error::NoMemory);
+        }
+
+        err = bioList.AddIo(pages, position, false);
+        if (!err.Ok())
+            return err;
+    }
+
+    err = bioList.SubmitWaitResult();
+    if (!err.Ok())
+        return err;
+
+    //Pages are parsed by ReplayTxBlock as data pages carry no header of their own
+    pageList.AddTail(Core::Memory::Move(readPageList));
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error JournalStream::WriteTxBlock(uint64_t index, const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page, Core::NoIOBioList& bioList)
+{
+    uint64_t position;
+    auto err = IndexToPosition(index, position);
+    if (!err.Ok())
+        return err;
+
+    err = JournalRef.WriteTxBlockPrepare(*page.Get());
+    if (!err.Ok())
+        return err;
+
+    return bioList.AddIo(page, position, true);
+}
+
+Core::Error JournalStream::GetNextIndex(size_t& index)
+{
+    size_t localIndex = -1;
+
+    Core::AutoLock lock(LogRbLock);
+    if ((LogRb.GetSize() + CheckpointLag + 1) >= LogRb.GetCapacity() && CheckpointLag != 0)
+    {
+        auto err = WriteHeaderLocked();
+        if (!err.Ok())
+            return err;
+    }
+
+    if ((LogRb.GetSize() + 1) >= LogRb.GetCapacity())
+        return MakeError(Core::Error::NoMemory);
+
+    auto err = LogRb.PushBack(localIndex);
+    if (!err.Ok())
+        return err;
+
+    trace(1, "Journal 0x%p stream %lu next index %lu", &JournalRef, Index, localIndex);
+    index = localIndex;
+    return MakeError(Core::Error::Success);
+}
+
+size_t JournalStream::GetWatermark(size_t percent)
+{
+    return (LogRb.GetCapacity() * percent) / 100;
+}
+
+Core::Error JournalStream::ReserveSpace(Transaction* tx)
+{
+    size_t dataCount = tx->DataBlockList.GetSize();
+    size_t count = dataCount + (dataCount + Api::JournalTxDescriptorMaxEntries - 1) / Api::JournalTxDescriptorMaxEntries + 2;
+    uint64_t throttleStart = 0;
+
+    for (;;)
+    {
+        {
+            //Space is freed under LogRbLock, so resetting here can't miss it. A wakeup
+            //taken by another writer's reset costs at most one wait timeout
+            Core::AutoLock lock(LogRbLock);
+            SpaceEvent.Reset();
+            if (!FailResult.Ok())
+                return FailResult;
+
+            if (Stopping)
+                return MakeError(Core::Error::InvalidState);
+
+            if (count >= LogRb.GetCapacity())
+                return MakeError(Core::Error::Overflow);
+
+            size_t used = LogRb.GetSize() + Reserved;
+            if (Throttled && used <= GetWatermark(JournalLowWatermarkPercent))
+                Throttled = false;
+
+            //Above high watermark writers wait until checkpointer drains log
+            //down to low watermark, oversized txs are allowed into empty log
+            if (!Throttled && !ForceThrottled && (used + count) < LogRb.GetCapacity() &&
+                (used == 0 || (used + count) <= GetWatermark(JournalHighWatermarkPercent)))
+            {
+                Reserved += count;
+                tx->ReservedBlocks = count;
+                if (throttleStart != 0)
+                    ThrottleTime += Core::Time::GetTime() - throttleStart;
+                return MakeError(Core::Error::Success);
+            }
+
+            Throttled = true;
+            if (throttleStart == 0)
+            {
+                throttleStart = Core::Time::GetTime();
+                ThrottleCount++;
+                trace(3, "Journal 0x%p stream %lu throttle tx 0x%p blocks %lu used %lu",
+                    &JournalRef, Index, tx, count, used);
+            }
+        }
+
+        SpaceEvent.Wait(10);
+    }
+}
+
+void JournalStream::StopReserve()
+{
+    {
+        Core::AutoLock lock(LogRbLock);
+        Stopping = true;
+    }
+
+    SpaceEvent.SetAll();
+}
+
+void JournalStream::SetThrottled(bool throttled)
+{
+    {
+        Core::AutoLock lock(LogRbLock);
+        ForceThrottled = throttled;
+    }
+
+    SpaceEvent.SetAll();
+}
+
+void JournalStream::ReleaseSpace(Transaction* tx)
+{
+    if (tx->ReservedBlocks == 0)
+        return;
+
+    {
+        Core::AutoLock lock(LogRbLock);
+        Reserved -= tx->ReservedBlocks;
+        tx->ReservedBlocks = 0;
+    }
+
+    SpaceEvent.SetAll();
+}
+
+void JournalStream::GetThrottleStats(uint64_t& count, uint64_t& time)
+{
+    Core::SharedAutoLock lock(LogRbLock);
+
+    count = ThrottleCount;
+    time = ThrottleTime;
+}
+
+Core::Error JournalStream::EraseBatch(const JournalBatch::Ptr& batch)
+{
+    Core::AutoLock lock(LogRbLock);
+    if (!BatchToErase.AddTail(batch))
+        return MakeError(Core::Error::NoMemory);
+
+    return MakeError(Core::Error::Success);
+}
+
+void JournalStream::CompactLog()
+{
+    Core::AutoLock lock(LogRbLock);
+
+    for (;;)
+    {
+        size_t count = 0;
+        auto it = BatchToErase.GetIterator();
+        for (;it.IsValid(); it.Next())
+        {
+            auto batch = it.Get();
+
+            if (LogRb.Erase(batch->IndexList))
+            {
+                CheckpointLag += batch->IndexList.Count();
+                LogStartSequence = batch->Sequence + 1;
+
+                trace(1, "Journal 0x%p stream %lu batch %s erased",
+                    &JournalRef, Index, batch->TxId.ToString().GetConstBuf());
+                it.Erase();
+                count++;
+            }
+        }
+
+        if (count == 0)
+            break;
+    }
+
+    trace(1, "Journal 0x%p stream %lu batch leaks %lu",
+        &JournalRef, Index, BatchToErase.Count());
+
+    BatchToErase.Clear();
+
+    if (CheckpointLag >= (LogRb.GetCapacity() / JournalCheckpointLagDivider) ||
+        (CheckpointLag != 0 &&
+         (LogRb.GetSize() + Reserved + CheckpointLag) > GetWatermark(JournalHighWatermarkPercent)))
+        WriteHeaderLocked();
 
-    TxToErase.Clear();
+    SpaceEvent.SetAll();
 }
 
 }
\ No newline at end of file
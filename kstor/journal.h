@@ -2,32 +2,92 @@
 
 #include "forwards.h"
 #include "guid.h"
+#include "io_scheduler.h"
 
 #include <core/error.h>
 #include <core/memory.h>
 #include <core/shared_ptr.h>
 #include <core/unique_ptr.h>
 #include <core/page.h>
-#include <core/hash_table.h>
 #include <core/rwsem.h>
 #include <core/list.h>
 #include <core/thread.h>
 #include <core/runnable.h>
 #include <core/event.h>
 #include <core/bio.h>
+#include <core/block_device.h>
 #include <core/ring_buffer.h>
 #include <core/pair.h>
+#include <core/btree.h>
+#include <core/spinlock.h>
+#include <core/vector.h>
+#include <core/bio_set.h>
+#include <core/page_pool.h>
+#include <core/list_entry.h>
 
 namespace KStor
 {
 
 class Journal;
+class JournalStream;
+class JournalBatch;
+
+const size_t JournalMaxStreams = 8;
+const size_t JournalStreamMinSize = 256;
+const size_t JournalReplayBioPages = 64;
+const size_t JournalReplayReadAhead = 16 * JournalReplayBioPages;
+const size_t JournalApplyMaxBios = 256;
+const size_t JournalCheckpointLagDivider = 4;
+const size_t JournalHighWatermarkPercent = 75;
+const size_t JournalLowWatermarkPercent = 50;
+const size_t JournalBlockPagePoolSize = 16;
+const size_t JournalMaxInflightBatches = 4;
+const size_t JournalBioSetPerStream = 2 * (JournalMaxInflightBatches + 1);
+const size_t JournalPagePoolPerStream = JournalMaxInflightBatches + 1;
+const size_t JournalTxPoolSize = 64;
 
 using JournalTxBlockPtr = Core::SharedPtr<Api::JournalTxBlock>;
 
+struct JournalDataBlock
+{
+    JournalDataBlock()
+        : Position(0)
+    {
+    }
+
+    JournalDataBlock(uint64_t position, const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& dataPage)
+        : Position(position)
+        , DataPage(dataPage)
+    {
+    }
+
+    uint64_t Position;
+    Core::Page<Core::Memory::PoolType::NoIO>::Ptr DataPage;
+};
+
+//Linked through a tx, a stream and the journal free list in turn, so it is
+//allocated once and reused
+struct JournalRetainedPages
+{
+    JournalRetainedPages()
+        : Sequence(0)
+        , FirstPage(0)
+        , LastPage(0)
+    {
+        Core::InitializeListHead(&Link);
+    }
+
+    Core::ListEntry Link;
+    uint64_t Sequence;
+    uint64_t FirstPage;
+    uint64_t LastPage;
+};
+
 class Transaction
 {
 friend Journal;
+friend JournalStream;
+friend JournalBatch;
 public:
     using Ptr = Core::SharedPtr<Transaction>;
 
@@ -35,40 +95,114 @@ public:
 
     virtual ~Transaction();
 
-    Core::Error Write(const Core::PageInterface& page, uint64_t position);
+    //Page is referenced by the journal until the tx is applied and must not be modified
+    Core::Error Write(const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page, uint64_t position);
 
     const Guid& GetTxId() const;
 
     Core::Error Commit();
 
+    Core::Error StartCommit();
+    Core::Error WaitCommit();
+
+    //Returns once the tx is durable in the log, before it's applied home
+    Core::Error WaitJournaled();
+
     void Cancel();
 
     void AcquireLock();
     void ReleaseLock();
     unsigned int GetState();
 
-    Core::LinkedList<size_t>& GetIndexList();
-
 private:
 
+    void OnJournaledLocked(const Core::Error& result);
+    void OnJournaled(const Core::Error& result);
     void OnCommitCompleteLocked(const Core::Error& result);
     void OnCommitComplete(const Core::Error& result);
-    JournalTxBlockPtr CreateTxBlock(unsigned int type);
 
-    Core::Error WriteTx(Core::NoIOBioList& bioList);
+    //Makes a pooled tx new again, keeps its block vector for reuse
+    Core::Error Reset();
+    void DropBlocks();
 
     Journal& JournalRef;
+    JournalStream* Stream;
+    bool Pending;
+    bool Journaled;
+    size_t ReservedBlocks;
     unsigned int State;
     Guid TxId;
-    JournalTxBlockPtr BeginBlock;
 
-    Core::LinkedList<JournalTxBlockPtr> DataBlockList;
-    Core::LinkedList<size_t> IndexList;
+    Core::Vector<JournalDataBlock> DataBlockList;
+    //Taken with the pending pages, moved to the stream once the tx is logged
+    Core::ListEntry RetainedPages;
+
+    //Registered tx keeps itself alive until it is unlinked, protected by Lock
+    Transaction::Ptr Self;
 
-    JournalTxBlockPtr CommitBlock;
     Core::RWSem Lock;
     Core::Event CommitEvent;
     Core::Error CommitResult;
+    Core::Event JournaledEvent;
+    Core::Error JournaledResult;
+};
+
+class JournalBatch
+{
+friend JournalStream;
+public:
+    using Ptr = Core::SharedPtr<JournalBatch>;
+
+    JournalBatch(Core::BlockDevice& device, Core::BioSet& bioSet, Core::Error& err);
+    virtual ~JournalBatch();
+
+    Core::Error AddTx(const Transaction::Ptr& tx);
+
+private:
+    JournalBatch(const JournalBatch& other) = delete;
+    JournalBatch(JournalBatch&& other) = delete;
+    JournalBatch& operator=(const JournalBatch& other) = delete;
+    JournalBatch& operator=(JournalBatch&& other) = delete;
+
+    Core::Error AddBlock(const JournalDataBlock& block);
+
+    Guid TxId;
+    uint64_t Sequence;
+    Core::Vector<JournalDataBlock> BlockList;
+    Core::Btree<uint64_t, size_t, 4> PositionTree;
+    Core::LinkedList<size_t> IndexList;
+    Core::LinkedList<Core::Page<Core::Memory::PoolType::NoIO>::Ptr, Core::Memory::PoolType::NoIO> BlockPages;
+    Core::LinkedList<Transaction::Ptr> TxList;
+    Core::NoIOBioList DataBioList;
+    IoAsync<Core::Memory::PoolType::NoIO> DataIo;
+    Core::NoIOBioList CommitBioList;
+    size_t LogEndIndex;
+    size_t BlockCount;
+    size_t AbsorbedCount;
+};
+
+class JournalApplier
+{
+public:
+    JournalApplier(Journal& journal);
+    virtual ~JournalApplier();
+
+    Core::Error Add(const JournalDataBlock& block);
+    Core::Error Complete(bool preflushFua);
+
+private:
+    JournalApplier(const JournalApplier& other) = delete;
+    JournalApplier(JournalApplier&& other) = delete;
+    JournalApplier& operator=(const JournalApplier& other) = delete;
+    JournalApplier& operator=(JournalApplier&& other) = delete;
+
+    bool CheckOverlap(uint64_t position, size_t size);
+    Core::Error Submit(bool preflushFua);
+
+    Journal& JournalRef;
+    Core::NoIOBioList IoList;
+    Core::Btree<uint64_t, uint64_t, 4> SectorTree;
+    size_t IoCount;
 };
 
 const unsigned int JournalStateNew = 1;
@@ -77,75 +211,277 @@ const unsigned int JournalStateRunning = 3;
 const unsigned int JournalStateStopping = 4;
 const unsigned int JournalStateStopped = 4;
 
-class Journal : public Core::Runnable
+class JournalCommitter : public Core::Runnable
 {
+public:
+    JournalCommitter(JournalStream& stream);
+    virtual ~JournalCommitter();
+
+private:
+    JournalCommitter(const JournalCommitter& other) = delete;
+    JournalCommitter(JournalCommitter&& other) = delete;
+    JournalCommitter& operator=(const JournalCommitter& other) = delete;
+    JournalCommitter& operator=(JournalCommitter&& other) = delete;
+
+    Core::Error Run(const Core::Threadable& thread) override;
 
+    JournalStream& StreamRef;
+};
+
+class JournalTxCommitter : public Core::Runnable
+{
+public:
+    JournalTxCommitter(const Transaction::Ptr& tx);
+    virtual ~JournalTxCommitter();
+
+private:
+    JournalTxCommitter(const JournalTxCommitter& other) = delete;
+    JournalTxCommitter(JournalTxCommitter&& other) = delete;
+    JournalTxCommitter& operator=(const JournalTxCommitter& other) = delete;
+    JournalTxCommitter& operator=(JournalTxCommitter&& other) = delete;
+
+    Core::Error Run(const Core::Threadable& thread) override;
+
+    Transaction::Ptr Tx;
+};
+
+class JournalStream : public Core::Runnable
+{
+
+friend Journal;
 friend Transaction;
+friend JournalCommitter;
+
+public:
+    JournalStream(Journal& journal, size_t index);
+    virtual ~JournalStream();
+
+    Core::Error Load(uint64_t start, uint64_t size);
+    Core::Error Format(uint64_t start, uint64_t size);
+
+    Core::Error StartThread();
+    void StopThread();
+
+    Core::Error Unload();
+
+    void GetThrottleStats(uint64_t& count, uint64_t& time);
+
+private:
+    JournalStream(const JournalStream& other) = delete;
+    JournalStream(JournalStream&& other) = delete;
+    JournalStream& operator=(const JournalStream& other) = delete;
+    JournalStream& operator=(JournalStream&& other) = delete;
+
+    Core::Error QueueTx(const Transaction::Ptr& tx);
+    Core::Error WriteBatch(const JournalBatch::Ptr& batch);
+    Core::Error SubmitBatch(const JournalBatch::Ptr& batch);
+    void CommitBatch(const JournalBatch::Ptr& batch);
+    void FailBatchesLocked(const JournalBatch::Ptr& batch, const Core::Error& err);
+    void RollbackLogLocked(size_t endIndex);
+    void CompleteTxList(Core::LinkedList<Transaction::Ptr>& txList, const Core::Error& err);
+    void JournaledTxList(Core::LinkedList<Transaction::Ptr>& txList);
+    static void DataWriteComplete(Core::NoIOBioList* bioList, void* ctx);
+
+    Core::Error Run(const Core::Threadable& thread) override;
+    Core::Error RunCommit(const Core::Threadable& thread);
+
+    Core::Error Flush(Core::NoIOBioList& bioList);
+
+    Core::Error WriteHeaderLocked();
+
+    void RetainPendingPages(const JournalBatch::Ptr& batch);
+    bool HasPassedRetainedLocked();
+    void ReleaseRetainedPagesLocked();
+    void CheckpointRetained();
+
+    Core::Error IndexToPosition(size_t index, uint64_t& position);
+
+    Core::Error ReadTxBlocks(size_t index, size_t count, Core::LinkedList<Core::Page<Core::Memory::PoolType::NoIO>::Ptr>& pageList);
+    Core::Error WriteTxBlock(uint64_t index, const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page, Core::NoIOBioList& bioList);
+
+    Core::Page<Core::Memory::PoolType::NoIO>::Ptr GetBlockPage(const JournalBatch::Ptr& batch, Core::Error& err);
+    void PutBlockPages(const JournalBatch::Ptr& batch);
+
+    Core::Error GetNextIndex(size_t& index);
+
+    Core::Error ReserveSpace(Transaction* tx);
+    void StopReserve();
+    void SetThrottled(bool throttled);
+    void ReleaseSpace(Transaction* tx);
+    size_t GetWatermark(size_t percent);
+
+    Core::Error EraseBatch(const JournalBatch::Ptr& batch);
+
+    Core::Error Apply(const JournalBatch::Ptr& batch);
+    Core::Error GetFailResult();
+
+    void CompactLog();
+
+    Core::Error ReplayTxBlock(size_t index, const Core::Page<Core::Memory::PoolType::NoIO>::Ptr& page,
+        Core::LinkedList<JournalTxBlockPtr>& txBlockList, Core::LinkedList<JournalDataBlock>& dataBlockList,
+        bool& complete);
+    Core::Error ReplayNextTx(Core::LinkedList<JournalTxBlockPtr>& txBlockList,
+        Core::LinkedList<JournalDataBlock>& dataBlockList);
+    Core::Error ReplayComplete();
+
+    Journal& JournalRef;
+    size_t Index;
+
+    Core::LinkedList<Transaction::Ptr> TxList;
+    Core::UniquePtr<Core::Thread> TxThread;
+    Core::RWSem TxListLock;
+    Core::Event TxListEvent;
+    Core::RWSem Lock;
+
+    JournalCommitter Committer;
+    Core::UniquePtr<Core::Thread> CommitThread;
+    Core::LinkedList<JournalBatch::Ptr> CommitQueue;
+    Core::RWSem CommitQueueLock;
+    Core::Event CommitQueueEvent;
+    Core::Event CommitDoneEvent;
+
+    Core::Vector<Core::Page<Core::Memory::PoolType::NoIO>::Ptr> BlockPagePool;
+    Core::SpinLock BlockPagePoolLock;
+
+    Core::RingBuffer LogRb;
+    Core::LinkedList<JournalBatch::Ptr> BatchToErase;
+    Core::RWSem LogRbLock;
+    uint64_t LogStartSequence;
+    uint64_t NextSequence;
+    size_t CheckpointLag;
+    Core::ListEntry RetainedPages;
+    Core::Error FailResult;
+
+    size_t Reserved;
+    bool Throttled;
+    bool ForceThrottled;
+    bool Stopping;
+    Core::Event SpaceEvent;
+    uint64_t ThrottleCount;
+    uint64_t ThrottleTime;
+
+    Core::LinkedList<Core::Page<Core::Memory::PoolType::NoIO>::Ptr> ReplayPageList;
+    Core::Error ReplayReadResult;
+    size_t ReplayDataLeft;
+    size_t ReplayIndex;
+    size_t ReplayEndIndex;
+    size_t ReplayScanned;
+
+    uint64_t Start;
+    uint64_t Size;
+};
+
+struct JournalPendingPage
+{
+    JournalPendingPage()
+        : StreamIndex(0)
+        , Count(0)
+    {
+    }
+
+    JournalPendingPage(size_t streamIndex, size_t count)
+        : StreamIndex(streamIndex)
+        , Count(count)
+    {
+    }
+
+    size_t StreamIndex;
+    size_t Count;
+};
+
+class Journal
+{
+
+friend Transaction;
+friend JournalApplier;
+friend JournalStream;
 
 public:
     Journal(Volume& volume);
 
-    Core::Error Load(uint64_t start);
+    Core::Error Load(uint64_t start, const Guid& journalId);
     Core::Error Format(uint64_t start, uint64_t size);
 
     uint64_t GetStart();
 
     uint64_t GetSize();
 
+    const Guid& GetJournalId() const;
+
     virtual ~Journal();
 
     Transaction::Ptr BeginTx();
 
+    //Tx is recycled only if this is the last reference
+    void EndTx(Transaction::Ptr& tx);
+
     size_t GetBlockSize();
 
     Core::Error Unload();
 
-private:
-    Core::Error ApplyBlocks(Core::LinkedList<JournalTxBlockPtr>& blockList, bool preflushFua = false);
+    void GetThrottleStats(uint64_t& count, uint64_t& time);
+
+    //Test only, every stream throttles new txs as if its log was full
+    void SetThrottled(bool throttled);
 
-    Core::Error Replay(Core::LinkedList<JournalTxBlockPtr>&& blockList);
+private:
+    Journal(const Journal& other) = delete;
+    Journal(Journal&& other) = delete;
+    Journal& operator=(const Journal& other) = delete;
+    Journal& operator=(Journal&& other) = delete;
+
+    Core::Error CheckTx(Core::LinkedList<JournalTxBlockPtr>& blockList,
+        Core::LinkedList<JournalDataBlock>& dataBlockList);
+    Core::Error ReplayTx(Core::LinkedList<JournalTxBlockPtr>&& blockList,
+        Core::LinkedList<JournalDataBlock>&& dataBlockList, JournalApplier& applier);
     Core::Error Replay();
 
+    Core::Error CreateStreams(uint64_t streamCount);
+
     Core::Error StartCommitTx(Transaction* tx);
-    Core::Error WriteTx(const Transaction::Ptr& tx, Core::NoIOBioList& bioList);
     void UnlinkTx(Transaction* tx, bool cancel);
 
+    Core::Error AcquirePendingPages(Transaction* tx, size_t& streamIndex);
+    void ReleasePendingPages(Transaction* tx);
+    void PutPendingPagesLocked(Transaction* tx, size_t count);
+    void PutPendingPageLocked(uint64_t page);
+    Core::Error GetRetainedPagesLocked(Transaction* tx);
+    void PutRetainedPagesLocked(Core::ListEntry* list);
+
     Core::Error ReadTxBlockComplete(Core::PageInterface& page);
     Core::Error WriteTxBlockPrepare(Core::PageInterface& page);
 
-    JournalTxBlockPtr ReadTxBlock(uint64_t index, Core::Error& err);
-    Core::Error WriteTxBlock(uint64_t index, const JournalTxBlockPtr& block, Core::NoIOBioList& bioList);
-
-    Core::Error GetNextIndex(size_t& index);
-
-    Core::Error Run(const Core::Threadable& thread) override;
-
-    Core::Error Flush(Core::NoIOBioList& bioList);
+    uint64_t GetNextGlobalSequence();
 
     Core::Error CheckPosition(unsigned long long position, size_t size);
 
-    Core::Error IndexToPosition(size_t index, uint64_t& position);
-
-    Core::Error PositionToIndex(uint64_t position, size_t& index);
-
-    Core::Error EraseTx(Transaction* tx);
-
-    void CompactLog();
+    Core::BlockDevice& GetDevice();
 
 private:
 
     Volume& VolumeRef;
-    Core::HashTable<Guid, Transaction::Ptr, 512, Core::RWSem> TxTable;
-    Core::LinkedList<Transaction::Ptr> TxList;
-    Core::UniquePtr<Core::Thread> TxThread;
-    Core::RWSem TxListLock;
-    Core::Event TxListEvent;
     Core::RWSem Lock;
 
-    Core::RingBuffer LogRb;
-    Core::LinkedList<Transaction::Ptr> TxToErase;
-    Core::RWSem LogRbLock;
+    //Declared before streams so pages they hold are returned first
+    Core::BioSet WriteBioSet;
+    Core::PagePool WritePagePool;
+
+    Core::UniquePtr<JournalStream> Streams[JournalMaxStreams];
+    size_t StreamCount;
+
+    Core::Btree<uint64_t, JournalPendingPage, 4> PendingPages;
+    Core::RWSem PendingLock;
+    Core::Event PendingEvent;
+    //Protected by PendingLock
+    Core::ListEntry FreeRetainedPages;
+
+    Core::Vector<Transaction::Ptr> TxPool;
+    Core::SpinLock TxPoolLock;
+
+    uint64_t GlobalSequence;
+    Core::SpinLock GlobalSequenceLock;
 
+    Guid JournalId;
     uint64_t Start;
     uint64_t Size;
     unsigned int State;
@@ -0,0 +1,210 @@
+#include "readahead.h"
+
+#include <core/trace.h>
+#include <core/auto_lock.h>
+
+namespace KStor
+{
+
+ReadStream::ReadStream()
+    : LastExtent(ReadaheadInvalidExtent)
+    , PrefetchEnd(0)
+    , Window(0)
+{
+}
+
+ReadStream::~ReadStream()
+{
+}
+
+void ReadStream::Reset()
+{
+    Core::AutoLock lock(Lock);
+    LastExtent = ReadaheadInvalidExtent;
+    PrefetchEnd = 0;
+    Window = 0;
+}
+
+bool ReadStream::Next(uint64_t extent, uint64_t& start, uint64_t& end)
+{
+    Core::AutoLock lock(Lock);
+
+    bool sequential = (LastExtent != ReadaheadInvalidExtent && extent == LastExtent + 1);
+
+    LastExtent = extent;
+    if (!sequential)
+    {
+        Window = 0;
+        PrefetchEnd = extent + 1;
+        return false;
+    }
+
+    //Window doubles while the stream stays sequential
+    Window = (Window == 0) ? ReadaheadMinWindow : Core::Memory::Min<uint64_t>(2 * Window, ReadaheadMaxWindow);
+
+    start = Core::Memory::Max<uint64_t>(PrefetchEnd, extent + 1);
+    end = extent + 1 + Window;
+    if (start >= end)
+        return false;
+
+    PrefetchEnd = end;
+    return true;
+}
+
+ReadaheadEntry::ReadaheadEntry(Core::BlockDevice& device, uint64_t extent, Core::Error& err)
+    : Extent(extent)
+    , Submitted(false)
+    , IoList(device)
+{
+    if (!err.Ok())
+        return;
+
+    Pages = Core::PageVector<>::Create(Api::ChunkSize / Api::PageSize, err);
+}
+
+ReadaheadEntry::~ReadaheadEntry()
+{
+}
+
+ReadaheadCache::ReadaheadCache(Core::BlockDevice& device, IoScheduler& scheduler)
+    : Device(device)
+    , Scheduler(scheduler)
+    , EntryCount(0)
+{
+}
+
+ReadaheadCache::~ReadaheadCache()
+{
+    Clear();
+}
+
+ReadaheadEntry::Ptr ReadaheadCache::TakeLocked(uint64_t extent)
+{
+    auto it = EntryList.GetIterator();
+    for (;it.IsValid(); it.Next())
+    {
+        auto entry = it.Get();
+        if (entry->Extent == extent)
+        {
+            it.Erase();
+            EntryCount--;
+            return entry;
+        }
+    }
+
+    return ReadaheadEntry::Ptr();
+}
+
+void ReadaheadCache::Drop(ReadaheadEntry::Ptr& entry)
+{
+    //Bios must finish before the list and pages go away
+    if (entry->Submitted)
+        entry->IoList.WaitResult();
+
+    entry.Reset();
+}
+
+Core::Error ReadaheadCache::Prefetch(uint64_t extent, uint64_t position)
+{
+    Core::Error err;
+    auto entry = Core::MakeShared<ReadaheadEntry, Core::Memory::PoolType::Kernel>(Device, extent, err);
+    if (entry.Get() == nullptr)
+        return MakeError(Core::Error::NoMemory);
+
+    if (!err.Ok())
+        return err;
+
+    err = entry->IoList.AddIo(entry->Pages, position, false);
+    if (!err.Ok())
+        return err;
+
+    ReadaheadEntry::Ptr evicted;
+    {
+        Core::AutoLock lock(Lock);
+
+        auto it = EntryList.GetIterator();
+        for (;it.IsValid(); it.Next())
+        {
+            if (it.Get()->Extent == extent)
+                return MakeError(Core::Error::Success);
+        }
+
+        if (EntryCount >= ReadaheadMaxEntries)
+        {
+            evicted = EntryList.Head();
+            EntryList.PopHead();
+            EntryCount--;
+        }
+
+        //Submitted under the lock so an invalidation can't miss it,
+        //speculative reads are skipped rather than queued behind other I/O
+        err = Scheduler.SubmitAsync(entry->IoList, IoClassBackground, entry->Io, nullptr, nullptr, true);
+        if (err.Ok())
+        {
+            entry->Submitted = true;
+            if (EntryList.AddTail(entry))
+                EntryCount++;
+            else
+                evicted = entry;
+        }
+    }
+
+    if (evicted.Get() != nullptr)
+        Drop(evicted);
+
+    trace(4, "Readahead 0x%p prefetch extent %llu, err %d", this, extent, err.GetCode());
+
+    return err;
+}
+
+bool ReadaheadCache::Read(uint64_t extent, Core::PageVector<>::Ptr& pages, Core::Error& err)
+{
+    ReadaheadEntry::Ptr entry;
+    {
+        Core::AutoLock lock(Lock);
+        entry = TakeLocked(extent);
+    }
+
+    if (entry.Get() == nullptr)
+        return false;
+
+    err = entry->IoList.WaitResult();
+    entry->Submitted = false;
+    if (err.Ok())
+        pages = entry->Pages;
+
+    trace(4, "Readahead 0x%p hit extent %llu, err %d", this, extent, err.GetCode());
+
+    return true;
+}
+
+void ReadaheadCache::Invalidate(uint64_t extent)
+{
+    ReadaheadEntry::Ptr entry;
+    {
+        Core::AutoLock lock(Lock);
+        entry = TakeLocked(extent);
+    }
+
+    if (entry.Get() != nullptr)
+        Drop(entry);
+}
+
+void ReadaheadCache::Clear()
+{
+    Core::LinkedList<ReadaheadEntry::Ptr> entryList;
+    {
+        Core::AutoLock lock(Lock);
+        entryList = Core::Memory::Move(EntryList);
+        EntryCount = 0;
+    }
+
+    while (!entryList.IsEmpty())
+    {
+        auto entry = entryList.Head();
+        entryList.PopHead();
+        Drop(entry);
+    }
+}
+
+}
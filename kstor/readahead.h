@@ -0,0 +1,104 @@
+#pragma once
+
+#include <core/error.h>
+#include <core/type.h>
+#include <core/bio.h>
+#include <core/page_vector.h>
+#include <core/block_device.h>
+#include <core/shared_ptr.h>
+#include <core/rwsem.h>
+#include <core/list.h>
+#include <core/spinlock.h>
+
+#include "api.h"
+#include "io_scheduler.h"
+
+namespace KStor
+{
+
+const uint64_t ReadaheadInvalidExtent = ~static_cast<uint64_t>(0);
+const uint64_t ReadaheadMinWindow = 2;
+const uint64_t ReadaheadMaxWindow = 32;
+const size_t ReadaheadMaxEntries = 64;
+
+//Sequential read detection, one per client stream, requests of the stream
+//may be handled concurrently
+class ReadStream
+{
+public:
+    ReadStream();
+    virtual ~ReadStream();
+
+    //Records a read of the extent, returns true with [start, end) set
+    //when the following extents should be prefetched
+    bool Next(uint64_t extent, uint64_t& start, uint64_t& end);
+
+    void Reset();
+
+private:
+    ReadStream(const ReadStream& other) = delete;
+    ReadStream(ReadStream&& other) = delete;
+    ReadStream& operator=(const ReadStream& other) = delete;
+    ReadStream& operator=(ReadStream&& other) = delete;
+
+    uint64_t LastExtent;
+    uint64_t PrefetchEnd;
+    uint64_t Window;
+    Core::SpinLock Lock;
+};
+
+class ReadaheadEntry
+{
+public:
+    using Ptr = Core::SharedPtr<ReadaheadEntry>;
+
+    ReadaheadEntry(Core::BlockDevice& device, uint64_t extent, Core::Error& err);
+    virtual ~ReadaheadEntry();
+
+    uint64_t Extent;
+    bool Submitted;
+    Core::PageVector<>::Ptr Pages;
+    Core::BioList<> IoList;
+    IoAsync<> Io;
+
+private:
+    ReadaheadEntry(const ReadaheadEntry& other) = delete;
+    ReadaheadEntry(ReadaheadEntry&& other) = delete;
+    ReadaheadEntry& operator=(const ReadaheadEntry& other) = delete;
+    ReadaheadEntry& operator=(ReadaheadEntry&& other) = delete;
+};
+
+//Extents read ahead of sequential streams, each entry is consumed by one read
+class ReadaheadCache
+{
+public:
+    ReadaheadCache(Core::BlockDevice& device, IoScheduler& scheduler);
+    virtual ~ReadaheadCache();
+
+    Core::Error Prefetch(uint64_t extent, uint64_t position);
+
+    //Returns true if the extent was prefetched, err holds the read result
+    //and pages the extent data
+    bool Read(uint64_t extent, Core::PageVector<>::Ptr& pages, Core::Error& err);
+
+    void Invalidate(uint64_t extent);
+
+    void Clear();
+
+private:
+    ReadaheadCache(const ReadaheadCache& other) = delete;
+    ReadaheadCache(ReadaheadCache&& other) = delete;
+    ReadaheadCache& operator=(const ReadaheadCache& other) = delete;
+    ReadaheadCache& operator=(ReadaheadCache&& other) = delete;
+
+    ReadaheadEntry::Ptr TakeLocked(uint64_t extent);
+    void Drop(ReadaheadEntry::Ptr& entry);
+
+    Core::BlockDevice& Device;
+    IoScheduler& Scheduler;
+    Core::LinkedList<ReadaheadEntry::Ptr> EntryList;
+    size_t EntryCount;
+    Core::RWSem Lock;
+};
+
+}
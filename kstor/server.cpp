@@ -4,12 +4,13 @@
 #include <core/xxhash.h>
 #include <core/hex.h>
 #include <core/astring.h>
+#include <core/smp.h>
 
 namespace KStor 
 {
 
 Packet::Packet()
-    : Type(0), Result(0), DataSize(0)
+    : Type(0), Result(0), DataSize(0), RequestId(0)
 {
 }
 
@@ -43,19 +44,32 @@ Core::Error Packet::Parse(const Api::PacketHeader &header)
     unsigned int type = Core::BitOps::Le32ToCpu(header.Type);
     unsigned int result = Core::BitOps::Le32ToCpu(header.Result);
     unsigned int dataSize = Core::BitOps::Le32ToCpu(header.DataSize);
+    unsigned long long requestId = Core::BitOps::Le64ToCpu(header.RequestId);
 
     if (magic != Api::PacketMagic)
         return MakeError(Core::Error::InvalidValue);
     if (dataSize > Api::PacketMaxDataSize)
         return MakeError(Core::Error::InvalidValue);
 
-    Body.Clear();
-    if (!Body.ReserveAndUse(dataSize + sizeof(Api::PacketHeader)))
+    size_t inlineSize = GetInlineDataSize(type, dataSize);
+    size_t pagedSize = dataSize - inlineSize;
+
+    if (!ResizeBody(inlineSize + sizeof(Api::PacketHeader)))
         return MakeError(Core::Error::NoMemory);
 
+    Pages.Reset();
+    if (pagedSize != 0)
+    {
+        Core::Error err;
+        Pages = Core::PageVector<>::Create(pagedSize / Api::PageSize, err);
+        if (!err.Ok())
+            return err;
+    }
+
     Type = type;
     Result = result;
     DataSize = dataSize;
+    RequestId = requestId;
 
     return MakeError(Core::Error::Success);
 }
@@ -85,6 +99,16 @@ void Packet::SetResult(unsigned int result)
     Result = result;
 }
 
+unsigned long long Packet::GetRequestId() const
+{
+    return RequestId;
+}
+
+void Packet::SetRequestId(unsigned long long requestId)
+{
+    RequestId = requestId;
+}
+
 void* Packet::GetData()
 {
     return Core::Memory::MemAdd(GetBody(), sizeof(Api::PacketHeader));
@@ -100,10 +124,10 @@ Core::Error Packet::Create(unsigned int type, unsigned int result, unsigned int
     if (dataSize > Api::PacketMaxDataSize)
         return MakeError(Core::Error::BufToBig);
 
-    Body.Clear();
-    if (!Body.ReserveAndUse(dataSize + sizeof(Api::PacketHeader)))
+    if (!ResizeBody(dataSize + sizeof(Api::PacketHeader)))
         return MakeError(Core::Error::NoMemory);
 
+    Pages.Reset();
     Type = type;
     Result = result;
     DataSize = dataSize;
@@ -111,14 +135,95 @@ Core::Error Packet::Create(unsigned int type, unsigned int result, unsigned int
     return MakeError(Core::Error::Success);
 }
 
+Core::Error Packet::CreateWithPages(unsigned int type, unsigned int result, const Core::PageVector<>::Ptr& pages)
+{
+    if (pages->GetSize() > Api::PacketMaxDataSize)
+        return MakeError(Core::Error::BufToBig);
+
+    if (!ResizeBody(sizeof(Api::PacketHeader)))
+        return MakeError(Core::Error::NoMemory);
+
+    Pages = pages;
+    Type = type;
+    Result = result;
+    DataSize = static_cast<unsigned int>(pages->GetSize());
+
+    return MakeError(Core::Error::Success);
+}
+
+size_t Packet::GetInlineDataSize(unsigned int type, size_t dataSize)
+{
+    //Chunk payload is received into pages and handed to the volume as is
+    if (type == Api::PacketTypeChunkWrite && dataSize == sizeof(Api::ChunkWriteRequest))
+        return dataSize - Api::ChunkSize;
+
+    return dataSize;
+}
+
+bool Packet::ResizeBody(size_t size)
+{
+    //Capacity is kept, a recycled body is only reallocated to grow
+    if (!Body.ReserveAndUse(size))
+        return false;
+
+    return Body.Truncate(size);
+}
+
+bool Packet::ReserveBody(size_t size)
+{
+    return Body.Reserve(size);
+}
+
+size_t Packet::GetBodyCapacity() const
+{
+    return Body.GetCapacity();
+}
+
+void Packet::Reset()
+{
+    Body.Truncate(0);
+    Pages.Reset();
+    Type = 0;
+    Result = 0;
+    DataSize = 0;
+    RequestId = 0;
+}
+
+size_t Packet::GetInlineSize() const
+{
+    return Body.GetSize() - sizeof(Api::PacketHeader);
+}
+
+const Core::PageVector<>::Ptr& Packet::GetPages() const
+{
+    return Pages;
+}
+
+void Packet::ComputeDataHash(unsigned char hash[Api::HashSize])
+{
+    Core::XXHash dataHash;
+    dataHash.Update(GetData(), GetInlineSize());
+    if (Pages.Get() != nullptr)
+    {
+        for (size_t i = 0; i < Pages->GetPageCount(); i++)
+        {
+            void* va = Pages->MapPageAtomic(i);
+            dataHash.Update(va, Pages->GetPageSize());
+            Pages->UnmapPageAtomic(va);
+        }
+    }
+    dataHash.GetSum(hash);
+}
+
 void Packet::PrepareSend()
 {
     GetHeader()->Type = Core::BitOps::CpuToLe32(Type);
     GetHeader()->Result = Core::BitOps::CpuToLe32(Result);
     GetHeader()->DataSize = Core::BitOps::CpuToLe32(DataSize);
+    GetHeader()->RequestId = Core::BitOps::CpuToLe64(RequestId);
     GetHeader()->Magic = Core::BitOps::CpuToLe32(Api::PacketMagic);
 
-    Core::XXHash::Sum(GetData(), GetDataSize(), GetHeader()->DataHash);
+    ComputeDataHash(GetHeader()->DataHash);
     Core::XXHash::Sum(GetHeader(), OFFSET_OF(Api::PacketHeader, Hash), GetHeader()->Hash);
 }
 
@@ -126,13 +231,129 @@ Packet::~Packet()
 {
 }
 
+PacketPool::PacketPool()
+{
+    //Lists never grow under the lock, a failed reserve just disables the class
+    for (size_t i = 0; i < PacketPoolClassCount; i++)
+        FreeList[i].Reserve(GetClassMaxCount(i));
+}
+
+PacketPool::~PacketPool()
+{
+}
+
+size_t PacketPool::GetClassBodySize(size_t index)
+{
+    switch (index)
+    {
+    case 0:
+        return sizeof(Api::PacketHeader) + PacketPoolSmallDataSize;
+    case 1:
+        return sizeof(Api::PacketHeader) + PacketPoolPageDataSize;
+    default:
+        return sizeof(Api::PacketHeader) + Api::PacketMaxDataSize;
+    }
+}
+
+size_t PacketPool::GetClassMaxCount(size_t index)
+{
+    switch (index)
+    {
+    case 0:
+        return PacketPoolMaxSmall;
+    case 1:
+        return PacketPoolMaxPage;
+    default:
+        return PacketPoolMaxLarge;
+    }
+}
+
+Packet::Ptr PacketPool::Alloc(size_t dataSize)
+{
+    size_t bodySize = dataSize + sizeof(Api::PacketHeader);
+    size_t index = 0;
+    for (; index < PacketPoolClassCount; index++)
+    {
+        if (bodySize <= GetClassBodySize(index))
+            break;
+    }
+
+    Packet::Ptr packet;
+    if (index < PacketPoolClassCount)
+    {
+        Core::AutoLock lock(Lock);
+        auto& freeList = FreeList[index];
+        size_t count = freeList.GetSize();
+        if (count != 0)
+        {
+            packet = Core::Memory::Move(freeList[count - 1]);
+            freeList.Truncate(count - 1);
+        }
+    }
+
+    if (packet.Get() != nullptr)
+        return packet;
+
+    packet = Core::MakeShared<Packet, Core::Memory::PoolType::Kernel>();
+    if (packet.Get() == nullptr)
+        return packet;
+
+    //Failure isn't fatal, the body is sized again when filled
+    if (index < PacketPoolClassCount)
+        packet->ReserveBody(GetClassBodySize(index));
+
+    return packet;
+}
+
+void PacketPool::Free(Packet::Ptr& packet)
+{
+    if (packet.Get() == nullptr)
+        return;
+
+    if (packet.GetCounter() != 1)
+    {
+        packet.Reset();
+        return;
+    }
+
+    packet->Reset();
+
+    //Largest class the body can serve
+    size_t capacity = packet->GetBodyCapacity();
+    size_t index = PacketPoolClassCount;
+    while (index > 0 && capacity < GetClassBodySize(index - 1))
+        index--;
+
+    if (index != 0)
+    {
+        auto& freeList = FreeList[index - 1];
+
+        Core::AutoLock lock(Lock);
+        if (freeList.GetSize() < freeList.GetCapacity())
+            freeList.PushBack(Core::Memory::Move(packet));
+    }
+
+    packet.Reset();
+}
+
 Server::Server()
+    : NextWorker(0)
+    , NextIoThread(0)
 {
 }
 
-Server::Connection::Connection(Server& srv, Core::UniquePtr<Core::Socket>&& socket)
-    : Srv(srv), Sock(Core::Memory::Move(socket))
+Server::Connection::Connection(Server& srv, Core::UniquePtr<Core::Socket>&& socket, IoThread& ioThread)
+    : Srv(srv), Io(ioThread), Sock(Core::Memory::Move(socket))
+    , HeaderReceived(0), BodyReceived(0), Outstanding(0), Failed(0), Throttled(0)
+    , Queued(false), Detached(false)
 {
+    Core::InitializeListHead(&ReadyLink);
+    Core::InitializeListHead(&FreeTasks);
+    for (int i = 0; i < ServerMaxConnRequests; i++)
+    {
+        Tasks[i].Conn = this;
+        Core::InsertTailList(&FreeTasks, &Tasks[i].FreeLink);
+    }
     trace(3, "Connection 0x%p created", this);
 }
 
@@ -141,27 +362,17 @@ Core::Error Server::Connection::Start()
     trace(3, "Connection 0x%p starting", this);
 
     Core::AutoLock lock(StateLock);
-    if (ConnThread.Get() != nullptr || Sock.Get() == nullptr)
+    if (Sock.Get() == nullptr)
     {
         return MakeError(Core::Error::InvalidState);
     }
 
-    Core::Error err;
-    Core::AString name("kstor-con", err);
+    Core::Error err = Sock->SetReadyCallback(&Connection::ReadyCallback, this);
     if (!err.Ok())
         return err;
 
-    ConnThread = Core::MakeUnique<Core::Thread, Core::Memory::PoolType::Kernel>(name, this, err);
-    if (ConnThread.Get() == nullptr)
-    {
-        err = MakeError(Core::Error::NoMemory);
-        return err;
-    }
-    if (!err.Ok())
-    {
-        ConnThread.Reset();
-        return err;
-    }
+    //Data may have arrived before the callback was installed
+    Io.Queue(this);
     return err;
 }
 
@@ -171,7 +382,15 @@ void Server::Connection::Stop()
 
     Core::AutoLock lock(StateLock);
 
-    ConnThread.Reset();
+    if (Sock.Get() != nullptr)
+        Sock->ClearReadyCallback();
+
+    Io.Remove(this);
+    WaitRequests(0);
+    {
+        Core::AutoLock completeLock(CompleteLock);
+    }
+
     if (Sock.Get() != nullptr)
     {
         Sock->Close();
@@ -182,7 +401,10 @@ void Server::Connection::Stop()
 bool Server::Connection::Closed()
 {
     Core::AutoLock lock(StateLock);
-    return (Sock.Get() == nullptr) ? true : false;
+    if (Sock.Get() == nullptr)
+        return true;
+
+    return (Failed.Get() != 0 && Outstanding.Get() == 0) ? true : false;
 }
 
 Server::Connection::~Connection()
@@ -191,62 +413,156 @@ Server::Connection::~Connection()
     trace(3, "Connection 0x%p dtor", this);
 }
 
-Packet::Ptr Server::Connection::RecvPacket(Core::Error& err)
+void Server::Connection::ReadyCallback(void* ctx)
 {
-    Packet::Ptr packet;
-    Api::PacketHeader header;
+    Connection* conn = static_cast<Connection*>(ctx);
+    conn->Io.Queue(conn);
+}
+
+Core::Error Server::Connection::RecvRequest(Packet::Ptr& request)
+{
+    Core::Error err;
     unsigned long received;
 
-    err = Sock->RecvAll(&header, sizeof(header), received);
-    if (!err.Ok())
+    if (HeaderReceived < sizeof(Header))
     {
-        if (err != Core::Error::ConnReset)
-            trace(0, "Connection 0x%p read header err %d", this, err.GetCode());
+        err = Sock->RecvNonBlock(Core::Memory::MemAdd(&Header, HeaderReceived),
+            sizeof(Header) - HeaderReceived, received);
+        if (!err.Ok())
+            return err;
 
-        return packet;
+        HeaderReceived += received;
+        if (HeaderReceived < sizeof(Header))
+            return MakeError(Core::Error::Again);
+
+        Pending = Pool.Alloc(Packet::GetInlineDataSize(Core::BitOps::Le32ToCpu(Header.Type),
+            Core::BitOps::Le32ToCpu(Header.DataSize)));
+        if (Pending.Get() == nullptr)
+        {
+            err = MakeError(Core::Error::NoMemory);
+            trace(0, "Connection 0x%p can't allocate packet err %d", this, err.GetCode());
+            return err;
+        }
+
+        err = Pending->Parse(Header);
+        if (!err.Ok())
+        {
+            trace(0, "Connection 0x%p can't parse packet err %d", this, err.GetCode());
+            Pending.Reset();
+            return err;
+        }
+        BodyReceived = 0;
     }
 
-    packet = Core::MakeShared<Packet, Core::Memory::PoolType::Kernel>(header, err);
-    if (packet.Get() == nullptr)
+    size_t inlineSize = Pending->GetInlineSize();
+    while (BodyReceived < Pending->GetDataSize())
     {
-        err = MakeError(Core::Error::NoMemory);
-        trace(0, "Connection 0x%p can't allocate packet err %d", this, err.GetCode());
-        packet.Reset();
-        return packet;
+        if (BodyReceived < inlineSize)
+        {
+            err = Sock->RecvNonBlock(Core::Memory::MemAdd(Pending->GetData(), BodyReceived),
+                inlineSize - BodyReceived, received);
+        }
+        else
+        {
+            auto& pages = Pending->GetPages();
+            size_t off = BodyReceived - inlineSize;
+            size_t index = off / pages->GetPageSize();
+            size_t pageOff = off % pages->GetPageSize();
+
+            void* va = pages->MapPage(index);
+            err = Sock->RecvNonBlock(Core::Memory::MemAdd(va, pageOff),
+                pages->GetPageSize() - pageOff, received);
+            pages->UnmapPage(index);
+        }
+        if (!err.Ok())
+            return err;
+
+        BodyReceived += received;
     }
 
-    if (!err.Ok())
+    unsigned char hash[Api::HashSize];
+    Pending->ComputeDataHash(hash);
+    if (!Core::Memory::ArrayEqual(Header.DataHash, hash))
     {
-        trace(0, "Connection 0x%p can't parse packet err %d", this, err.GetCode());
-        packet.Reset();
-        return packet;
+        err = MakeError(Core::Error::DataCorrupt);
+        trace(0, "Connection 0x%p packet body corrupt err %d", this, err.GetCode());
+        Pending.Reset();
+        return err;
     }
 
-    err = Sock->RecvAll(packet->GetData(), packet->GetDataSize(), received);
-    if (!err.Ok())
+    request = Core::Memory::Move(Pending);
+    HeaderReceived = 0;
+    BodyReceived = 0;
+    return MakeError(Core::Error::Success);
+}
+
+void Server::Connection::OnReady()
+{
+    //Bounded so one busy connection can't starve the others on this thread
+    for (size_t i = 0; i < ServerMaxReadyPackets; i++)
     {
-        trace(0, "Connection 0x%p can't read packet body err %d", this, err.GetCode());
-        packet.Reset();
-        return packet;
+        if (Failed.Get() != 0)
+            return;
+
+        //Resumed by CompleteRequest once a slot frees up
+        Throttled.Set(1);
+        if (Outstanding.Get() >= ServerMaxConnRequests)
+            return;
+        Throttled.Set(0);
+
+        Packet::Ptr request;
+        Core::Error err = RecvRequest(request);
+        if (err == Core::Error::Again)
+            return;
+
+        if (!err.Ok())
+        {
+            if (err != Core::Error::ConnReset)
+                trace(0, "Connection 0x%p recv packet err %d", this, err.GetCode());
+
+            Failed.Set(1);
+            return;
+        }
+
+        DispatchRequest(request);
     }
 
-    unsigned char hash[Api::HashSize];
-    Core::XXHash::Sum(packet->GetData(), packet->GetDataSize(), hash);
-    if (!Core::Memory::ArrayEqual(header.DataHash, hash))
+    Io.Queue(this);
+}
+
+void Server::Connection::DispatchRequest(Packet::Ptr& request)
+{
+    Outstanding.Inc();
+    RequestTask* task = AllocTask();
+    if (task != nullptr)
     {
-        err = MakeError(Core::Error::DataCorrupt);
-        trace(0, "Connection 0x%p packet body corrupt err %d", this, err.GetCode());
-        packet.Reset();
-        return packet;
+        task->Request = Core::Memory::Move(request);
+        if (Srv.Dispatch(task))
+            return;
+
+        request = Core::Memory::Move(task->Request);
     }
 
-    return packet;
+    auto err = HandleRequest(request);
+    CompleteRequest(err, task);
+}
+
+Server::Connection::RequestTask* Server::Connection::AllocTask()
+{
+    Core::AutoLock lock(CompleteLock);
+    if (Core::IsListEmpty(&FreeTasks))
+        return nullptr;
+
+    auto task = CONTAINING_RECORD(Core::RemoveHeadList(&FreeTasks), RequestTask, FreeLink);
+    Core::InitializeListHead(&task->FreeLink);
+    return task;
 }
 
 Core::Error Server::Connection::SendPacket(Packet::Ptr& packet)
 {
     packet->PrepareSend();
 
+    Core::AutoLock lock(SendLock);
     unsigned long sent;
     Core::Error err = Sock->SendAll(packet->GetBody(), packet->GetSize(), sent);
     if (!err.Ok())
@@ -255,56 +571,216 @@ Core::Error Server::Connection::SendPacket(Packet::Ptr& packet)
         return err;
     }
 
+    auto& pages = packet->GetPages();
+    if (pages.Get() != nullptr)
+    {
+        for (size_t i = 0; i < pages->GetPageCount(); i++)
+        {
+            unsigned long pageSent;
+            bool more = (i + 1) < pages->GetPageCount();
+            err = Sock->SendPageAll(pages->GetPagePtr(i), 0, pages->GetPageSize(), more, pageSent);
+            sent += pageSent;
+            if (!err.Ok())
+            {
+                trace(0, "Connection 0x%p can't send packet page %lu err %d", this, i, err.GetCode());
+                return err;
+            }
+        }
+    }
+
     trace(3, "Connection 0x%p sent packet size %lu", this, sent);
 
     return err;
 }
 
-Core::Error Server::Connection::Run(const Core::Threadable& thread)
+Server::Connection::RequestTask::RequestTask()
+    : Conn(nullptr)
+{
+    Core::InitializeListHead(&FreeLink);
+}
+
+Server::Connection::RequestTask::~RequestTask()
+{
+}
+
+void Server::Connection::RequestTask::Run(const Core::Threadable& thread)
+{
+    //Task keeps no reference, so the request can be recycled
+    Packet::Ptr request = Core::Memory::Move(Request);
+    auto err = Conn->HandleRequest(request);
+    //Task may be reused as soon as it is back on the free list
+    Conn->CompleteRequest(err, this);
+}
+
+void Server::Connection::RequestTask::Cancel()
+{
+    Packet::Ptr request = Core::Memory::Move(Request);
+    Conn->Pool.Free(request);
+    Conn->CompleteRequest(MakeError(Core::Error::Cancelled), this);
+}
+
+Core::Error Server::Connection::HandleRequest(Packet::Ptr& request)
 {
     Core::Error err;
 
-    trace(3, "Connection 0x%p thread", this);
+    trace(3, "Connection 0x%p handling request %llu", this, request->GetRequestId());
+    auto response = Pool.Alloc(0);
+    if (response.Get() == nullptr)
+    {
+        err = MakeError(Core::Error::NoMemory);
+        trace(0, "Connection 0x%p can't allocate response err %d", this, err.GetCode());
+        Pool.Free(request);
+        return err;
+    }
 
-    while (!thread.IsStopping())
+    err = Srv.HandleRequest(request, response, Stream);
+    if (!err.Ok())
     {
-        trace(3, "Connection 0x%p receiving request", this);
-        auto request = RecvPacket(err);
-        if (!err.Ok())
-        {
-            if (err != Core::Error::ConnReset)
-                trace(0, "Connection 0x%p recv packet err %d", this, err.GetCode());
+        trace(0, "Connection 0x%p handle packet err %d", this, err.GetCode());
+        Pool.Free(response);
+        Pool.Free(request);
+        return err;
+    }
+
+    response->SetRequestId(request->GetRequestId());
+
+    trace(3, "Connection 0x%p sending response %llu", this, request->GetRequestId());
+    err = SendPacket(response);
+    if (!err.Ok())
+        trace(0, "Connection 0x%p send packet err %d", this, err.GetCode());
+
+    Pool.Free(response);
+    Pool.Free(request);
+    return err;
+}
 
+void Server::Connection::CompleteRequest(const Core::Error& err, RequestTask* task)
+{
+    //Once Outstanding drops the connection may be freed, Stop waits for the lock
+    //release as the last access of the worker
+    Core::AutoLock lock(CompleteLock);
+    if (task != nullptr)
+        Core::InsertHeadList(&FreeTasks, &task->FreeLink);
+
+    if (!err.Ok())
+        Failed.Set(1);
+
+    Outstanding.DecAndTest();
+    if (Throttled.Get() != 0)
+    {
+        Throttled.Set(0);
+        Io.Queue(this);
+    }
+    RequestEvent.SetAll();
+}
+
+void Server::Connection::WaitRequests(int maxOutstanding)
+{
+    for (;;)
+    {
+        //Reset before the check so a completion in between wakes the wait
+        RequestEvent.Reset();
+        if (Outstanding.Get() <= maxOutstanding)
             break;
-        }
-        trace(3, "Connection 0x%p handling request", this);
-        auto response = Srv.HandleRequest(request, err);
-        if (!err.Ok())
+        RequestEvent.Wait(10);
+    }
+}
+
+Server::IoThread::IoThread(const Core::AString& name, Core::Error& err)
+    : Current(nullptr)
+    , Running(false)
+{
+    Core::InitializeListHead(&ReadyList);
+
+    if (!err.Ok())
+        return;
+
+    err = Thread.Start(name, this);
+    if (!err.Ok())
+        return;
+
+    Running = true;
+}
+
+Server::IoThread::~IoThread()
+{
+    if (!Running)
+        return;
+
+    Thread.Stop();
+    ReadyEvent.Set();
+    Thread.Wait();
+}
+
+void Server::IoThread::Queue(Connection* conn)
+{
+    bool wakeup = false;
+    {
+        Core::AutoLock lock(Lock);
+        if (!conn->Detached && !conn->Queued)
         {
-            trace(0, "Connection 0x%p handle packet err %d", this, err.GetCode());
-            break;
+            conn->Queued = true;
+            Core::InsertTailList(&ReadyList, &conn->ReadyLink);
+            wakeup = true;
         }
-        trace(3, "Connection 0x%p sending response", this);
-        err = SendPacket(response);
-        if (!err.Ok())
+    }
+
+    if (wakeup)
+        ReadyEvent.Set();
+}
+
+void Server::IoThread::Remove(Connection* conn)
+{
+    for (;;)
+    {
         {
-            trace(0, "Connection 0x%p send packet err %d", this, err.GetCode());
-            break;
+            Core::AutoLock lock(Lock);
+            conn->Detached = true;
+            if (conn->Queued)
+            {
+                conn->Queued = false;
+                Core::RemoveInitEntryList(&conn->ReadyLink);
+            }
+            if (Current != conn)
+                break;
         }
+        Core::Thread::Sleep(1);
     }
+}
 
-    trace(3, "Connection 0x%p thread closing socket", this);
+Core::Error Server::IoThread::Run(const Core::Threadable& thread)
+{
+    trace(3, "IoThread 0x%p running", this);
 
+    while (!thread.IsStopping())
     {
-        Core::AutoLock lock(StateLock);
-        if (Sock.Get() != nullptr)
+        ReadyEvent.Wait(10);
+        ReadyEvent.Reset();
+
+        while (!thread.IsStopping())
         {
-            Sock->Close();
-            Sock.Reset();
+            Connection* conn = nullptr;
+            {
+                Core::AutoLock lock(Lock);
+                if (Core::IsListEmpty(&ReadyList))
+                    break;
+
+                conn = CONTAINING_RECORD(Core::RemoveHeadList(&ReadyList), Connection, ReadyLink);
+                Core::InitializeListHead(&conn->ReadyLink);
+                conn->Queued = false;
+                Current = conn;
+            }
+
+            conn->OnReady();
+
+            {
+                Core::AutoLock lock(Lock);
+                Current = nullptr;
+            }
         }
     }
 
-    trace(3, "Connection 0x%p thread exiting", this);
+    trace(3, "IoThread 0x%p exiting", this);
 
     return MakeError(Core::Error::Success);
 }
@@ -351,7 +827,7 @@ Core::Error Server::Run(const Core::Threadable &thread)
 
         trace(3, "Server 0x%p accepted new connection", this);
 
-        auto conn = Core::MakeShared<Connection, Core::Memory::PoolType::Kernel>(*this, Core::Memory::Move(socket));
+        auto conn = Core::MakeShared<Connection, Core::Memory::PoolType::Kernel>(*this, Core::Memory::Move(socket), PickIoThread());
         if (conn.Get() == nullptr)
         {
             err = MakeError(Core::Error::NoMemory);
@@ -389,6 +865,93 @@ Core::Error Server::Run(const Core::Threadable &thread)
     return MakeError(Core::Error::Success);
 }
 
+Core::Error Server::StartWorkers()
+{
+    size_t count = Core::Memory::Min<size_t>(Core::Smp::GetOnlineCpuCount(), ServerMaxWorkers);
+    if (count == 0)
+        count = 1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        Core::Error err;
+        Core::AString name("kstor-wrk", err);
+        if (!err.Ok())
+            return err;
+
+        auto worker = Core::MakeShared<Core::Worker, Core::Memory::PoolType::Kernel>(name, err);
+        if (worker.Get() == nullptr)
+            return MakeError(Core::Error::NoMemory);
+
+        if (!err.Ok())
+            return err;
+
+        if (!Workers.PushBack(worker))
+            return MakeError(Core::Error::NoMemory);
+    }
+
+    trace(1, "Server 0x%p started %lu workers", this, Workers.GetSize());
+
+    return MakeError(Core::Error::Success);
+}
+
+void Server::StopWorkers()
+{
+    Workers.Clear();
+}
+
+bool Server::Dispatch(Core::WorkItem* item)
+{
+    size_t count = Workers.GetSize();
+    if (count == 0)
+        return false;
+
+    //Round robin, a racy index only skews the distribution
+    NextWorker.Inc();
+    unsigned int index = static_cast<unsigned int>(NextWorker.Get());
+    return Workers[index % count]->Execute(item);
+}
+
+Core::Error Server::StartIoThreads()
+{
+    size_t count = Core::Memory::Min<size_t>(Core::Smp::GetOnlineCpuCount(), ServerMaxIoThreads);
+    if (count == 0)
+        count = 1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        Core::Error err;
+        Core::AString name("kstor-io", err);
+        if (!err.Ok())
+            return err;
+
+        auto ioThread = Core::MakeShared<IoThread, Core::Memory::PoolType::Kernel>(name, err);
+        if (ioThread.Get() == nullptr)
+            return MakeError(Core::Error::NoMemory);
+
+        if (!err.Ok())
+            return err;
+
+        if (!IoThreads.PushBack(ioThread))
+            return MakeError(Core::Error::NoMemory);
+    }
+
+    trace(1, "Server 0x%p started %lu io threads", this, IoThreads.GetSize());
+
+    return MakeError(Core::Error::Success);
+}
+
+void Server::StopIoThreads()
+{
+    IoThreads.Clear();
+}
+
+Server::IoThread& Server::PickIoThread()
+{
+    NextIoThread.Inc();
+    unsigned int index = static_cast<unsigned int>(NextIoThread.Get());
+    return *IoThreads[index % IoThreads.GetSize()];
+}
+
 Core::Error Server::Start(const Core::AString& host, unsigned short port)
 {
     trace(3, "Server 0x%p starting", this);
@@ -398,14 +961,30 @@ Core::Error Server::Start(const Core::AString& host, unsigned short port)
     if (ListenSocket.Get() != nullptr || AcceptThread.Get() != nullptr)
         return MakeError(Core::Error::InvalidState);
 
+    Core::Error err = StartWorkers();
+    if (err.Ok())
+        err = StartIoThreads();
+    if (!err.Ok())
+    {
+        StopIoThreads();
+        StopWorkers();
+        return err;
+    }
+
     ListenSocket = Core::MakeUnique<Core::Socket, Core::Memory::PoolType::Kernel>();
     if (ListenSocket.Get() == nullptr)
+    {
+        StopIoThreads();
+        StopWorkers();
         return MakeError(Core::Error::NoMemory);
+    }
 
-    Core::Error err = ListenSocket->Listen(host, port, 65536);
+    err = ListenSocket->Listen(host, port, 65536);
     if (!err.Ok())
     {
         ListenSocket.Reset();
+        StopIoThreads();
+        StopWorkers();
         return err;
     }
 
@@ -413,18 +992,24 @@ Core::Error Server::Start(const Core::AString& host, unsigned short port)
     if (!err.Ok())
     {
         ListenSocket.Reset();
+        StopIoThreads();
+        StopWorkers();
         return err;
     }
 
     AcceptThread = Core::MakeUnique<Core::Thread, Core::Memory::PoolType::Kernel>(name, this, err);
     if (AcceptThread.Get() == nullptr) {
         ListenSocket.Reset();
+        StopIoThreads();
+        StopWorkers();
         return MakeError(Core::Error::NoMemory);
     }
 
     if (!err.Ok()) {
         AcceptThread.Reset();
         ListenSocket.Reset();
+        StopIoThreads();
+        StopWorkers();
         return err;
     }
 
@@ -478,6 +1063,10 @@ void Server::Stop()
             conn->Stop();
     }
 
+    //Connections wait for their requests, so workers go last
+    StopWorkers();
+    StopIoThreads();
+
     trace(3, "Server 0x%p stopped", this);
 }
 
@@ -530,8 +1119,9 @@ Core::Error Server::HandleChunkWrite(Packet::Ptr& request, Packet::Ptr& response
 {
     Core::Error err;
 
+    //Only the fields before Data are inline, the payload is in the pages
     Api::ChunkWriteRequest* req = static_cast<Api::ChunkWriteRequest*>(request->GetData());
-    if (request->GetDataSize() != sizeof(*req))
+    if (request->GetDataSize() != sizeof(*req) || request->GetPages().Get() == nullptr)
     {
         return response->Create(request->GetType(), Api::ResultUnexpectedDataSize, 0);
     }
@@ -540,7 +1130,8 @@ Core::Error Server::HandleChunkWrite(Packet::Ptr& request, Packet::Ptr& response
     if (!err.Ok())
         return err;
 
-    err = ControlDevice::Get()->ChunkWrite(req->ChunkId, req->Data);
+    err = ControlDevice::Get()->ChunkWrite(req->ChunkId, request->GetPages(),
+        Core::BitOps::Le32ToCpu(req->Durability));
     if (!err.Ok())
     {
         err.Reset();
@@ -550,7 +1141,7 @@ Core::Error Server::HandleChunkWrite(Packet::Ptr& request, Packet::Ptr& response
     return err;
 }
 
-Core::Error Server::HandleChunkRead(Packet::Ptr& request, Packet::Ptr& response)
+Core::Error Server::HandleChunkRead(Packet::Ptr& request, Packet::Ptr& response, ReadStream& stream)
 {
     Api::ChunkReadRequest* req = static_cast<Api::ChunkReadRequest*>(request->GetData());
     if (request->GetDataSize() != sizeof(*req))
@@ -558,20 +1149,16 @@ Core::Error Server::HandleChunkRead(Packet::Ptr& request, Packet::Ptr& response)
         return response->Create(request->GetType(), Api::ResultUnexpectedDataSize, 0);
     }
 
-    Api::ChunkReadResponse* resp = nullptr;
-    Core::Error err = response->Create(request->GetType(), Api::ResultSuccess, sizeof(*resp));
+    //Response data are the chunk pages, the socket references them
+    Core::PageVector<>::Ptr pages;
+    Core::Error err = ControlDevice::Get()->ChunkRead(req->ChunkId, pages, &stream);
     if (!err.Ok())
-        return err;
+        return response->Create(request->GetType(), Api::ResultNotFound, 0);
 
-    resp = static_cast<Api::ChunkReadResponse*>(response->GetData());
-    err = ControlDevice::Get()->ChunkRead(req->ChunkId, resp->Data);
-    if (!err.Ok())
-    {
-        err.Reset();
-        response->SetResult(Api::ResultNotFound);
-    }
+    if (pages->GetSize() != sizeof(Api::ChunkReadResponse))
+        return MakeError(Core::Error::UnexpectedEOF);
 
-    return err;
+    return response->CreateWithPages(request->GetType(), Api::ResultSuccess, pages);
 }
 
 Core::Error Server::HandleChunkDelete(Packet::Ptr& request, Packet::Ptr& response)
@@ -598,14 +1185,9 @@ Core::Error Server::HandleChunkDelete(Packet::Ptr& request, Packet::Ptr& respons
     return response->Create(request->GetType(), Api::ResultSuccess, 0);
 }
 
-Packet::Ptr Server::HandleRequest(Packet::Ptr& request, Core::Error& err)
+Core::Error Server::HandleRequest(Packet::Ptr& request, Packet::Ptr& response, ReadStream& stream)
 {
-    Packet::Ptr response(new Packet());
-    if (response.Get() == nullptr)
-    {
-        err = MakeError(Core::Error::NoMemory);
-        return response;
-    }
+    Core::Error err;
 
     switch (request->GetType())
     {
@@ -619,7 +1201,7 @@ Packet::Ptr Server::HandleRequest(Packet::Ptr& request, Core::Error& err)
         err = HandleChunkWrite(request, response);
         break;
     case Api::PacketTypeChunkRead:
-        err = HandleChunkRead(request, response);
+        err = HandleChunkRead(request, response, stream);
         break;
     case Api::PacketTypeChunkDelete:
         err = HandleChunkDelete(request, response);
@@ -629,7 +1211,7 @@ Packet::Ptr Server::HandleRequest(Packet::Ptr& request, Core::Error& err)
         break;
     }
 
-    return response;
+    return err;
 }
 
 }
\ No newline at end of file
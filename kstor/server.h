@@ -14,12 +14,31 @@
 #include <core/threadable.h>
 #include <core/list.h>
 #include <core/vector.h>
+#include <core/worker.h>
+#include <core/atomic.h>
+#include <core/event.h>
+#include <core/spinlock.h>
+#include <core/list_entry.h>
+#include <core/page_vector.h>
 
 #include "api.h"
+#include "readahead.h"
 
 namespace KStor 
 {
 
+const size_t ServerMaxWorkers = 32;
+const size_t ServerMaxIoThreads = 8;
+const int ServerMaxConnRequests = 64;
+const size_t ServerMaxReadyPackets = 16;
+
+const size_t PacketPoolClassCount = 3;
+const size_t PacketPoolSmallDataSize = 256;
+const size_t PacketPoolPageDataSize = 4096;
+const size_t PacketPoolMaxSmall = 2 * ServerMaxConnRequests;
+const size_t PacketPoolMaxPage = 16;
+const size_t PacketPoolMaxLarge = 4;
+
 class Packet
 {
 public:
@@ -29,25 +48,75 @@ public:
     Packet(const Api::PacketHeader &header, Core::Error &err);
     Core::Error Parse(const Api::PacketHeader &header);
     Core::Error Create(unsigned int type, unsigned int result, unsigned int dataSize);
+    //Data is sent straight from the pages, Body holds only the header
+    Core::Error CreateWithPages(unsigned int type, unsigned int result, const Core::PageVector<>::Ptr& pages);
 
     void PrepareSend();
 
     virtual ~Packet();
     unsigned int GetType() const;
     unsigned int GetResult() const;
+    unsigned long long GetRequestId() const;
     size_t GetDataSize() const;
     size_t GetSize() const;
     void* GetBody();
     void* GetData();
+    //Data is the inline part in Body followed by the pages, if any
+    size_t GetInlineSize() const;
+    const Core::PageVector<>::Ptr& GetPages() const;
+    void ComputeDataHash(unsigned char hash[Api::HashSize]);
 
     void SetResult(unsigned int result);
+    void SetRequestId(unsigned long long requestId);
+
+    //Drops the data but keeps the body buffer for reuse
+    void Reset();
+    bool ReserveBody(size_t size);
+    size_t GetBodyCapacity() const;
+
+    //Size of the data kept in Body, the rest is received into pages
+    static size_t GetInlineDataSize(unsigned int type, size_t dataSize);
 
 private:
+    Packet(const Packet& other) = delete;
+    Packet(Packet&& other) = delete;
+    Packet& operator=(const Packet& other) = delete;
+    Packet& operator=(Packet&& other) = delete;
+
     Api::PacketHeader *GetHeader();
+    bool ResizeBody(size_t size);
     unsigned int Type;
     unsigned int Result;
     unsigned int DataSize;
+    unsigned long long RequestId;
     Core::Vector<unsigned char> Body;
+    Core::PageVector<>::Ptr Pages;
+};
+
+//Recycles packets with their body buffers in size classes, so the
+//steady state request loop doesn't allocate them
+class PacketPool
+{
+public:
+    PacketPool();
+    virtual ~PacketPool();
+
+    Packet::Ptr Alloc(size_t dataSize);
+
+    //Packet is recycled only if this is the last reference
+    void Free(Packet::Ptr& packet);
+
+private:
+    PacketPool(const PacketPool& other) = delete;
+    PacketPool(PacketPool&& other) = delete;
+    PacketPool& operator=(const PacketPool& other) = delete;
+    PacketPool& operator=(PacketPool&& other) = delete;
+
+    static size_t GetClassBodySize(size_t index);
+    static size_t GetClassMaxCount(size_t index);
+
+    Core::SpinLock Lock;
+    Core::Vector<Packet::Ptr> FreeList[PacketPoolClassCount];
 };
 
 class Server : public Core::Runnable
@@ -58,43 +127,144 @@ public:
     Core::Error Start(const Core::AString &host, unsigned short port);
     void Stop();
 private:
-    class Connection : public Core::Runnable {
+    class IoThread;
+
+    class Connection {
+    friend IoThread;
     public:
         using Ptr = Core::SharedPtr<Connection>;
 
-        Connection(Server& srv, Core::UniquePtr<Core::Socket>&& sock);
+        Connection(Server& srv, Core::UniquePtr<Core::Socket>&& sock, IoThread& ioThread);
         Core::Error Start();
         void Stop();
         virtual ~Connection();
 
-        Packet::Ptr RecvPacket(Core::Error& err);
         Core::Error SendPacket(Packet::Ptr& packet);
 
         bool Closed();
 
     private:
-        Core::Error Run(const Core::Threadable& thread) override;
+        Connection(const Connection& other) = delete;
+        Connection(Connection&& other) = delete;
+        Connection& operator=(const Connection& other) = delete;
+        Connection& operator=(Connection&& other) = delete;
+
+        //Handles one request on a worker, responses may go out of order.
+        //Preallocated per connection, one for each outstanding request slot
+        class RequestTask : public Core::WorkItem {
+        friend Connection;
+        public:
+            RequestTask();
+            virtual ~RequestTask();
+
+        private:
+            RequestTask(const RequestTask& other) = delete;
+            RequestTask(RequestTask&& other) = delete;
+            RequestTask& operator=(const RequestTask& other) = delete;
+            RequestTask& operator=(RequestTask&& other) = delete;
+
+            void Run(const Core::Threadable& thread) override;
+            void Cancel() override;
+
+            Connection* Conn;
+            Packet::Ptr Request;
+            //Protected by the connection CompleteLock
+            Core::ListEntry FreeLink;
+        };
+
+        static void ReadyCallback(void* ctx);
+
+        //Runs on the I/O thread, reads whatever the socket has without blocking
+        void OnReady();
+        Core::Error RecvRequest(Packet::Ptr& request);
+        void DispatchRequest(Packet::Ptr& request);
+        Core::Error HandleRequest(Packet::Ptr& request);
+        RequestTask* AllocTask();
+        void CompleteRequest(const Core::Error& err, RequestTask* task);
+        void WaitRequests(int maxOutstanding);
+
         Server& Srv;
+        IoThread& Io;
         Core::UniquePtr<Core::Socket> Sock;
-        Core::UniquePtr<Core::Thread> ConnThread;
         Core::RWSem StateLock;
+        Core::RWSem SendLock;
+        ReadStream Stream;
+        PacketPool Pool;
+        Api::PacketHeader Header;
+        size_t HeaderReceived;
+        Packet::Ptr Pending;
+        size_t BodyReceived;
+        Core::Atomic Outstanding;
+        Core::Atomic Failed;
+        Core::Atomic Throttled;
+        Core::Event RequestEvent;
+        Core::SpinLock CompleteLock;
+        RequestTask Tasks[ServerMaxConnRequests];
+        Core::ListEntry FreeTasks;
+
+        //Protected by the I/O thread lock
+        Core::ListEntry ReadyLink;
+        bool Queued;
+        bool Detached;
     };
 
+    //Reads requests of many connections, woken up by socket callbacks
+    class IoThread : public Core::Runnable {
+    public:
+        using Ptr = Core::SharedPtr<IoThread>;
+
+        IoThread(const Core::AString& name, Core::Error& err);
+        virtual ~IoThread();
+
+        //May be called from softirq context
+        void Queue(Connection* conn);
+
+        //Connection won't be queued again, waits until it isn't processed
+        void Remove(Connection* conn);
+
+    private:
+        IoThread(const IoThread& other) = delete;
+        IoThread(IoThread&& other) = delete;
+        IoThread& operator=(const IoThread& other) = delete;
+        IoThread& operator=(IoThread&& other) = delete;
+
+        Core::Error Run(const Core::Threadable& thread) override;
+
+        Core::SpinLock Lock;
+        Core::ListEntry ReadyList;
+        Connection* Current;
+        Core::Event ReadyEvent;
+        Core::Thread Thread;
+        bool Running;
+    };
+
+    Core::Error StartIoThreads();
+    void StopIoThreads();
+    IoThread& PickIoThread();
+
+    Core::Error StartWorkers();
+    void StopWorkers();
+    bool Dispatch(Core::WorkItem* item);
+
     Core::Error Run(const Core::Threadable& thread) override;
     Core::RWSem ConnListLock;
     Core::RWSem StateLock;
     Core::UniquePtr<Core::Socket> ListenSocket;
     Core::UniquePtr<Core::Thread> AcceptThread;
     Core::LinkedList<Connection::Ptr> ConnList;
+    Core::Vector<Core::Worker::Ptr> Workers;
+    Core::Atomic NextWorker;
+    Core::Vector<IoThread::Ptr> IoThreads;
+    Core::Atomic NextIoThread;
 
     Core::Error HandleChunkCreate(Packet::Ptr& request, Packet::Ptr& response);
     Core::Error HandleChunkWrite(Packet::Ptr& request, Packet::Ptr& response);
-    Core::Error HandleChunkRead(Packet::Ptr& request, Packet::Ptr& response);
+    Core::Error HandleChunkRead(Packet::Ptr& request, Packet::Ptr& response, ReadStream& stream);
     Core::Error HandleChunkDelete(Packet::Ptr& request, Packet::Ptr& response);
 
     Core::Error HandlePing(Packet::Ptr& request, Packet::Ptr& response);
 
-    Packet::Ptr HandleRequest(Packet::Ptr& request, Core::Error& err);
+    Core::Error HandleRequest(Packet::Ptr& request, Packet::Ptr& response, ReadStream& stream);
 
 };
 
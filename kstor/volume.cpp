@@ -4,17 +4,24 @@
 #include <core/bitops.h>
 #include <core/hex.h>
 #include <core/xxhash.h>
+#include <core/random.h>
 
 namespace KStor
 {
 
-Volume::Volume(const Core::AString& deviceName, Core::Error& err)
+Volume::Volume(const Core::AString& deviceName, const Core::AString& journalDeviceName, Core::Error& err)
     : DeviceName(deviceName, err)
     , Device(DeviceName, err)
+    , Readahead(Device, Scheduler)
     , Size(0)
     , BlockSize(Api::PageSize)
+    , IndexStart(0)
+    , IndexSize(0)
+    , ExtentCount(0)
     , TxJournal(*this)
     , Balloc(*this)
+    , Index(*this)
+    , Flusher(*this)
     , State(VolumeStateNew)
 {
     if (!err.Ok())
@@ -22,6 +29,24 @@ Volume::Volume(const Core::AString& deviceName, Core::Error& err)
         return;
     }
 
+    if (journalDeviceName.GetLen() != 0)
+    {
+        JournalDevice = Core::MakeUnique<Core::BlockDevice, Core::Memory::PoolType::Kernel>(journalDeviceName, err);
+        if (JournalDevice.Get() == nullptr)
+        {
+            err = MakeError(Core::Error::NoMemory);
+            return;
+        }
+
+        if (!err.Ok())
+        {
+            return;
+        }
+
+        trace(1, "Volume 0x%p journal name %s size %llu",
+            this, journalDeviceName.GetConstBuf(), JournalDevice->GetSize());
+    }
+
     trace(1, "Volume 0x%p name %s size %llu ctor",
         this, deviceName.GetConstBuf(), Device.GetSize());
 }
@@ -45,10 +70,69 @@ Core::Error Volume::Format()
 
     Size = size;
 
-    Core::Error err = TxJournal.Format(1, (size / 10) / BlockSize);
+    auto err = CheckDeviceLimits(Device);
     if (!err.Ok())
         return err;
 
+    if (HasExternalJournal())
+    {
+        err = CheckDeviceLimits(*JournalDevice.Get());
+        if (!err.Ok())
+            return err;
+    }
+
+    uint64_t indexStart;
+    if (HasExternalJournal())
+    {
+        err = TxJournal.Format(0, JournalDevice->GetSize() / BlockSize);
+        if (!err.Ok())
+            return err;
+
+        indexStart = 1;
+    }
+    else
+    {
+        err = TxJournal.Format(1, (size / 10) / BlockSize);
+        if (!err.Ok())
+            return err;
+
+        indexStart = TxJournal.GetStart() + TxJournal.GetSize();
+    }
+
+    if (indexStart >= (size / BlockSize))
+        return MakeError(Core::Error::InvalidValue);
+
+    uint64_t extentBlocks = Api::ChunkSize / BlockSize;
+    uint64_t restBlocks = (size / BlockSize) - indexStart;
+    uint64_t extentCount = (restBlocks * Api::ChunkIndexEntriesPerPage) /
+                           (extentBlocks * Api::ChunkIndexEntriesPerPage + 1);
+    if (extentCount == 0)
+        return MakeError(Core::Error::InvalidValue);
+
+    uint64_t indexSize = (extentCount + Api::ChunkIndexEntriesPerPage - 1) / Api::ChunkIndexEntriesPerPage;
+
+    //Index is padded so that extents start on a physical block or stripe boundary
+    uint64_t alignBlocks = GetExtentAlignment() / BlockSize;
+    uint64_t padBlocks = (alignBlocks - (indexStart + indexSize) % alignBlocks) % alignBlocks;
+    if (padBlocks != 0)
+    {
+        indexSize += padBlocks;
+        if (indexSize >= restBlocks)
+            return MakeError(Core::Error::InvalidValue);
+
+        extentCount = Core::Memory::Min<uint64_t>(extentCount, (restBlocks - indexSize) / extentBlocks);
+        if (extentCount == 0)
+            return MakeError(Core::Error::InvalidValue);
+    }
+
+    err = Index.Format(indexStart, indexSize);
+    if (!err.Ok())
+        return err;
+
+    IndexStart = indexStart;
+    IndexSize = indexSize;
+    ExtentCount = extentCount;
+
     auto page = Core::Page<>::Create(err);
     if (!err.Ok())
         return err;
@@ -61,12 +145,17 @@ Core::Error Volume::Format()
     header->VolumeId = VolumeId.GetContent();
     header->Size = Core::BitOps::CpuToLe64(size);
     header->JournalSize = Core::BitOps::CpuToLe64(TxJournal.GetSize());
+    header->IndexSize = Core::BitOps::CpuToLe64(IndexSize);
+    header->ExtentCount = Core::BitOps::CpuToLe64(ExtentCount);
+    header->JournalId = TxJournal.GetJournalId().GetContent();
+    header->JournalFlags = Core::BitOps::CpuToLe64((HasExternalJournal()) ? Api::VolumeJournalFlagExternal : 0);
 
     Core::XXHash::Sum(header, OFFSET_OF(Api::VolumeHeader, Hash), header->Hash);
 
     err = Core::BioList<>(Device).SubmitWaitResult(page, 0, true, true);
 
-    trace(1, "Volume 0x%p write header, err %d", this, err.GetCode());
+    trace(1, "Volume 0x%p write header, indexSize %llu extentCount %llu align %llu err %d",
+        this, IndexSize, ExtentCount, alignBlocks * BlockSize, err.GetCode());
 
     return err;
 }
@@ -77,7 +166,17 @@ Core::Error Volume::Load()
     if (State != VolumeStateNew)
         return MakeError(Core::Error::InvalidState);
 
-    Core::Error err;
+    auto err = CheckDeviceLimits(Device);
+    if (!err.Ok())
+        return err;
+
+    if (HasExternalJournal())
+    {
+        err = CheckDeviceLimits(*JournalDevice.Get());
+        if (!err.Ok())
+            return err;
+    }
+
     auto page = Core::Page<>::Create(err);
     if (!err.Ok())
         return err;
@@ -121,7 +220,27 @@ Core::Error Volume::Load()
     Size = size;
 
     uint64_t journalSize = Core::BitOps::Le64ToCpu(header->JournalSize);
-    err = TxJournal.Load(1);
+    uint64_t indexSize = Core::BitOps::Le64ToCpu(header->IndexSize);
+    uint64_t extentCount = Core::BitOps::Le64ToCpu(header->ExtentCount);
+    uint64_t journalFlags = Core::BitOps::Le64ToCpu(header->JournalFlags);
+    bool external = (journalFlags & Api::VolumeJournalFlagExternal) != 0;
+    if (external != HasExternalJournal())
+    {
+        trace(0, "Volume 0x%p journal flags 0x%llx mismatch", this, journalFlags);
+        return MakeError(Core::Error::InvalidValue);
+    }
+
+    uint64_t journalStart = (external) ? 0 : 1;
+    uint64_t indexStart = (external) ? 1 : 1 + journalSize;
+
+    if (extentCount == 0 ||
+        (indexStart + indexSize) * BlockSize + extentCount * Api::ChunkSize > size)
+    {
+        trace(0, "Volume 0x%p bad layout, indexSize %llu extentCount %llu", this, indexSize, extentCount);
+        return MakeError(Core::Error::BadSize);
+    }
+
+    err = TxJournal.Load(journalStart, Guid(header->JournalId));
     if (!err.Ok())
     {
         trace(0, "Volume 0x%p can't load journal, err %d", this, err.GetCode());
@@ -136,6 +255,25 @@ Core::Error Volume::Load()
     }
 
     VolumeId.SetContent(header->VolumeId);
+    IndexStart = indexStart;
+    IndexSize = indexSize;
+    ExtentCount = extentCount;
+
+    err = LoadChunks();
+    if (!err.Ok())
+    {
+        trace(0, "Volume 0x%p can't load chunks, err %d", this, err.GetCode());
+        TxJournal.Unload();
+        return err;
+    }
+
+    err = StartFlushThread();
+    if (!err.Ok())
+    {
+        trace(0, "Volume 0x%p can't start flush thread, err %d", this, err.GetCode());
+        TxJournal.Unload();
+        return err;
+    }
 
     State = VolumeStateRunning;
     trace(1, "Volume 0x%p load volumeId %s size %llu blockSize %llu",
@@ -155,7 +293,15 @@ Core::Error Volume::Unload()
         return MakeError(Core::Error::InvalidState);
 
     State = VolumeStateStopping;
-    auto err = TxJournal.Unload();
+    StopFlushThread();
+
+    auto err = FlushBuffered();
+    if (!err.Ok())
+        trace(0, "Volume 0x%p flush buffered chunks, err %d", this, err.GetCode());
+
+    Readahead.Clear();
+
+    err = TxJournal.Unload();
     if (!err.Ok())
         return err;
 
@@ -171,11 +317,18 @@ Core::Error Volume::Unload()
     header->VolumeId = VolumeId.GetContent();
     header->Size = Core::BitOps::CpuToLe64(Size);
     header->JournalSize = Core::BitOps::CpuToLe64(TxJournal.GetSize());
+    header->IndexSize = Core::BitOps::CpuToLe64(IndexSize);
+    header->ExtentCount = Core::BitOps::CpuToLe64(ExtentCount);
+    header->JournalId = TxJournal.GetJournalId().GetContent();
+    header->JournalFlags = Core::BitOps::CpuToLe64((HasExternalJournal()) ? Api::VolumeJournalFlagExternal : 0);
 
     Core::XXHash::Sum(header, OFFSET_OF(Api::VolumeHeader, Hash), header->Hash);
 
     err = Core::BioList<>(Device).SubmitWaitResult(page, 0, true, true);
 
+    Index.Unload();
+    Balloc.Unload();
+
     State = VolumeStateStopped;
 
     trace(1, "Volume 0x%p unload, err %d", this, err.GetCode());
@@ -208,6 +361,226 @@ Core::BlockDevice& Volume::GetDevice()
     return Device;
 }
 
+Core::BlockDevice& Volume::GetJournalDevice()
+{
+    return (JournalDevice.Get() != nullptr) ? *JournalDevice.Get() : Device;
+}
+
+IoScheduler& Volume::GetIoScheduler()
+{
+    return Scheduler;
+}
+
+bool Volume::HasExternalJournal() const
+{
+    return JournalDevice.Get() != nullptr;
+}
+
+Core::Error Volume::LoadChunks()
+{
+    auto err = Balloc.Load(ExtentCount);
+    if (!err.Ok())
+        return err;
+
+    Core::LinkedList<Chunk::Ptr> chunkList;
+    err = Index.Load(IndexStart, IndexSize, ExtentCount, chunkList);
+    if (!err.Ok())
+        return err;
+
+    while (!chunkList.IsEmpty())
+    {
+        auto chunk = chunkList.Head();
+        chunkList.PopHead();
+
+        err = Balloc.MarkUsed(chunk->Extent);
+        if (!err.Ok())
+        {
+            trace(0, "Volume 0x%p chunk %s extent %llu is used, err %d",
+                this, chunk->ChunkId.ToString().GetConstBuf(), chunk->Extent, err.GetCode());
+            return MakeError(Core::Error::DataCorrupt);
+        }
+
+        if (!ChunkTable.Insert(chunk->ChunkId, chunk))
+        {
+            trace(0, "Volume 0x%p chunk %s duplicate", this, chunk->ChunkId.ToString().GetConstBuf());
+            return MakeError(Core::Error::DataCorrupt);
+        }
+    }
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error Volume::CheckDeviceLimits(Core::BlockDevice& device)
+{
+    //Metadata and journal blocks are BlockSize sized, so the device must be able to address them
+    if (device.GetLogicalBlockSize() > BlockSize || BlockSize % device.GetLogicalBlockSize())
+    {
+        trace(0, "Volume 0x%p device logical block size %u isn't supported",
+            this, device.GetLogicalBlockSize());
+        return MakeError(Core::Error::InvalidValue);
+    }
+
+    if (device.GetPhysicalBlockSize() > BlockSize)
+    {
+        trace(0, "Volume 0x%p device physical block size %u exceeds block size %llu, writes will be read-modify-write",
+            this, device.GetPhysicalBlockSize(), BlockSize);
+    }
+
+    if (device.GetAtomicWriteSize() >= BlockSize)
+    {
+        trace(1, "Volume 0x%p device writes %u bytes atomically", this, device.GetAtomicWriteSize());
+    }
+
+    return MakeError(Core::Error::Success);
+}
+
+uint64_t Volume::GetExtentAlignment()
+{
+    uint64_t alignment = Core::Memory::Max<uint64_t>(BlockSize, Device.GetPhysicalBlockSize());
+
+    //Optimal I/O size is the stripe width on RAID, only used if it is a sane multiple
+    uint64_t optimal = Device.GetOptimalIoSize();
+    if (optimal > alignment && optimal <= VolumeMaxExtentAlignment && (optimal % alignment) == 0)
+        alignment = optimal;
+
+    if (alignment > VolumeMaxExtentAlignment || (alignment % BlockSize) != 0)
+        alignment = BlockSize;
+
+    return alignment;
+}
+
+Core::Error Volume::ExtentToPosition(uint64_t extent, uint64_t& position)
+{
+    if (extent >= ExtentCount)
+        return MakeError(Core::Error::Overflow);
+
+    position = (IndexStart + IndexSize) * BlockSize + extent * Api::ChunkSize;
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error Volume::WriteExtent(uint64_t extent, const Core::PageVector<>::Ptr& pages, unsigned int ioClass)
+{
+    if (pages->GetSize() != Api::ChunkSize)
+        return MakeError(Core::Error::InvalidValue);
+
+    uint64_t position;
+    auto err = ExtentToPosition(extent, position);
+    if (!err.Ok())
+        return err;
+
+    Core::BioList<> bioList(Device);
+    err = bioList.AddIo(pages, position, true);
+    if (!err.Ok())
+        return err;
+
+    //Extent may have been read ahead while free, drop it again after the
+    //write in case a prefetch raced with it
+    //Index commit flushes only the journal device, with a separate one the
+    //extent has to be durable on its own before it is referenced
+    Readahead.Invalidate(extent);
+    err = Scheduler.SubmitWait(bioList, ioClass, HasExternalJournal());
+    Readahead.Invalidate(extent);
+    return err;
+}
+
+Core::Error Volume::ReadExtent(uint64_t extent, Core::PageVector<>::Ptr& pages)
+{
+    uint64_t position;
+    auto err = ExtentToPosition(extent, position);
+    if (!err.Ok())
+        return err;
+
+    auto extentPages = Core::PageVector<>::Create(Api::ChunkSize / Api::PageSize, err);
+    if (!err.Ok())
+        return err;
+
+    Core::BioList<> bioList(Device);
+    err = bioList.AddIo(extentPages, position, false);
+    if (!err.Ok())
+        return err;
+
+    err = Scheduler.SubmitWait(bioList, IoClassRead);
+    if (!err.Ok())
+        return err;
+
+    pages = extentPages;
+    return MakeError(Core::Error::Success);
+}
+
+void Volume::ReadAhead(ReadStream& stream, uint64_t extent)
+{
+    uint64_t start, end;
+    if (!stream.Next(extent, start, end))
+        return;
+
+    for (uint64_t next = start; next < end; next++)
+    {
+        uint64_t position;
+        auto err = ExtentToPosition(next, position);
+        if (!err.Ok())
+            break;
+
+        err = Readahead.Prefetch(next, position);
+        if (err.GetCode() == Core::Error::Again)
+        {
+            trace(3, "Volume 0x%p readahead extent %llu throttled", this, next);
+            break;
+        }
+
+        if (!err.Ok())
+        {
+            trace(0, "Volume 0x%p readahead extent %llu, err %d", this, next, err.GetCode());
+            break;
+        }
+    }
+}
+
+Core::Error Volume::CommitIndex(const Guid& chunkId, uint64_t extent, unsigned int flags,
+    uint64_t oldExtent, unsigned int oldFlags, unsigned int durability)
+{
+    Transaction::Ptr tx;
+    Core::Error err;
+
+    {
+        //Each index update journals a new version of the page by reference,
+        //so txs must be queued in the same order as the versions were made
+        Core::AutoLock lock(IndexLock);
+
+        tx = TxJournal.BeginTx();
+        if (tx.Get() == nullptr)
+            return MakeError(Core::Error::NoMemory);
+
+        if (extent != VolumeInvalidExtent)
+            err = Index.Set(tx, extent, chunkId, flags);
+
+        if (err.Ok() && oldExtent != VolumeInvalidExtent)
+            err = Index.Clear(tx, oldExtent);
+
+        if (err.Ok())
+            err = tx->StartCommit();
+
+        if (!err.Ok())
+            tx->Cancel();
+    }
+
+    if (err.Ok())
+        err = (durability == Api::WriteDurabilityJournaled) ? tx->WaitJournaled() : tx->WaitCommit();
+
+    if (!err.Ok())
+    {
+        trace(0, "Chunk %s index commit err %d", chunkId.ToString().GetConstBuf(), err.GetCode());
+
+        Core::AutoLock lock(IndexLock);
+        if (extent != VolumeInvalidExtent)
+            Index.Clear(Transaction::Ptr(), extent);
+        if (oldExtent != VolumeInvalidExtent)
+            Index.Set(Transaction::Ptr(), oldExtent, chunkId, oldFlags);
+    }
+
+    TxJournal.EndTx(tx);
+    return err;
+}
+
 Core::Error Volume::ChunkCreate(const Guid& chunkId)
 {
     Core::SharedAutoLock lock(Lock);
@@ -223,23 +596,50 @@ Core::Error Volume::ChunkCreate(const Guid& chunkId)
         return MakeError(Core::Error::AlreadyExists);
     }
 
-    chunk = Core::MakeShared<Chunk, Core::Memory::PoolType::Kernel>(chunkId);
+    uint64_t extent;
+    auto err = Balloc.Alloc(extent);
+    if (!err.Ok())
+        return err;
+
+    chunk = Core::MakeShared<Chunk, Core::Memory::PoolType::Kernel>(chunkId, extent, 0);
     if (chunk.Get() == nullptr)
+    {
+        Balloc.Free(extent);
         return MakeError(Core::Error::NoMemory);
+    }
 
+    Core::AutoLock chunkLock(chunk->Lock);
     if (!ChunkTable.Insert(chunk->ChunkId, chunk))
-        return MakeError(Core::Error::NoMemory);
+    {
+        Balloc.Free(extent);
+        return MakeError(Core::Error::AlreadyExists);
+    }
+
+    err = CommitIndex(chunkId, extent, 0, VolumeInvalidExtent, 0);
+    if (!err.Ok())
+    {
+        chunk->Deleted = true;
+        ChunkTable.Delete(chunkId);
+        Balloc.Free(extent);
+        return err;
+    }
 
     return MakeError(Core::Error::Success);
 }
 
-Core::Error Volume::ChunkWrite(const Guid& chunkId, unsigned char data[Api::ChunkSize])
+Core::Error Volume::ChunkWrite(const Guid& chunkId, const Core::PageVector<>::Ptr& pages, unsigned int durability)
 {
     Core::SharedAutoLock lock(Lock);
     if (State != VolumeStateRunning)
         return MakeError(Core::Error::InvalidState);
 
-    trace(1, "Chunk %s write", chunkId.ToString().GetConstBuf());
+    trace(1, "Chunk %s write durability %u", chunkId.ToString().GetConstBuf(), durability);
+
+    if (durability == Api::WriteDurabilityDefault)
+        durability = Api::WriteDurabilityApplied;
+
+    if (durability > Api::WriteDurabilityApplied)
+        return MakeError(Core::Error::InvalidValue);
 
     bool exist;
     auto chunk = ChunkTable.Lookup(chunkId, exist);
@@ -248,15 +648,49 @@ Core::Error Volume::ChunkWrite(const Guid& chunkId, unsigned char data[Api::Chun
         return MakeError(Core::Error::NotFound);
     }
 
-    Core::Memory::MemCpy(chunk->Data, data, sizeof(chunk->Data));
+    Core::AutoLock chunkLock(chunk->Lock);
+    if (chunk->Deleted)
+        return MakeError(Core::Error::NotFound);
+
+    Core::Error err;
+    if (durability == Api::WriteDurabilityBuffered)
+    {
+        err = BufferWrite(chunk, pages);
+        if (err.GetCode() != Core::Error::Overflow)
+            return err;
+
+        //Too many chunks are buffered already, write through
+        durability = Api::WriteDurabilityJournaled;
+    }
+
+    uint64_t extent;
+    err = Balloc.Alloc(extent);
+    if (!err.Ok())
+        return err;
+
+    //Data goes straight to the new extent and only index update is journaled,
+    //the old extent is released after the index commit
+    err = WriteExtent(extent, pages, IoClassCommit);
+    if (err.Ok())
+        err = CommitIndex(chunkId, extent, Api::ChunkIndexFlagData, chunk->Extent, chunk->Flags, durability);
+
+    if (!err.Ok())
+    {
+        Balloc.Free(extent);
+        return err;
+    }
+
+    DropBuffered(chunk);
+    Balloc.Free(chunk->Extent);
+    chunk->Extent = extent;
+    chunk->Flags = Api::ChunkIndexFlagUsed | Api::ChunkIndexFlagData;
 
-    trace(3, "Chunk %s write %s size %lu", chunkId.ToString().GetConstBuf(),
-        Core::Hex::Encode(chunk->Data, 10).GetConstBuf(), sizeof(chunk->Data));
+    trace(3, "Chunk %s write extent %llu", chunkId.ToString().GetConstBuf(), extent);
 
     return MakeError(Core::Error::Success);
 }
 
-Core::Error Volume::ChunkRead(const Guid& chunkId, unsigned char data[Api::ChunkSize])
+Core::Error Volume::ChunkRead(const Guid& chunkId, Core::PageVector<>::Ptr& pages, ReadStream* stream)
 {
     Core::SharedAutoLock lock(Lock);
     if (State != VolumeStateRunning)
@@ -271,10 +705,38 @@ Core::Error Volume::ChunkRead(const Guid& chunkId, unsigned char data[Api::Chunk
         return MakeError(Core::Error::NotFound);
     }
 
-    Core::Memory::MemCpy(data, chunk->Data, sizeof(chunk->Data));
+    Core::SharedAutoLock chunkLock(chunk->Lock);
+    if (chunk->Deleted)
+        return MakeError(Core::Error::NotFound);
+
+    Core::Error err;
+    if (chunk->Buffered)
+    {
+        pages = chunk->BufferedPages;
+        return MakeError(Core::Error::Success);
+    }
+
+    if (!(chunk->Flags & Api::ChunkIndexFlagData))
+    {
+        auto chunkPages = Core::PageVector<>::Create(Api::ChunkSize / Api::PageSize, err);
+        if (!err.Ok())
+            return err;
+
+        chunkPages->Zero();
+        pages = chunkPages;
+        return MakeError(Core::Error::Success);
+    }
+
+    //A failed prefetch is retried synchronously
+    if (!Readahead.Read(chunk->Extent, pages, err) || !err.Ok())
+        err = ReadExtent(chunk->Extent, pages);
+    if (!err.Ok())
+        return err;
+
+    if (stream != nullptr)
+        ReadAhead(*stream, chunk->Extent);
 
-    trace(3, "Chunk %s read %s size %lu", chunkId.ToString().GetConstBuf(),
-        Core::Hex::Encode(data, 10).GetConstBuf(), sizeof(chunk->Data));
+    trace(3, "Chunk %s read extent %llu", chunkId.ToString().GetConstBuf(), chunk->Extent);
 
     return MakeError(Core::Error::Success);
 }
@@ -287,10 +749,269 @@ Core::Error Volume::ChunkDelete(const Guid& chunkId)
 
     trace(1, "Chunk %s delete", chunkId.ToString().GetConstBuf());
 
-    if (ChunkTable.Delete(chunkId))
+    bool exist;
+    auto chunk = ChunkTable.Lookup(chunkId, exist);
+    if (!exist)
+        return MakeError(Core::Error::NotFound);
+
+    Core::AutoLock chunkLock(chunk->Lock);
+    if (chunk->Deleted)
+        return MakeError(Core::Error::NotFound);
+
+    auto err = CommitIndex(chunkId, VolumeInvalidExtent, 0, chunk->Extent, chunk->Flags);
+    if (!err.Ok())
+        return err;
+
+    DropBuffered(chunk);
+    chunk->Deleted = true;
+    ChunkTable.Delete(chunkId);
+    Balloc.Free(chunk->Extent);
+    chunk->Extent = VolumeInvalidExtent;
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error Volume::BufferWrite(const Chunk::Ptr& chunk, const Core::PageVector<>::Ptr& pages)
+{
+    if (pages->GetSize() != Api::ChunkSize)
+        return MakeError(Core::Error::InvalidValue);
+
+    {
+        Core::AutoLock lock(BufferedLock);
+        if (!chunk->BufferedQueued)
+        {
+            if (BufferedList.Count() >= VolumeMaxBufferedChunks)
+            {
+                FlushEvent.SetAll();
+                return MakeError(Core::Error::Overflow);
+            }
+
+            if (!BufferedList.AddTail(chunk))
+                return MakeError(Core::Error::NoMemory);
+
+            chunk->BufferedQueued = true;
+        }
+    }
+
+    chunk->Buffered = true;
+    chunk->BufferedPages = pages;
+
+    trace(3, "Chunk %s buffered", chunk->ChunkId.ToString().GetConstBuf());
+
+    return MakeError(Core::Error::Success);
+}
+
+void Volume::DropBuffered(const Chunk::Ptr& chunk)
+{
+    chunk->Buffered = false;
+    chunk->BufferedPages.Reset();
+
+    //Chunk taken by a running flush stays queued until the flusher pops it
+    Core::AutoLock lock(BufferedLock);
+    if (!chunk->BufferedQueued)
+        return;
+
+    auto it = BufferedList.GetIterator();
+    for (;it.IsValid(); it.Next())
+    {
+        if (it.Get().Get() == chunk.Get())
+        {
+            it.Erase();
+            chunk->BufferedQueued = false;
+            break;
+        }
+    }
+}
+
+void Volume::RequeueBuffered(const Chunk::Ptr& chunk)
+{
+    Core::AutoLock lock(BufferedLock);
+    if (chunk->BufferedQueued)
+        return;
+
+    if (!BufferedList.AddTail(chunk))
+    {
+        trace(0, "Chunk %s can't requeue buffered data", chunk->ChunkId.ToString().GetConstBuf());
+        return;
+    }
+    chunk->BufferedQueued = true;
+}
+
+Core::Error Volume::FlushBuffered()
+{
+    Core::LinkedList<Chunk::Ptr> chunkList;
+    {
+        Core::AutoLock lock(BufferedLock);
+        chunkList = Core::Memory::Move(BufferedList);
+    }
+
+    if (chunkList.IsEmpty())
         return MakeError(Core::Error::Success);
 
-    return MakeError(Core::Error::NotFound);
+    //Chunks stay locked until the group tx is journaled
+    Core::LinkedList<VolumeFlushEntry> entryList;
+    Core::Error err;
+    while (!chunkList.IsEmpty())
+    {
+        auto chunk = chunkList.Head();
+        chunkList.PopHead();
+
+        {
+            Core::AutoLock lock(BufferedLock);
+            chunk->BufferedQueued = false;
+        }
+
+        chunk->Lock.Acquire();
+        if (chunk->Deleted || !chunk->Buffered)
+        {
+            chunk->Lock.Release();
+            continue;
+        }
+
+        uint64_t extent;
+        err = Balloc.Alloc(extent);
+        if (err.Ok())
+        {
+            //Buffered data is written back in the background class
+            err = WriteExtent(extent, chunk->BufferedPages, IoClassBackground);
+            if (err.Ok() && !entryList.AddTail(VolumeFlushEntry(chunk, extent)))
+                err = MakeError(Core::Error::NoMemory);
+            if (!err.Ok())
+                Balloc.Free(extent);
+        }
+
+        if (!err.Ok())
+        {
+            trace(0, "Chunk %s flush err %d", chunk->ChunkId.ToString().GetConstBuf(), err.GetCode());
+            chunk->Lock.Release();
+            RequeueBuffered(chunk);
+        }
+    }
+
+    if (entryList.IsEmpty())
+        return err;
+
+    Transaction::Ptr tx;
+    err = MakeError(Core::Error::Success);
+    {
+        Core::AutoLock lock(IndexLock);
+
+        tx = TxJournal.BeginTx();
+        if (tx.Get() == nullptr)
+            err = MakeError(Core::Error::NoMemory);
+
+        auto it = entryList.GetIterator();
+        for (;it.IsValid() && err.Ok(); it.Next())
+        {
+            auto& entry = it.Get();
+            err = Index.Set(tx, entry.Extent, entry.ChunkRef->ChunkId, Api::ChunkIndexFlagData);
+            if (err.Ok())
+                err = Index.Clear(tx, entry.ChunkRef->Extent);
+        }
+
+        if (err.Ok())
+            err = tx->StartCommit();
+
+        if (!err.Ok() && tx.Get() != nullptr)
+            tx->Cancel();
+    }
+
+    if (err.Ok())
+        err = tx->WaitJournaled();
+
+    TxJournal.EndTx(tx);
+
+    trace(1, "Volume 0x%p flush %lu buffered chunks, err %d", this, entryList.Count(), err.GetCode());
+
+    while (!entryList.IsEmpty())
+    {
+        auto entry = entryList.Head();
+        entryList.PopHead();
+        auto& chunk = entry.ChunkRef;
+
+        if (err.Ok())
+        {
+            Balloc.Free(chunk->Extent);
+            chunk->Extent = entry.Extent;
+            chunk->Flags = Api::ChunkIndexFlagUsed | Api::ChunkIndexFlagData;
+            DropBuffered(chunk);
+        }
+        else
+        {
+            {
+                Core::AutoLock lock(IndexLock);
+                Index.Clear(Transaction::Ptr(), entry.Extent);
+                Index.Set(Transaction::Ptr(), chunk->Extent, chunk->ChunkId, chunk->Flags);
+            }
+            Balloc.Free(entry.Extent);
+            RequeueBuffered(chunk);
+        }
+        chunk->Lock.Release();
+    }
+
+    return err;
+}
+
+Core::Error Volume::StartFlushThread()
+{
+    Core::Error err;
+    Core::AString name("kstor-flush", err);
+    if (!err.Ok())
+        return err;
+
+    FlushThread = Core::MakeUnique<Core::Thread, Core::Memory::PoolType::Kernel>(name, &Flusher, err);
+    if (FlushThread.Get() == nullptr)
+        return MakeError(Core::Error::NoMemory);
+
+    if (!err.Ok())
+    {
+        FlushThread.Reset();
+        return err;
+    }
+
+    return MakeError(Core::Error::Success);
+}
+
+void Volume::StopFlushThread()
+{
+    if (FlushThread.Get() != nullptr)
+    {
+        FlushThread->StopAndWait();
+        FlushThread.Reset();
+    }
+}
+
+Core::Error Volume::RunFlush(const Core::Threadable& thread)
+{
+    trace(1, "Volume 0x%p flush thread start", this);
+
+    while (!thread.IsStopping())
+    {
+        FlushEvent.Wait(VolumeFlushIntervalMs);
+        //Reset before flushing so an overflow signalled meanwhile flushes again
+        FlushEvent.Reset();
+
+        auto err = FlushBuffered();
+        if (!err.Ok())
+            trace(0, "Volume 0x%p flush err %d", this, err.GetCode());
+    }
+
+    trace(1, "Volume 0x%p flush thread stop", this);
+    return MakeError(Core::Error::Success);
+}
+
+VolumeFlusher::VolumeFlusher(Volume& volume)
+    : VolumeRef(volume)
+{
+}
+
+VolumeFlusher::~VolumeFlusher()
+{
+}
+
+Core::Error VolumeFlusher::Run(const Core::Threadable& thread)
+{
+    return VolumeRef.RunFlush(thread);
 }
 
 Core::Error Volume::ChunkLookup(const Guid& chunkId)
@@ -322,29 +1043,293 @@ Core::Error Volume::TestJournal()
 
     trace(1, "Test journal, tx created %s", tx->GetTxId().ToString().GetConstBuf());
 
-    unsigned long long position = (TxJournal.GetStart() + TxJournal.GetSize()) * GetBlockSize();
+    uint64_t extent;
+    auto err = Balloc.Alloc(extent);
+    if (!err.Ok())
+    {
+        tx->Cancel();
+        return err;
+    }
 
-    Core::Error err;
-    auto page = Core::Page<>::Create(err);
+    uint64_t position;
+    err = ExtentToPosition(extent, position);
     if (!err.Ok())
+    {
+        tx->Cancel();
+        Balloc.Free(extent);
         return err;
+    }
 
     for (int i = 0; i < 2; i++)
     {
+        auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
+        if (!err.Ok())
+            break;
+
         page->FillRandom();
 
-        err = tx->Write(*page.Get(), position);
+        err = tx->Write(page, position);
         if (!err.Ok())
-            return err;
+            break;
 
         position+= page->GetSize();
     }
 
-    err = tx->Commit();
+    if (err.Ok())
+        err = tx->Commit();
+    else
+        tx->Cancel();
+
+    TxJournal.EndTx(tx);
+    Balloc.Free(extent);
 
     trace(1, "Test journal, err %d", err.GetCode());
 
     return err;
 }
 
+Core::Error Volume::TestCompareChunk(const Guid& chunkId, const Core::PageVector<>::Ptr& expected)
+{
+    Core::PageVector<>::Ptr pages;
+    auto err = ChunkRead(chunkId, pages);
+    if (!err.Ok())
+        return err;
+
+    if (pages->GetPageCount() != expected->GetPageCount())
+        return MakeError(Core::Error::DataCorrupt);
+
+    for (size_t i = 0; i < pages->GetPageCount(); i++)
+    {
+        void* va = pages->MapPage(i);
+        void* vaExpected = expected->MapPage(i);
+        int rc = Core::Memory::MemCmp(va, vaExpected, Api::PageSize);
+        expected->UnmapPage(i);
+        pages->UnmapPage(i);
+        if (rc != 0)
+            return MakeError(Core::Error::DataCorrupt);
+    }
+
+    return MakeError(Core::Error::Success);
+}
+
+Core::Error Volume::TestBufferedWrite()
+{
+    trace(1, "Test buffered write");
+
+    Core::Error err;
+    Core::PageVector<>::Ptr pages[3];
+    for (size_t i = 0; i < 3 && err.Ok(); i++)
+    {
+        pages[i] = Core::PageVector<>::Create(Api::ChunkSize / Api::PageSize, err);
+        for (size_t j = 0; err.Ok() && j < pages[i]->GetPageCount(); j++)
+        {
+            void* va = pages[i]->MapPage(j);
+            Core::Random::GetBytes(va, Api::PageSize);
+            pages[i]->UnmapPage(j);
+        }
+    }
+
+    if (!err.Ok())
+        return err;
+
+    Guid chunkId;
+    err = chunkId.Generate();
+    if (!err.Ok())
+        return err;
+
+    err = ChunkCreate(chunkId);
+    if (!err.Ok())
+        return err;
+
+    //Overwrite drops buffered data, the next buffered write must not queue the chunk twice
+    err = ChunkWrite(chunkId, pages[0], Api::WriteDurabilityBuffered);
+    if (err.Ok())
+        err = ChunkWrite(chunkId, pages[1], Api::WriteDurabilityJournaled);
+    if (err.Ok())
+        err = ChunkWrite(chunkId, pages[2], Api::WriteDurabilityBuffered);
+    if (err.Ok())
+        err = FlushBuffered();
+    if (err.Ok())
+        err = TestCompareChunk(chunkId, pages[2]);
+
+    //Same for a chunk deleted and created again while buffered
+    if (err.Ok())
+        err = ChunkWrite(chunkId, pages[0], Api::WriteDurabilityBuffered);
+    if (err.Ok())
+        err = ChunkDelete(chunkId);
+    if (err.Ok())
+        err = ChunkCreate(chunkId);
+    if (err.Ok())
+        err = ChunkWrite(chunkId, pages[1], Api::WriteDurabilityBuffered);
+    if (err.Ok())
+        err = FlushBuffered();
+    if (err.Ok())
+        err = TestCompareChunk(chunkId, pages[1]);
+
+    ChunkDelete(chunkId);
+
+    trace(1, "Test buffered write, err %d", err.GetCode());
+
+    return err;
+}
+
+Core::Error Volume::TestJournalUnload()
+{
+    Core::SharedAutoLock lock(Lock);
+    if (State != VolumeStateRunning)
+        return MakeError(Core::Error::InvalidState);
+
+    trace(1, "Test journal unload");
+
+    auto tx = TxJournal.BeginTx();
+    if (tx.Get() == nullptr)
+        return MakeError(Core::Error::NoMemory);
+
+    uint64_t extent;
+    auto err = Balloc.Alloc(extent);
+    if (!err.Ok())
+    {
+        tx->Cancel();
+        return err;
+    }
+
+    uint64_t position;
+    err = ExtentToPosition(extent, position);
+    if (!err.Ok())
+    {
+        tx->Cancel();
+        Balloc.Free(extent);
+        return err;
+    }
+
+    auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
+    if (err.Ok())
+    {
+        page->FillRandom();
+        err = tx->Write(page, position);
+    }
+
+    if (!err.Ok())
+    {
+        tx->Cancel();
+        Balloc.Free(extent);
+        return err;
+    }
+
+    Core::AString name("kstor-jtest", err);
+    if (!err.Ok())
+    {
+        tx->Cancel();
+        Balloc.Free(extent);
+        return err;
+    }
+
+    //Commit waits for log space until unload fails it
+    TxJournal.SetThrottled(true);
+
+    JournalTxCommitter committer(tx);
+    Core::Thread thread(name, &committer, err);
+    if (!err.Ok())
+    {
+        TxJournal.SetThrottled(false);
+        tx->Cancel();
+        Balloc.Free(extent);
+        return err;
+    }
+
+    Core::Thread::Sleep(100);
+    if (committer.GetStatus().GetCode() != Core::Error::NotExecuted)
+    {
+        trace(0, "Test journal unload, tx isn't throttled, err %d", committer.GetStatus().GetCode());
+        err = MakeError(Core::Error::Unsuccessful);
+    }
+
+    auto unloadErr = TxJournal.Unload();
+    thread.Wait();
+    Balloc.Free(extent);
+
+    if (err.Ok() && !unloadErr.Ok())
+        err = unloadErr;
+
+    if (err.Ok() && committer.GetStatus().Ok())
+    {
+        trace(0, "Test journal unload, throttled tx committed");
+        err = MakeError(Core::Error::Unsuccessful);
+    }
+
+    trace(1, "Test journal unload, err %d commit err %d", err.GetCode(), committer.GetStatus().GetCode());
+
+    return err;
+}
+
+Core::Error Volume::TestJournalApply()
+{
+    Core::SharedAutoLock lock(Lock);
+    if (State != VolumeStateRunning)
+        return MakeError(Core::Error::InvalidState);
+
+    trace(1, "Test journal apply");
+
+    uint64_t extent;
+    auto err = Balloc.Alloc(extent);
+    if (!err.Ok())
+        return err;
+
+    uint64_t position;
+    err = ExtentToPosition(extent, position);
+    if (!err.Ok())
+    {
+        Balloc.Free(extent);
+        return err;
+    }
+
+    //More blocks than one drain takes, each extent page is written many times
+    //so the later writes must land after the earlier ones
+    const size_t slotCount = Api::ChunkSize / Api::PageSize;
+    Core::Page<Core::Memory::PoolType::NoIO>::Ptr expected[slotCount];
+    {
+        JournalApplier applier(TxJournal);
+        for (size_t i = 0; i < JournalApplyMaxBios + 2 * slotCount; i++)
+        {
+            auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
+            if (!err.Ok())
+                break;
+
+            page->FillRandom();
+            size_t slot = i % slotCount;
+            err = applier.Add(JournalDataBlock(position + slot * Api::PageSize, page));
+            if (!err.Ok())
+                break;
+
+            expected[slot] = page;
+        }
+
+        if (err.Ok())
+            err = applier.Complete(true);
+    }
+
+    for (size_t i = 0; i < slotCount && err.Ok(); i++)
+    {
+        auto page = Core::Page<Core::Memory::PoolType::NoIO>::Create(err);
+        if (!err.Ok())
+            break;
+
+        err = Core::NoIOBioList(GetDevice()).SubmitWaitResult(page, position + i * Api::PageSize, false);
+        if (!err.Ok())
+            break;
+
+        if (page->CompareContent(*expected[i].Get()) != 0)
+        {
+            trace(0, "Test journal apply, page %lu mismatch", i);
+            err = MakeError(Core::Error::DataCorrupt);
+        }
+    }
+
+    Balloc.Free(extent);
+
+    trace(1, "Test journal apply, err %d", err.GetCode());
+
+    return err;
+}
+
 }
\ No newline at end of file
@@ -6,13 +6,22 @@
 #include <core/shared_ptr.h>
 #include <core/astring.h>
 #include <core/page.h>
+#include <core/page_vector.h>
 #include <core/hash_table.h>
 #include <core/rwsem.h>
+#include <core/unique_ptr.h>
+#include <core/thread.h>
+#include <core/runnable.h>
+#include <core/event.h>
+#include <core/list.h>
 
 #include "guid.h"
 #include "chunk.h"
 #include "journal.h"
 #include "block_allocator.h"
+#include "chunk_index.h"
+#include "io_scheduler.h"
+#include "readahead.h"
 
 namespace KStor 
 {
@@ -22,13 +31,57 @@ const unsigned int VolumeStateRunning = 2;
 const unsigned int VolumeStateStopping = 3;
 const unsigned int VolumeStateStopped = 4;
 
+const uint64_t VolumeInvalidExtent = ~static_cast<uint64_t>(0);
+
+const uint64_t VolumeMaxExtentAlignment = 1024 * 1024;
+
+const size_t VolumeMaxBufferedChunks = 64;
+const unsigned long VolumeFlushIntervalMs = 50;
+
+class Volume;
+
+class VolumeFlusher : public Core::Runnable
+{
+public:
+    VolumeFlusher(Volume& volume);
+    virtual ~VolumeFlusher();
+
+private:
+    VolumeFlusher(const VolumeFlusher& other) = delete;
+    VolumeFlusher(VolumeFlusher&& other) = delete;
+    VolumeFlusher& operator=(const VolumeFlusher& other) = delete;
+    VolumeFlusher& operator=(VolumeFlusher&& other) = delete;
+
+    Core::Error Run(const Core::Threadable& thread) override;
+
+    Volume& VolumeRef;
+};
+
+struct VolumeFlushEntry
+{
+    VolumeFlushEntry()
+        : Extent(VolumeInvalidExtent)
+    {
+    }
+
+    VolumeFlushEntry(const Chunk::Ptr& chunk, uint64_t extent)
+        : ChunkRef(chunk)
+        , Extent(extent)
+    {
+    }
+
+    Chunk::Ptr ChunkRef;
+    uint64_t Extent;
+};
+
 class Volume
 {
+friend VolumeFlusher;
 public:
 
     using Ptr = Core::SharedPtr<Volume>;
 
-    Volume(const Core::AString& deviceName, Core::Error& err);
+    Volume(const Core::AString& deviceName, const Core::AString& journalDeviceName, Core::Error& err);
     virtual ~Volume();
 
     Core::Error Format();
@@ -44,11 +97,17 @@ public:
 
     Core::BlockDevice& GetDevice();
 
+    Core::BlockDevice& GetJournalDevice();
+
+    bool HasExternalJournal() const;
+
+    IoScheduler& GetIoScheduler();
+
     Core::Error ChunkCreate(const Guid& chunkId);
 
-    Core::Error ChunkWrite(const Guid& chunkId, unsigned char data[Api::ChunkSize]);
+    Core::Error ChunkWrite(const Guid& chunkId, const Core::PageVector<>::Ptr& pages, unsigned int durability);
 
-    Core::Error ChunkRead(const Guid& chunkId, unsigned char data[Api::ChunkSize]);
+    Core::Error ChunkRead(const Guid& chunkId, Core::PageVector<>::Ptr& pages, ReadStream* stream = nullptr);
 
     Core::Error ChunkDelete(const Guid& chunkId);
 
@@ -56,15 +115,54 @@ public:
 
     Core::Error TestJournal();
 
+    //Leaves the journal unloaded, the volume has to be remounted
+    Core::Error TestJournalUnload();
+
+    Core::Error TestBufferedWrite();
+
+    Core::Error TestJournalApply();
+
 private:
+    Core::Error CheckDeviceLimits(Core::BlockDevice& device);
+    uint64_t GetExtentAlignment();
+    Core::Error LoadChunks();
+    Core::Error ExtentToPosition(uint64_t extent, uint64_t& position);
+    Core::Error WriteExtent(uint64_t extent, const Core::PageVector<>::Ptr& pages, unsigned int ioClass);
+    Core::Error ReadExtent(uint64_t extent, Core::PageVector<>::Ptr& pages);
+    void ReadAhead(ReadStream& stream, uint64_t extent);
+    Core::Error CommitIndex(const Guid& chunkId, uint64_t extent, unsigned int flags,
+        uint64_t oldExtent, unsigned int oldFlags, unsigned int durability = Api::WriteDurabilityApplied);
+
+    Core::Error BufferWrite(const Chunk::Ptr& chunk, const Core::PageVector<>::Ptr& pages);
+    void DropBuffered(const Chunk::Ptr& chunk);
+    void RequeueBuffered(const Chunk::Ptr& chunk);
+    Core::Error FlushBuffered();
+    Core::Error TestCompareChunk(const Guid& chunkId, const Core::PageVector<>::Ptr& expected);
+    Core::Error StartFlushThread();
+    void StopFlushThread();
+    Core::Error RunFlush(const Core::Threadable& thread);
+
     Core::AString DeviceName;
     Core::BlockDevice Device;
+    Core::UniquePtr<Core::BlockDevice> JournalDevice;
+    IoScheduler Scheduler;
+    ReadaheadCache Readahead;
     Guid VolumeId;
     Core::HashTable<Guid, Chunk::Ptr, 512, Core::RWSem> ChunkTable;
     uint64_t Size;
     uint64_t BlockSize;
+    uint64_t IndexStart;
+    uint64_t IndexSize;
+    uint64_t ExtentCount;
     Journal TxJournal;
     BlockAllocator Balloc;
+    ChunkIndex Index;
+    Core::RWSem IndexLock;
+    VolumeFlusher Flusher;
+    Core::UniquePtr<Core::Thread> FlushThread;
+    Core::LinkedList<Chunk::Ptr> BufferedList;
+    Core::RWSem BufferedLock;
+    Core::Event FlushEvent;
     Core::RWSem Lock;
     unsigned int State;
 };
@@ -12,6 +12,9 @@
 #include <linux/preempt.h>
 #include <linux/highmem.h>
 #include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/mempool.h>
+#include <linux/ioprio.h>
 #include <linux/version.h>
 #include <linux/fs.h>
 #include <linux/file.h>
@@ -37,6 +40,8 @@ _Static_assert(sizeof(struct kapi_completion) >= sizeof(struct completion),
               "Bad size");
 _Static_assert(sizeof(struct kapi_rwsem) >= sizeof(struct rw_semaphore),
               "Bad size");
+_Static_assert(sizeof(struct kapi_blk_plug) >= sizeof(struct blk_plug),
+              "Bad size");
 
 _Static_assert(sizeof(unsigned int) == 4, "Bad size");
 
@@ -181,6 +186,11 @@ static void kapi_completion_init(void *comp)
     init_completion((struct completion *)comp);
 }
 
+static void kapi_completion_reinit(void *comp)
+{
+    reinit_completion((struct completion *)comp);
+}
+
 static void kapi_completion_wait(void *comp)
 {
     wait_for_completion((struct completion *)comp);
@@ -257,6 +267,11 @@ static void kapi_msleep(unsigned int msecs)
     msleep(msecs);
 }
 
+static void kapi_cond_resched(void)
+{
+    cond_resched();
+}
+
 static void* kapi_spinlock_create(unsigned long pool_type)
 {
     spinlock_t *lock;
@@ -332,6 +347,11 @@ static void kapi_put_online_cpus(void)
     put_online_cpus();
 }
 
+static int kapi_get_online_cpu_count(void)
+{
+    return num_online_cpus();
+}
+
 static void kapi_preempt_disable(void)
 {
     preempt_disable();
@@ -440,6 +460,23 @@ static int kapi_get_page_size(void)
     return PAGE_SIZE;
 }
 
+static void *kapi_alloc_pages(unsigned int order, unsigned long pool_type)
+{
+    //Caller falls back to single pages, so don't try hard
+    return alloc_pages(kapi_get_gfp_flags(pool_type) | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY,
+                       order);
+}
+
+static void kapi_free_pages(void *page, unsigned int order)
+{
+    __free_pages((struct page *)page, order);
+}
+
+static void *kapi_get_nth_page(void *page, unsigned long index)
+{
+    return nth_page((struct page *)page, index);
+}
+
 static fmode_t kapi_get_fmode_by_mode(int mode)
 {
     fmode_t fmode = 0;
@@ -478,16 +515,64 @@ static unsigned long long kapi_bdev_get_size(void* bdev)
     return i_size_read(((struct block_device*)bdev)->bd_inode);
 }
 
-static void* kapi_alloc_bio(int page_count, unsigned long pool_type)
+static unsigned int kapi_bdev_get_max_segments(void* bdev)
+{
+    return queue_max_segments(bdev_get_queue((struct block_device*)bdev));
+}
+
+static unsigned int kapi_bdev_get_max_sectors(void* bdev)
+{
+    return queue_max_sectors(bdev_get_queue((struct block_device*)bdev));
+}
+
+static bool kapi_bdev_poll_capable(void* bdev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+    return (bdev_get_queue((struct block_device*)bdev)->limits.features & BLK_FEAT_POLL) != 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    return test_bit(QUEUE_FLAG_POLL, &bdev_get_queue((struct block_device*)bdev)->queue_flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+    struct request_queue* q = bdev_get_queue((struct block_device*)bdev);
+
+    return q->mq_ops && test_bit(QUEUE_FLAG_POLL, &q->queue_flags);
+#else
+    return false;
+#endif
+}
+
+static unsigned int kapi_bdev_get_logical_block_size(void* bdev)
+{
+    return bdev_logical_block_size((struct block_device*)bdev);
+}
+
+static unsigned int kapi_bdev_get_physical_block_size(void* bdev)
+{
+    return bdev_physical_block_size((struct block_device*)bdev);
+}
+
+static unsigned int kapi_bdev_get_io_min(void* bdev)
+{
+    return bdev_io_min((struct block_device*)bdev);
+}
+
+static unsigned int kapi_bdev_get_io_opt(void* bdev)
+{
+    return bdev_io_opt((struct block_device*)bdev);
+}
+
+static unsigned int kapi_bdev_get_atomic_write_max(void* bdev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+    return queue_atomic_write_unit_max_bytes(bdev_get_queue((struct block_device*)bdev));
+#else
+    return 0;
+#endif
+}
+
+static void kapi_init_bio(struct bio* bio)
 {
-    struct bio* bio;
     int i;
 
-    bio = bio_alloc(kapi_get_gfp_flags(pool_type), page_count);
-    if (!bio)
-    {
-        return NULL;
-    }
     bio->bi_iter.bi_size = 0;
     bio->bi_iter.bi_sector = 0;
     bio->bi_vcnt = 0;
@@ -497,8 +582,6 @@ static void* kapi_alloc_bio(int page_count, unsigned long pool_type)
         bio->bi_io_vec[i].bv_offset = 0;
         bio->bi_io_vec[i].bv_len = 0;
     }
-
-    return bio;
 }
 
 struct kapi_bio_private
@@ -506,8 +589,88 @@ struct kapi_bio_private
     void* bio;
     void* priv;
     void (*bio_end_io)(void* bio, int err);
+    /* Lives in the bio_set front pad rather than in kapi_bio_private_pool */
+    int front_pad;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+    blk_qc_t cookie;
+#endif
 };
 
+/* Private data of bios allocated outside of a bio_set */
+static mempool_t* kapi_bio_private_pool;
+
+#define KAPI_BIO_PRIVATE_POOL_SIZE 256
+
+static void* kapi_alloc_bio(int page_count, unsigned long pool_type)
+{
+    struct bio* bio;
+
+    bio = bio_alloc(kapi_get_gfp_flags(pool_type), page_count);
+    if (!bio)
+    {
+        return NULL;
+    }
+    kapi_init_bio(bio);
+
+    return bio;
+}
+
+static void* kapi_bio_set_create(unsigned int pool_size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+    return bioset_create(pool_size, sizeof(struct kapi_bio_private), BIOSET_NEED_BVECS);
+#else
+    return bioset_create(pool_size, sizeof(struct kapi_bio_private));
+#endif
+}
+
+static void kapi_bio_set_delete(void* bio_set)
+{
+    bioset_free((struct bio_set*)bio_set);
+}
+
+static void* kapi_alloc_bio_from_set(void* bio_set, int page_count, unsigned long pool_type)
+{
+    struct bio* bio;
+    struct kapi_bio_private* priv;
+
+    bio = bio_alloc_bioset(kapi_get_gfp_flags(pool_type), page_count, (struct bio_set*)bio_set);
+    if (!bio)
+    {
+        return NULL;
+    }
+    kapi_init_bio(bio);
+
+    /* The set reserves front pad right before each bio */
+    priv = (struct kapi_bio_private*)((char*)bio - sizeof(*priv));
+    memset(priv, 0, sizeof(*priv));
+    priv->bio = bio;
+    priv->front_pad = 1;
+    bio->bi_private = priv;
+
+    return bio;
+}
+
+static void* kapi_page_pool_create(int min_pages)
+{
+    return mempool_create_page_pool(min_pages, 0);
+}
+
+static void kapi_page_pool_delete(void* page_pool)
+{
+    mempool_destroy((mempool_t*)page_pool);
+}
+
+static void* kapi_page_pool_alloc(void* page_pool, unsigned long pool_type)
+{
+    return mempool_alloc((mempool_t*)page_pool, kapi_get_gfp_flags(pool_type));
+}
+
+static void kapi_page_pool_free(void* page_pool, void* page)
+{
+    mempool_free(page, (mempool_t*)page_pool);
+}
+
 static struct kapi_bio_private* kapi_get_bio_private_(struct bio* bio)
 {
     struct bio* bio_ = (struct bio*)bio;
@@ -531,7 +694,10 @@ static void kapi_free_bio(void* bio)
     priv = kapi_get_bio_private_(bio_);
     if (priv)
     {
-        kapi_kfree(priv);
+        if (!priv->front_pad)
+        {
+            mempool_free(priv, kapi_bio_private_pool);
+        }
         bio_->bi_private = NULL;
     }
 
@@ -579,7 +745,7 @@ static struct kapi_bio_private* kapi_get_or_create_bio_private(struct bio* bio)
         return priv;
     }
 
-    priv = (struct kapi_bio_private*)kapi_kmalloc_gfp(sizeof(*priv), GFP_NOIO);
+    priv = (struct kapi_bio_private*)mempool_alloc(kapi_bio_private_pool, GFP_NOIO);
     if (!priv)
     {
         return NULL;
@@ -650,6 +816,30 @@ static void kapi_set_bio_position(void* bio, unsigned long long sector)
     bio_->bi_iter.bi_sector = sector;
 }
 
+static void kapi_set_bio_prio(void* bio, int prio_class, int prio_level)
+{
+    struct bio* bio_ = (struct bio*)bio;
+    int class_;
+
+    switch (prio_class)
+    {
+    case KAPI_BIO_PRIO_CLASS_RT:
+        class_ = IOPRIO_CLASS_RT;
+        break;
+    case KAPI_BIO_PRIO_CLASS_BE:
+        class_ = IOPRIO_CLASS_BE;
+        break;
+    case KAPI_BIO_PRIO_CLASS_IDLE:
+        class_ = IOPRIO_CLASS_IDLE;
+        break;
+    default:
+        class_ = IOPRIO_CLASS_NONE;
+        break;
+    }
+
+    bio_set_prio(bio_, IOPRIO_PRIO_VALUE(class_, prio_level));
+}
+
 static void* kapi_get_bio_private(void* bio)
 {
     struct bio* bio_ = (struct bio*)bio;
@@ -691,6 +881,13 @@ static unsigned int kapi_get_bio_op_flags(unsigned int op_flags)
         result |= REQ_SYNC;
     if (op_flags & KAPI_BIO_REQ_PREFLUSH)
         result |= REQ_PREFLUSH;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    if (op_flags & KAPI_BIO_REQ_POLLED)
+        result |= REQ_POLLED;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+    if (op_flags & KAPI_BIO_REQ_POLLED)
+        result |= REQ_HIPRI;
+#endif
 
     return result;
 }
@@ -734,12 +931,74 @@ static int kapi_get_bio_rw(unsigned int op, unsigned int op_flags)
 static void kapi_submit_bio(void* bio, unsigned int op, unsigned int op_flags)
 {
     struct bio* bio_ = (struct bio*)bio;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+    struct kapi_bio_private* priv_ = kapi_get_bio_private_(bio_);
+    blk_qc_t cookie;
+
+    /* bio_poll() finds the request by itself, older kernels poll by the submit cookie */
+    if (priv_)
+        priv_->cookie = BLK_QC_T_NONE;
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
     bio_set_op_attrs(bio_, kapi_get_bio_op(op), kapi_get_bio_op_flags(op_flags));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+    cookie = submit_bio(bio_);
+#else
     submit_bio(bio_);
+#endif
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+    cookie = submit_bio(kapi_get_bio_rw(op, op_flags), bio_);
 #else
     submit_bio(kapi_get_bio_rw(op, op_flags), bio_);
 #endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+    /* bio and its private data are owned by the caller, so they outlive end_io */
+    if (priv_)
+        priv_->cookie = cookie;
+#endif
+}
+
+static int kapi_bio_poll(void* bio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    return bio_poll((struct bio*)bio, NULL, 0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+    struct bio* bio_ = (struct bio*)bio;
+    struct kapi_bio_private* priv_ = kapi_get_bio_private_(bio_);
+    struct request_queue* q;
+
+    /* Merged or not blk-mq, the caller falls back to waiting for the interrupt */
+    if (!priv_ || !blk_qc_t_valid(priv_->cookie))
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    q = bdev_get_queue(bio_->bi_bdev);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+    q = bio_->bi_disk->queue;
+#else
+    q = bdev_get_queue(bio_->bi_bdev);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+    return blk_poll(q, priv_->cookie, true);
+#else
+    return blk_poll(q, priv_->cookie) ? 1 : 0;
+#endif
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+static void kapi_blk_start_plug(void* plug)
+{
+    blk_start_plug((struct blk_plug*)plug);
+}
+
+static void kapi_blk_finish_plug(void* plug)
+{
+    blk_finish_plug((struct blk_plug*)plug);
 }
 
 static int kapi_vfs_file_open(const char *path, int flags, void** file)
@@ -1126,6 +1385,26 @@ static void kapi_sock_abort_accept(void *sockp)
     return ksock_abort_accept((struct socket *)sockp);
 }
 
+static int kapi_sock_recv_nonblock(void *sockp, void *buf, int len)
+{
+    return ksock_recv_nonblock((struct socket *)sockp, buf, len);
+}
+
+static int kapi_sock_send_page(void *sockp, void *page, int offset, int len, int more)
+{
+    return ksock_send_page((struct socket *)sockp, (struct page *)page, offset, len, more != 0);
+}
+
+static int kapi_sock_set_ready_callback(void *sockp, void (*ready)(void *ctx), void *ctx)
+{
+    return ksock_set_ready_callback((struct socket *)sockp, ready, ctx);
+}
+
+static void kapi_sock_clear_ready_callback(void *sockp)
+{
+    ksock_clear_ready_callback((struct socket *)sockp);
+}
+
 static unsigned int kapi_le32_to_cpu(unsigned int value)
 {
     return le32_to_cpu(value);
@@ -1240,6 +1519,7 @@ static struct kernel_api g_kapi =
 
     .completion_create = kapi_completion_create,
     .completion_init = kapi_completion_init,
+    .completion_reinit = kapi_completion_reinit,
     .completion_delete = kapi_completion_delete,
     .completion_wait = kapi_completion_wait,
     .completion_wait_timeout = kapi_completion_wait_timeout,
@@ -1255,6 +1535,7 @@ static struct kernel_api g_kapi =
     .task_get_pid = kapi_task_get_pid,
     .task_current = kapi_task_current,
     .msleep = kapi_msleep,
+    .cond_resched = kapi_cond_resched,
     .task_lookup = kapi_task_lookup,
     .task_stack_read = kapi_task_stack_read,
     .sprint_symbol = kapi_sprint_symbol,
@@ -1274,6 +1555,7 @@ static struct kernel_api g_kapi =
     .smp_call_function = kapi_smp_call_function,
     .get_online_cpus = kapi_get_online_cpus,
     .put_online_cpus = kapi_put_online_cpus,
+    .get_online_cpu_count = kapi_get_online_cpu_count,
     .preempt_disable = kapi_preempt_disable,
     .preempt_enable = kapi_preempt_enable,
     .smp_processor_id = kapi_smp_processor_id,
@@ -1291,12 +1573,23 @@ static struct kernel_api g_kapi =
     .unmap_page = kapi_unmap_page,
     .free_page = kapi_free_page,
     .get_page_size = kapi_get_page_size,
+    .alloc_pages = kapi_alloc_pages,
+    .free_pages = kapi_free_pages,
+    .get_nth_page = kapi_get_nth_page,
     .map_page_atomic = kapi_map_page_atomic,
     .unmap_page_atomic = kapi_unmap_page_atomic,
 
     .bdev_get_by_path = kapi_bdev_get_by_path,
     .bdev_put = kapi_bdev_put,
     .bdev_get_size = kapi_bdev_get_size,
+    .bdev_get_max_segments = kapi_bdev_get_max_segments,
+    .bdev_get_max_sectors = kapi_bdev_get_max_sectors,
+    .bdev_poll_capable = kapi_bdev_poll_capable,
+    .bdev_get_logical_block_size = kapi_bdev_get_logical_block_size,
+    .bdev_get_physical_block_size = kapi_bdev_get_physical_block_size,
+    .bdev_get_io_min = kapi_bdev_get_io_min,
+    .bdev_get_io_opt = kapi_bdev_get_io_opt,
+    .bdev_get_atomic_write_max = kapi_bdev_get_atomic_write_max,
 
     .alloc_bio = kapi_alloc_bio,
     .free_bio = kapi_free_bio,
@@ -1305,8 +1598,22 @@ static struct kernel_api g_kapi =
     .set_bio_bdev = kapi_set_bio_bdev,
     .set_bio_flags = kapi_set_bio_flags,
     .set_bio_position = kapi_set_bio_position,
+    .set_bio_prio = kapi_set_bio_prio,
     .get_bio_private = kapi_get_bio_private,
     .submit_bio = kapi_submit_bio,
+    .bio_poll = kapi_bio_poll,
+
+    .bio_set_create = kapi_bio_set_create,
+    .bio_set_delete = kapi_bio_set_delete,
+    .alloc_bio_from_set = kapi_alloc_bio_from_set,
+
+    .page_pool_create = kapi_page_pool_create,
+    .page_pool_delete = kapi_page_pool_delete,
+    .page_pool_alloc = kapi_page_pool_alloc,
+    .page_pool_free = kapi_page_pool_free,
+
+    .blk_start_plug = kapi_blk_start_plug,
+    .blk_finish_plug = kapi_blk_finish_plug,
 
     .vfs_file_open = kapi_vfs_file_open,
     .vfs_file_read = kapi_vfs_file_read,
@@ -1336,6 +1643,10 @@ static struct kernel_api g_kapi =
     .sock_recv = kapi_sock_recv,
     .sock_accept = kapi_sock_accept,
     .sock_abort_accept = kapi_sock_abort_accept,
+    .sock_recv_nonblock = kapi_sock_recv_nonblock,
+    .sock_send_page = kapi_sock_send_page,
+    .sock_set_ready_callback = kapi_sock_set_ready_callback,
+    .sock_clear_ready_callback = kapi_sock_clear_ready_callback,
 
     .le32_to_cpu = kapi_le32_to_cpu,
     .cpu_to_le32 = kapi_cpu_to_le32,
@@ -1370,12 +1681,24 @@ int kapi_init(void)
     if (r)
         goto deinit_malloc_checker;
 
+    kapi_bio_private_pool = mempool_create_kmalloc_pool(KAPI_BIO_PRIVATE_POOL_SIZE,
+        sizeof(struct kapi_bio_private));
+    if (!kapi_bio_private_pool)
+    {
+        r = -ENOMEM;
+        goto deinit_page_checker;
+    }
+
 #if defined(__DEBUG__) && defined(__UNIQUE_KEY__)
     unique_key_init();
 #endif
 
     return 0;
 
+deinit_page_checker:
+#if defined(__DEBUG__) && defined(__PAGE_CHECKER__)
+    page_checker_deinit();
+#endif
 deinit_malloc_checker:
 #if defined(__DEBUG__) && defined(__MALLOC_CHECKER__)
     malloc_checker_deinit();
@@ -1389,6 +1712,9 @@ void kapi_deinit(void)
     unique_key_deinit();
 #endif
 
+    mempool_destroy(kapi_bio_private_pool);
+    kapi_bio_private_pool = NULL;
+
 #if defined(__DEBUG__) && defined(__PAGE_CHECKER__)
     page_checker_deinit();
 #endif
@@ -28,6 +28,12 @@ extern "C"
 #define KAPI_BIO_REQ_FUA        0x1
 #define KAPI_BIO_REQ_SYNC       0x2
 #define KAPI_BIO_REQ_PREFLUSH   0x4
+#define KAPI_BIO_REQ_POLLED     0x8
+
+#define KAPI_BIO_PRIO_CLASS_NONE    0
+#define KAPI_BIO_PRIO_CLASS_RT      1
+#define KAPI_BIO_PRIO_CLASS_BE      2
+#define KAPI_BIO_PRIO_CLASS_IDLE    3
 
 #define KAPI_VFS_FILE_RDONLY    0x1
 #define KAPI_VFS_FILE_WRONLY    0x2
@@ -55,6 +61,11 @@ struct kapi_rwsem
     unsigned long value[5];
 };
 
+struct kapi_blk_plug
+{
+    unsigned long value[8];
+};
+
 struct kernel_api
 {
     void *(*kmalloc)(size_t size, unsigned long pool_type);
@@ -77,6 +88,7 @@ struct kernel_api
 
     void* (*completion_create)(unsigned long pool_type);
     void (*completion_init)(void *completion);
+    void (*completion_reinit)(void *completion);
     void (*completion_delete)(void *completion);
     void (*completion_wait)(void *completion);
     void (*completion_wait_timeout)(void *completion, unsigned long timeout);
@@ -97,6 +109,7 @@ struct kernel_api
     int (*sprint_symbol)(char *buf, unsigned long address);
 
     void (*msleep)(unsigned int msecs);
+    void (*cond_resched)(void);
 
     void* (*spinlock_create)(unsigned long pool_type);
     void (*spinlock_init)(void* spinlock);
@@ -115,6 +128,7 @@ struct kernel_api
                               bool wait);
     void (*get_online_cpus)(void);
     void (*put_online_cpus)(void);
+    int (*get_online_cpu_count)(void);
     void (*preempt_disable)(void);
     void (*preempt_enable)(void);
     int (*smp_processor_id)(void);
@@ -136,9 +150,21 @@ struct kernel_api
     void (*free_page)(void *page);
     int (*get_page_size)(void);
 
+    void *(*alloc_pages)(unsigned int order, unsigned long pool_type);
+    void (*free_pages)(void *page, unsigned int order);
+    void *(*get_nth_page)(void *page, unsigned long index);
+
     int (*bdev_get_by_path)(const char *path, int mode, void *holder, void **pbdev);
     void (*bdev_put)(void *bdev, int mode);
     unsigned long long (*bdev_get_size)(void* bdev);
+    unsigned int (*bdev_get_max_segments)(void* bdev);
+    unsigned int (*bdev_get_max_sectors)(void* bdev);
+    bool (*bdev_poll_capable)(void* bdev);
+    unsigned int (*bdev_get_logical_block_size)(void* bdev);
+    unsigned int (*bdev_get_physical_block_size)(void* bdev);
+    unsigned int (*bdev_get_io_min)(void* bdev);
+    unsigned int (*bdev_get_io_opt)(void* bdev);
+    unsigned int (*bdev_get_atomic_write_max)(void* bdev);
 
     void* (*alloc_bio)(int page_count, unsigned long pool_type);
     void (*free_bio)(void* bio);
@@ -147,8 +173,22 @@ struct kernel_api
     void (*set_bio_bdev)(void* bio, void* bdev);
     void (*set_bio_flags)(void* bio, int flags);
     void (*set_bio_position)(void* bio, unsigned long long sector);
+    void (*set_bio_prio)(void* bio, int prio_class, int prio_level);
     void* (*get_bio_private)(void* bio);
     void (*submit_bio)(void* bio, unsigned int op, unsigned int op_flags);
+    int (*bio_poll)(void* bio);
+
+    void* (*bio_set_create)(unsigned int pool_size);
+    void (*bio_set_delete)(void* bio_set);
+    void* (*alloc_bio_from_set)(void* bio_set, int page_count, unsigned long pool_type);
+
+    void* (*page_pool_create)(int min_pages);
+    void (*page_pool_delete)(void* page_pool);
+    void* (*page_pool_alloc)(void* page_pool, unsigned long pool_type);
+    void (*page_pool_free)(void* page_pool, void* page);
+
+    void (*blk_start_plug)(void* plug);
+    void (*blk_finish_plug)(void* plug);
 
     int (*vfs_file_open)(const char *path, int flags, void** file);
     int (*vfs_file_write)(void* file, const void* buf, unsigned long len, unsigned long long offset);
@@ -180,6 +220,10 @@ struct kernel_api
     int (*sock_recv)(void *sockp, void *buf, int len);
     int (*sock_accept)(void **newsockp, void *sockp);
     void (*sock_abort_accept)(void *sockp);
+    int (*sock_recv_nonblock)(void *sockp, void *buf, int len);
+    int (*sock_send_page)(void *sockp, void *page, int offset, int len, int more);
+    int (*sock_set_ready_callback)(void *sockp, void (*ready)(void *ctx), void *ctx);
+    void (*sock_clear_ready_callback)(void *sockp);
 
     unsigned int (*le32_to_cpu)(unsigned int value);
     unsigned int (*cpu_to_le32)(unsigned int value);
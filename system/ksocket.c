@@ -8,6 +8,9 @@
 #include <linux/net.h>
 #include <linux/in.h>
 #include <linux/in6.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
 
 u16 ksock_peer_port(struct socket *sock)
 {
@@ -437,6 +440,143 @@ out:
 	return error;
 }
 
+int ksock_recv_nonblock(struct socket *sock, void *buf, int len)
+{
+	struct kvec iov = {
+		.iov_base = buf,
+		.iov_len = len
+	};
+	struct msghdr msg;
+	int r;
+
+	memset(&msg, 0, sizeof(msg));
+	r = kernel_recvmsg(sock, &msg, &iov, 1, len, MSG_DONTWAIT);
+	if (r == 0)
+		return -ECONNRESET;
+
+	return r;
+}
+
+int ksock_send_page(struct socket *sock, struct page *page, int offset, int len,
+	bool more)
+{
+	int flags = more ? MSG_MORE : 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	struct bio_vec bvec;
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_flags = MSG_SPLICE_PAGES | flags;
+	bvec_set_page(&bvec, page, len, offset);
+	iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, &bvec, 1, len);
+	return sock_sendmsg(sock, &msg);
+#else
+	return kernel_sendpage(sock, page, offset, len, flags);
+#endif
+}
+
+struct ksock_ready_callback {
+	void (*ready)(void *ctx);
+	void *ctx;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+	void (*orig_data_ready)(struct sock *sk);
+#else
+	void (*orig_data_ready)(struct sock *sk, int bytes);
+#endif
+	void (*orig_state_change)(struct sock *sk);
+};
+
+static void ksock_call_ready(struct sock *sk)
+{
+	struct ksock_ready_callback *cb = sk->sk_user_data;
+
+	if (cb)
+		cb->ready(cb->ctx);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+static void ksock_data_ready(struct sock *sk)
+#else
+static void ksock_data_ready(struct sock *sk, int bytes)
+#endif
+{
+	struct ksock_ready_callback *cb;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	cb = sk->sk_user_data;
+	if (cb) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+		cb->orig_data_ready(sk);
+#else
+		cb->orig_data_ready(sk, bytes);
+#endif
+	}
+	ksock_call_ready(sk);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void ksock_state_change(struct sock *sk)
+{
+	struct ksock_ready_callback *cb;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	cb = sk->sk_user_data;
+	if (cb)
+		cb->orig_state_change(sk);
+	ksock_call_ready(sk);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/*
+ * ready() runs in softirq context on incoming data or a state change
+ * (peer close, reset) and must not sleep.
+ */
+int ksock_set_ready_callback(struct socket *sock, void (*ready)(void *ctx), void *ctx)
+{
+	struct sock *sk = sock->sk;
+	struct ksock_ready_callback *cb;
+
+	cb = kmalloc(sizeof(*cb), GFP_KERNEL);
+	if (!cb)
+		return -ENOMEM;
+
+	cb->ready = ready;
+	cb->ctx = ctx;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	if (sk->sk_user_data) {
+		write_unlock_bh(&sk->sk_callback_lock);
+		kfree(cb);
+		return -EBUSY;
+	}
+	cb->orig_data_ready = sk->sk_data_ready;
+	cb->orig_state_change = sk->sk_state_change;
+	sk->sk_user_data = cb;
+	sk->sk_data_ready = ksock_data_ready;
+	sk->sk_state_change = ksock_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+	return 0;
+}
+
+/*
+ * After return no ready() call is running or will be made.
+ */
+void ksock_clear_ready_callback(struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+	struct ksock_ready_callback *cb;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	cb = sk->sk_user_data;
+	if (cb) {
+		sk->sk_data_ready = cb->orig_data_ready;
+		sk->sk_state_change = cb->orig_state_change;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+	kfree(cb);
+}
+
 void ksock_abort_accept(struct socket *sock)
 {
 	wake_up_all(sk_sleep(sock->sk));
@@ -39,6 +39,15 @@ int ksock_listen(struct socket **sockp, __u32 local_ip, int local_port,
 
 int ksock_accept(struct socket **newsockp, struct socket *sock);
 
+int ksock_recv_nonblock(struct socket *sock, void *buf, int len);
+
+int ksock_send_page(struct socket *sock, struct page *page, int offset, int len,
+	bool more);
+
+int ksock_set_ready_callback(struct socket *sock, void (*ready)(void *ctx), void *ctx);
+
+void ksock_clear_ready_callback(struct socket *sock);
+
 void ksock_abort_accept(struct socket *sock);
 
 int ksock_ioctl(struct socket *sock, int cmd, unsigned long arg);